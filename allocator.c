@@ -0,0 +1,210 @@
+#include "allocator.h"
+#include "stats.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+// blocks spanning a few of these get transparent huge pages
+#define HUGE_PAGE_SIZE (2 << 20)
+
+typedef struct {
+  MemoryContext *context;
+  void *base;
+  size_t size;
+  void (*free)(void *user, void *ptr);
+  void *user;
+} BlockHeader;
+
+// the header sits in the alignment slot in front of every block
+typedef char
+    header_fits_alignment[sizeof(BlockHeader) <= STITCH_ALIGNMENT ? 1 : -1];
+
+static void *aligned_from_raw(unsigned char *raw, size_t alignment) {
+  if (!raw)
+    return NULL;
+  uintptr_t aligned =
+      ((uintptr_t)raw + sizeof(void *) + alignment - 1) & ~(alignment - 1);
+  ((void **)aligned)[-1] = raw;
+  return (void *)aligned;
+}
+
+/*
+ * Pyramid levels and accumulators are walked row by row with strides of a
+ * full canvas width, which misses the TLB on every row with 4K pages. The
+ * advice has to come before the first touch, which for fresh mappings is
+ * whoever writes the block first.
+ */
+static unsigned char *advise_huge_pages(unsigned char *raw, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (raw && size >= 2 * HUGE_PAGE_SIZE) {
+    uintptr_t start = ((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                      ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    uintptr_t end = ((uintptr_t)raw + size) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start)
+      madvise((void *)start, end - start, MADV_HUGEPAGE);
+  }
+#endif
+  return raw;
+}
+
+static void *default_alloc(void *user, size_t size, size_t alignment) {
+  (void)user;
+  size_t total = size + alignment + sizeof(void *);
+  return aligned_from_raw(
+      advise_huge_pages((unsigned char *)malloc(total), total), alignment);
+}
+
+// calloc keeps the lazily zeroed pages the OS hands out for large blocks
+static void *default_calloc(void *user, size_t size, size_t alignment) {
+  (void)user;
+  size_t total = size + alignment + sizeof(void *);
+  return aligned_from_raw(
+      advise_huge_pages((unsigned char *)calloc(total, 1), total), alignment);
+}
+
+static void default_free(void *user, void *ptr) {
+  (void)user;
+  if (ptr)
+    free(((void **)ptr)[-1]);
+}
+
+static const StitchAllocator DEFAULT_ALLOCATOR = {default_alloc, default_calloc,
+                                                  default_free, NULL};
+
+static MemoryContext process_context = {
+    {default_alloc, default_calloc, default_free, NULL}, 0, 0, 0, 0, 0};
+
+static __thread MemoryContext *active_memory = NULL;
+
+static MemoryUsage usage_of(const MemoryContext *context) {
+  MemoryUsage usage;
+  usage.current_bytes =
+      __atomic_load_n(&context->current_bytes, __ATOMIC_RELAXED);
+  usage.peak_bytes = __atomic_load_n(&context->peak_bytes, __ATOMIC_RELAXED);
+  usage.limit_bytes = context->limit_bytes;
+  usage.alloc_calls = __atomic_load_n(&context->alloc_calls, __ATOMIC_RELAXED);
+  usage.failed_calls =
+      __atomic_load_n(&context->failed_calls, __ATOMIC_RELAXED);
+  return usage;
+}
+
+void set_default_allocator(const StitchAllocator *allocator) {
+  process_context.allocator = allocator ? *allocator : DEFAULT_ALLOCATOR;
+}
+
+MemoryUsage get_process_memory_usage(void) {
+  return usage_of(&process_context);
+}
+
+MemoryContext *create_memory_context(const StitchAllocator *allocator,
+                                     size_t limit_bytes) {
+  MemoryContext *context =
+      (MemoryContext *)stitch_calloc(1, sizeof(MemoryContext));
+  if (!context)
+    return NULL;
+  context->allocator = allocator ? *allocator : process_context.allocator;
+  context->limit_bytes = limit_bytes;
+  return context;
+}
+
+void destroy_memory_context(MemoryContext *context) {
+  if (context && context != &process_context) {
+    stitch_free(context);
+  }
+}
+
+MemoryUsage memory_context_usage(const MemoryContext *context) {
+  return usage_of(context ? context : &process_context);
+}
+
+MemoryContext *memory_activate(MemoryContext *context) {
+  MemoryContext *previous = active_memory;
+  active_memory = context;
+  return previous;
+}
+
+MemoryContext *memory_active(void) { return active_memory; }
+
+MemoryContext *memory_context_of(const void *ptr) {
+  if (!ptr)
+    return active_memory;
+  return ((const BlockHeader *)ptr - 1)->context;
+}
+
+int memory_has_calloc(void) {
+  MemoryContext *context = active_memory ? active_memory : &process_context;
+  return context->allocator.calloc != NULL;
+}
+
+static int reserve(MemoryContext *context, size_t size) {
+  size_t current =
+      __atomic_add_fetch(&context->current_bytes, size, __ATOMIC_RELAXED);
+  if (context->limit_bytes && current > context->limit_bytes) {
+    __atomic_sub_fetch(&context->current_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&context->failed_calls, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  size_t peak = __atomic_load_n(&context->peak_bytes, __ATOMIC_RELAXED);
+  while (current > peak &&
+         !__atomic_compare_exchange_n(&context->peak_bytes, &peak, current, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_add_fetch(&context->alloc_calls, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static void *allocate(size_t size, int zeroed) {
+  MemoryContext *context = active_memory ? active_memory : &process_context;
+  if (!reserve(context, size))
+    return NULL;
+
+  StitchAllocator *allocator = &context->allocator;
+  size_t total = size + STITCH_ALIGNMENT;
+  unsigned char *base;
+  if (zeroed && allocator->calloc) {
+    base = (unsigned char *)allocator->calloc(allocator->user, total,
+                                              STITCH_ALIGNMENT);
+  } else {
+    base = (unsigned char *)allocator->alloc(allocator->user, total,
+                                             STITCH_ALIGNMENT);
+    if (base && zeroed)
+      memset(base + STITCH_ALIGNMENT, 0, size);
+  }
+
+  if (!base) {
+    __atomic_sub_fetch(&context->current_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&context->failed_calls, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  BlockHeader *header = (BlockHeader *)(base + STITCH_ALIGNMENT) - 1;
+  header->context = context;
+  header->base = base;
+  header->size = size;
+  header->free = allocator->free;
+  header->user = allocator->user;
+
+  stats_record_alloc(size);
+  return base + STITCH_ALIGNMENT;
+}
+
+void *stitch_malloc(size_t size) { return allocate(size, 0); }
+
+void *stitch_calloc(size_t count, size_t size) {
+  if (size && count > SIZE_MAX / size)
+    return NULL;
+  return allocate(count * size, 1);
+}
+
+void stitch_free(void *ptr) {
+  if (!ptr)
+    return;
+  BlockHeader *header = (BlockHeader *)ptr - 1;
+  __atomic_sub_fetch(&header->context->current_bytes, header->size,
+                     __ATOMIC_RELAXED);
+  header->free(header->user, header->base);
+}
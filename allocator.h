@@ -0,0 +1,78 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef ALLOCATOR_HEADERS
+#define ALLOCATOR_HEADERS
+
+#include <stddef.h>
+
+/* Every buffer handed out by the library starts on this boundary. */
+#define STITCH_ALIGNMENT 64
+
+/*
+ * Allocation hooks. alloc must return memory aligned to at least
+ * `alignment` bytes. calloc is optional; when NULL the library zeroes the
+ * block returned by alloc. free receives the pointers returned by alloc or
+ * calloc.
+ */
+typedef struct
+{
+    void *(*alloc)(void *user, size_t size, size_t alignment);
+    void *(*calloc)(void *user, size_t size, size_t alignment);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} StitchAllocator;
+
+typedef struct
+{
+    size_t current_bytes;
+    size_t peak_bytes;
+    size_t limit_bytes;
+    unsigned long long alloc_calls;
+    unsigned long long failed_calls;
+} MemoryUsage;
+
+/*
+ * A memory context pairs an allocator with byte accounting and an optional
+ * limit. Allocations go to the context activated on the calling thread, or
+ * to the process context when none is active; frees always return the block
+ * to the context it came from.
+ */
+typedef struct
+{
+    StitchAllocator allocator;
+    size_t limit_bytes;
+    size_t current_bytes;
+    size_t peak_bytes;
+    unsigned long long alloc_calls;
+    unsigned long long failed_calls;
+} MemoryContext;
+
+void set_default_allocator(const StitchAllocator *allocator);
+MemoryUsage get_process_memory_usage(void);
+
+MemoryContext *create_memory_context(const StitchAllocator *allocator,
+                                     size_t limit_bytes);
+void destroy_memory_context(MemoryContext *context);
+MemoryUsage memory_context_usage(const MemoryContext *context);
+
+MemoryContext *memory_activate(MemoryContext *context);
+MemoryContext *memory_active(void);
+/* The context a library-allocated block is charged to. */
+MemoryContext *memory_context_of(const void *ptr);
+/*
+ * Whether the allocator of the active context zeroes blocks itself. When it
+ * does not, stitch_calloc clears every block on the calling thread.
+ */
+int memory_has_calloc(void);
+
+void *stitch_malloc(size_t size);
+void *stitch_calloc(size_t count, size_t size);
+void stitch_free(void *ptr);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,393 @@
+#include "blending.h"
+#include "kernels.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Micro-benchmarks for the image operators on synthetic images.
+ *
+ *   kernel_bench [--sizes 512,2048,4096] [--threads 1,2,4]
+ *                [--min-time 0.25] [--tmp kernel_bench.jpg]
+ *                [--kernels baseline|avx2|avx512]
+ *
+ * Every kernel runs at every size, channel count and thread count. Results
+ * are written to stdout as a single JSON document. Bytes are the estimated
+ * bytes read plus written by one call; speedup is relative to the first
+ * thread count in the sweep.
+ */
+
+#define MAX_SWEEP 16
+
+typedef struct BenchCase BenchCase;
+
+struct BenchCase {
+  const char *name;
+  int width;
+  int height;
+  int channels;
+  double bytes;
+  void (*setup)(BenchCase *c);
+  void (*run)(BenchCase *c);
+  void (*teardown)(BenchCase *c);
+
+  Image img;
+  Image mask;
+  ImageS img_s;
+  ImageS img_s2;
+  ImageS mask_s;
+  ImageF img_f;
+  ImageF out;
+  ImageF out_mask;
+  ImageS final_out;
+  const char *tmp_path;
+};
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_list(const char *arg, int *values) {
+  int n = 0;
+  while (*arg && n < MAX_SWEEP) {
+    values[n++] = atoi(arg);
+    const char *comma = strchr(arg, ',');
+    if (!comma)
+      break;
+    arg = comma + 1;
+  }
+  return n;
+}
+
+static void fill_image(Image *img) {
+  unsigned int seed = 12345;
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x++) {
+      for (int c = 0; c < img->channels; c++) {
+        seed = seed * 1103515245u + 12345u;
+        int base = ((x >> 4) * 37 + (y >> 4) * 91 + c * 53) & 0xff;
+        img->data[(y * img->width + x) * img->channels + c] =
+            (unsigned char)((base + ((seed >> 16) & 15)) & 0xff);
+      }
+    }
+  }
+}
+
+static Image synthetic_image(int width, int height, int channels) {
+  Image img = create_empty_image(width, height, channels);
+  if (img.data)
+    fill_image(&img);
+  return img;
+}
+
+static Image synthetic_mask(int width, int height) {
+  Image mask = create_empty_image(width, height, GRAY_CHANNELS);
+  if (mask.data) {
+    for (int y = 0; y < height; y++) {
+      memset(mask.data + y * width, 255, width - width / 8);
+    }
+  }
+  return mask;
+}
+
+static ImageS widen(Image *img) {
+  ImageS s = create_empty_image_s(img->width, img->height, img->channels);
+  if (s.data)
+    convert_image_to_image_s(img, &s);
+  return s;
+}
+
+static void free_all(BenchCase *c) {
+  destroy_image(&c->img);
+  destroy_image(&c->mask);
+  destroy_image_s(&c->img_s);
+  destroy_image_s(&c->img_s2);
+  destroy_image_s(&c->mask_s);
+  destroy_image_f(&c->img_f);
+  destroy_image_f(&c->out);
+  destroy_image_f(&c->out_mask);
+  destroy_image_s(&c->final_out);
+  memset(&c->img, 0, sizeof(Image));
+  memset(&c->mask, 0, sizeof(Image));
+  memset(&c->img_s, 0, sizeof(ImageS));
+  memset(&c->img_s2, 0, sizeof(ImageS));
+  memset(&c->mask_s, 0, sizeof(ImageS));
+  memset(&c->img_f, 0, sizeof(ImageF));
+  memset(&c->out, 0, sizeof(ImageF));
+  memset(&c->out_mask, 0, sizeof(ImageF));
+  memset(&c->final_out, 0, sizeof(ImageS));
+}
+
+static void setup_u8(BenchCase *c) {
+  c->img = synthetic_image(c->width, c->height, c->channels);
+}
+
+static void setup_s(BenchCase *c) {
+  setup_u8(c);
+  c->img_s = widen(&c->img);
+}
+
+static void setup_f(BenchCase *c) {
+  setup_u8(c);
+  c->img_f = create_empty_image_f(c->width, c->height, c->channels);
+  convert_image_to_image_f(&c->img, &c->img_f);
+}
+
+static void run_downsample(BenchCase *c) {
+  Image r = downsample(&c->img);
+  destroy_image(&r);
+}
+
+static void run_downsample_s(BenchCase *c) {
+  ImageS r = downsample_s(&c->img_s);
+  destroy_image_s(&r);
+}
+
+static void run_downsample_f(BenchCase *c) {
+  ImageF r = downsample_f(&c->img_f);
+  destroy_image_f(&r);
+}
+
+static void setup_upsample(BenchCase *c) {
+  Image full = synthetic_image(c->width, c->height, c->channels);
+  c->img = downsample(&full);
+  destroy_image(&full);
+}
+
+static void setup_upsample_s(BenchCase *c) {
+  setup_upsample(c);
+  c->img_s = widen(&c->img);
+}
+
+static void run_upsample(BenchCase *c) {
+  Image r = upsample(&c->img, 4.f);
+  destroy_image(&r);
+}
+
+static void run_upsample_s(BenchCase *c) {
+  ImageS r = upsample_image_s(&c->img_s, 4.f);
+  destroy_image_s(&r);
+}
+
+static void setup_laplacian(BenchCase *c) {
+  setup_s(c);
+  c->img_s2 = widen(&c->img);
+}
+
+static void run_laplacian(BenchCase *c) { compute_laplacian(&c->img_s, &c->img_s2); }
+
+static void setup_feed(BenchCase *c) {
+  setup_s(c);
+  c->mask = synthetic_mask(c->width, c->height);
+  c->mask_s = widen(&c->mask);
+  c->out = create_empty_image_f(c->width, c->height, RGB_CHANNELS);
+  c->out_mask = create_empty_image_f(c->width, c->height, GRAY_CHANNELS);
+  c->final_out = create_empty_image_s(c->width, c->height, RGB_CHANNELS);
+}
+
+static void run_feed(BenchCase *c) {
+  FeedThreadData ftd;
+  ftd.rows = c->height;
+  ftd.cols = c->width;
+  ftd.x_tl = 0;
+  ftd.y_tl = 0;
+  ftd.out_level_width = c->width;
+  ftd.out_level_height = c->height;
+  ftd.level_width = c->width;
+  ftd.level_height = c->height;
+  ftd.level = 0;
+  ftd.img_laplacians = &c->img_s;
+  ftd.mask_gaussian = &c->mask_s;
+  ftd.out = &c->out;
+  ftd.out_mask = &c->out_mask;
+  ftd.start_col = 0;
+  ftd.end_col = 0;
+
+  WorkerThreadArgs wtd;
+  wtd.ftd = &ftd;
+  ParallelOperatorArgs args = {c->height, &wtd};
+  parallel_operator(FEED, &args);
+}
+
+static void run_normalize(BenchCase *c) {
+  NormalThreadData ntd = {c->width, 0, &c->out, &c->out_mask, &c->final_out};
+  WorkerThreadArgs wtd;
+  wtd.ntd = &ntd;
+  ParallelOperatorArgs args = {c->height, &wtd};
+  parallel_operator(NORMALIZE, &args);
+}
+
+static void run_blend(BenchCase *c) {
+  BlendThreadData btd = {(size_t)c->img_s.width * c->img_s.channels, c->img_s,
+                         c->img_s2};
+  WorkerThreadArgs wtd;
+  wtd.btd = &btd;
+  ParallelOperatorArgs args = {c->img_s.height, &wtd};
+  parallel_operator(BLEND, &args);
+}
+
+static void setup_distance(BenchCase *c) {
+  c->mask = synthetic_mask(c->width, c->height);
+}
+
+static void run_distance(BenchCase *c) { distance_transform(&c->mask); }
+
+static void run_border(BenchCase *c) {
+  int border = 3 * (1 << 5);
+  add_border_to_image(&c->img, border, border, border, border, c->channels,
+                      BORDER_REFLECT);
+}
+
+static void run_encode(BenchCase *c) {
+  if (c->channels == RGB_CHANNELS)
+    compress_jpeg(c->tmp_path, &c->img, 100);
+  else
+    compress_grayscale_jpeg(c->tmp_path, &c->img, 100);
+}
+
+static void setup_decode(BenchCase *c) {
+  setup_u8(c);
+  run_encode(c);
+}
+
+static void run_decode(BenchCase *c) {
+  Image r = decompress_jpeg(c->tmp_path);
+  destroy_image(&r);
+}
+
+static double run_case(BenchCase *c, double min_time, int *iterations) {
+  double best = -1.0, total = 0.0;
+  int n = 0;
+
+  while (n < 3 || (total < min_time && n < 1000)) {
+    c->setup(c);
+    double start = now_seconds();
+    c->run(c);
+    double elapsed = now_seconds() - start;
+    c->teardown(c);
+
+    total += elapsed;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+    n++;
+  }
+
+  *iterations = n;
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int sizes[MAX_SWEEP] = {512, 2048, 4096};
+  int num_sizes = 3;
+  int threads[MAX_SWEEP];
+  int num_threads = 0;
+  double min_time = 0.25;
+  const char *tmp_path = "kernel_bench.jpg";
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--sizes") && i + 1 < argc) {
+      num_sizes = parse_list(argv[++i], sizes);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      num_threads = parse_list(argv[++i], threads);
+    } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+      min_time = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--tmp") && i + 1 < argc) {
+      tmp_path = argv[++i];
+    } else if (!strcmp(argv[i], "--kernels") && i + 1 < argc) {
+      if (!set_kernel_variant(argv[++i])) {
+        fprintf(stderr, "kernel variant %s is not available\n", argv[i]);
+        return 1;
+      }
+    } else {
+      fprintf(stderr,
+              "usage: %s [--sizes a,b] [--threads a,b] [--min-time s] "
+              "[--tmp file] [--kernels variant]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (num_threads == 0) {
+    for (int t = 1; t <= get_no_of_cpu() && num_threads < MAX_SWEEP; t *= 2) {
+      threads[num_threads++] = t;
+    }
+  }
+
+  const int channel_counts[2] = {GRAY_CHANNELS, RGB_CHANNELS};
+
+  printf("{\n  \"kernels\": \"%s\",\n  \"benchmarks\": [",
+         kernel_variant_name());
+  int first = 1;
+
+  for (int s = 0; s < num_sizes; s++) {
+    for (int ch = 0; ch < 2; ch++) {
+      int w = sizes[s], h = sizes[s], cn = channel_counts[ch];
+      double px = (double)w * h;
+
+      BenchCase cases[] = {
+          {"downsample", w, h, cn, px * cn * 1.25, setup_u8, run_downsample,
+           free_all},
+          {"downsample_s", w, h, cn, px * cn * 2 * 1.25, setup_s,
+           run_downsample_s, free_all},
+          {"downsample_f", w, h, cn, px * cn * 4 * 1.25, setup_f,
+           run_downsample_f, free_all},
+          {"upsample", w, h, cn, px * cn * 1.25, setup_upsample, run_upsample,
+           free_all},
+          {"upsample_image_s", w, h, cn, px * cn * 2 * 1.25, setup_upsample_s,
+           run_upsample_s, free_all},
+          {"compute_laplacian", w, h, cn, px * cn * 2 * 3, setup_laplacian,
+           run_laplacian, free_all},
+          {"blend_worker", w, h, cn, px * cn * 2 * 3, setup_laplacian,
+           run_blend, free_all},
+          {"add_border_to_image", w, h, cn, px * cn * 2, setup_u8, run_border,
+           free_all},
+          {"jpeg_encode", w, h, cn, px * cn, setup_u8, run_encode, free_all},
+          {"jpeg_decode", w, h, cn, px * cn, setup_decode, run_decode,
+           free_all},
+          {"feed_worker", w, h, RGB_CHANNELS, px * (3 * 2 + 2 + 2 * 4 * 4),
+           setup_feed, run_feed, free_all},
+          {"normalize_worker", w, h, RGB_CHANNELS, px * (3 * 4 + 4 + 3 * 2),
+           setup_feed, run_normalize, free_all},
+          {"distance_transform", w, h, GRAY_CHANNELS, px * (1 + 4 * 3),
+           setup_distance, run_distance, free_all},
+      };
+      int num_cases = sizeof(cases) / sizeof(cases[0]);
+
+      for (int k = 0; k < num_cases; k++) {
+        BenchCase *c = &cases[k];
+        // kernels that only exist for one channel layout run once per size
+        if (c->channels != cn)
+          continue;
+        c->tmp_path = tmp_path;
+
+        double base = 0.0;
+        for (int t = 0; t < num_threads; t++) {
+          int iterations;
+          set_cpus_count(threads[t]);
+          double best = run_case(c, min_time, &iterations);
+          if (t == 0)
+            base = best;
+
+          printf("%s\n    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+                 "\"channels\": %d, \"threads\": %d, \"iterations\": %d, "
+                 "\"seconds\": %.9f, \"ns_per_pixel\": %.4f, "
+                 "\"gb_per_s\": %.4f, \"speedup\": %.3f}",
+                 first ? "" : ",", c->name, c->width, c->height, c->channels,
+                 threads[t], iterations, best, best * 1e9 / px,
+                 c->bytes / best / 1e9, base / best);
+          first = 0;
+          fflush(stdout);
+        }
+      }
+    }
+  }
+
+  printf("\n  ]\n}\n");
+  set_cpus_count(0);
+  remove(tmp_path);
+  return 0;
+}
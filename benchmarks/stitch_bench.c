@@ -0,0 +1,285 @@
+#include "blending.h"
+#include "seam_finder.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * End-to-end stitching benchmark on procedurally generated panoramas.
+ *
+ *   stitch_bench [--inputs 4] [--size 2000x1500] [--overlap 0.2]
+ *                [--layout strip|grid] [--bands 1,3,5,7] [--threads 1,2,4]
+ *                [--blenders multiband,feather] [--seam-local]
+ *                [--out stitch_bench.jpg]
+ *
+ * Inputs are crops of one synthetic scene with a per-input exposure shift,
+ * so seams are visible without blending. Masks come from the Voronoi seam
+ * finder. Each configuration runs in a forked child so that peak RSS is
+ * per run; one CSV row per configuration is written to stdout.
+ * --seam-local feeds the multiband blender all inputs at once with
+ * seam_local set, which shows up as the multiband-seam blender.
+ */
+
+#define MAX_SWEEP 16
+
+typedef struct {
+  int inputs;
+  int width;
+  int height;
+  float overlap;
+  int grid;
+  int seam_local;
+  const char *out_path;
+} BenchConfig;
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_list(const char *arg, int *values) {
+  int n = 0;
+  while (*arg && n < MAX_SWEEP) {
+    values[n++] = atoi(arg);
+    const char *comma = strchr(arg, ',');
+    if (!comma)
+      break;
+    arg = comma + 1;
+  }
+  return n;
+}
+
+static double peak_rss_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+  return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+static unsigned char scene_value(int x, int y, int c) {
+  int v = ((x * (c + 1)) / 7 + (y * (3 - c)) / 5) & 0xff;
+  int checker = (((x >> 5) ^ (y >> 5)) & 1) * 40;
+  return (unsigned char)clamp(v / 2 + checker + 60, 0, 255);
+}
+
+static void layout_rects(const BenchConfig *cfg, StitchRect *rects,
+                         StitchRect *canvas) {
+  int cols = cfg->inputs;
+  if (cfg->grid) {
+    cols = 1;
+    while (cols * cols < cfg->inputs)
+      cols++;
+  }
+
+  int step_x = (int)(cfg->width * (1.0f - cfg->overlap));
+  int step_y = (int)(cfg->height * (1.0f - cfg->overlap));
+
+  canvas->x = canvas->y = 0;
+  canvas->width = canvas->height = 0;
+  for (int i = 0; i < cfg->inputs; i++) {
+    rects[i].x = (i % cols) * step_x;
+    rects[i].y = (i / cols) * step_y;
+    rects[i].width = cfg->width;
+    rects[i].height = cfg->height;
+    canvas->width = max(canvas->width, rects[i].x + cfg->width);
+    canvas->height = max(canvas->height, rects[i].y + cfg->height);
+  }
+}
+
+static Image generate_input(const StitchRect *r, int index) {
+  Image img = create_empty_image(r->width, r->height, RGB_CHANNELS);
+  if (!img.data)
+    return img;
+
+  int exposure = (index % 3) * 12 - 12;
+  for (int y = 0; y < r->height; y++) {
+    unsigned char *row = img.data + y * r->width * RGB_CHANNELS;
+    for (int x = 0; x < r->width; x++) {
+      for (int c = 0; c < RGB_CHANNELS; c++) {
+        row[x * RGB_CHANNELS + c] = (unsigned char)clamp(
+            scene_value(r->x + x, r->y + y, c) + exposure, 0, 255);
+      }
+    }
+  }
+  return img;
+}
+
+static int run_config(const BenchConfig *cfg, BlenderType type, int bands,
+                      int threads) {
+  StitchRect *rects = (StitchRect *)malloc(cfg->inputs * sizeof(StitchRect));
+  Image *images = (Image *)calloc(cfg->inputs, sizeof(Image));
+  Image *masks = (Image *)calloc(cfg->inputs, sizeof(Image));
+  if (!rects || !images || !masks)
+    return 0;
+
+  StitchRect canvas;
+  layout_rects(cfg, rects, &canvas);
+
+  for (int i = 0; i < cfg->inputs; i++) {
+    images[i] = generate_input(&rects[i], i);
+    if (!images[i].data)
+      return 0;
+  }
+  if (!find_seam_masks(SEAM_VORONOI, rects, NULL, cfg->inputs, 3, masks))
+    return 0;
+
+  set_cpus_count(threads);
+
+  double t0 = now_seconds();
+  Blender *b = create_blender(type, canvas, bands);
+  if (!b)
+    return 0;
+  double t1 = now_seconds();
+
+  if (cfg->seam_local && type == MULTIBAND) {
+    Image **image_ptrs = (Image **)malloc(cfg->inputs * sizeof(Image *));
+    Image **mask_ptrs = (Image **)malloc(cfg->inputs * sizeof(Image *));
+    StitchPoint *tls = (StitchPoint *)malloc(cfg->inputs * sizeof(StitchPoint));
+    if (!image_ptrs || !mask_ptrs || !tls)
+      return 0;
+    for (int i = 0; i < cfg->inputs; i++) {
+      image_ptrs[i] = &images[i];
+      mask_ptrs[i] = &masks[i];
+      tls[i].x = rects[i].x;
+      tls[i].y = rects[i].y;
+    }
+    b->seam_local = 1;
+    feed_many(b, image_ptrs, mask_ptrs, tls, cfg->inputs);
+    free(image_ptrs);
+    free(mask_ptrs);
+    free(tls);
+  } else {
+    for (int i = 0; i < cfg->inputs; i++) {
+      StitchPoint tl = {rects[i].x, rects[i].y};
+      feed(b, &images[i], &masks[i], tl);
+    }
+  }
+  double t2 = now_seconds();
+
+  blend(b);
+  double t3 = now_seconds();
+
+  int saved = b->result.data != NULL && save_image(&b->result, cfg->out_path);
+  double t4 = now_seconds();
+
+  double total = t4 - t0;
+  double megapixels = (double)canvas.width * canvas.height / 1e6;
+
+  printf("%s,%s,%d,%d,%d,%.3f,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.1f,%d\n",
+         type == FEATHER   ? "feather"
+         : cfg->seam_local ? "multiband-seam"
+                           : "multiband",
+         cfg->grid ? "grid" : "strip", cfg->inputs, cfg->width, cfg->height,
+         cfg->overlap, type == MULTIBAND ? b->num_bands : 0, threads,
+         canvas.width, canvas.height, (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+         (t3 - t2) * 1e3, (t4 - t3) * 1e3, total * 1e3, megapixels / total,
+         peak_rss_mb(), saved);
+  fflush(stdout);
+
+  destroy_blender(b);
+  for (int i = 0; i < cfg->inputs; i++) {
+    destroy_image(&images[i]);
+    destroy_image(&masks[i]);
+  }
+  free(rects);
+  free(images);
+  free(masks);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  BenchConfig cfg = {4, 2000, 1500, 0.2f, 0, 0, "stitch_bench.jpg"};
+  int bands[MAX_SWEEP] = {1, 3, 5, 7};
+  int num_bands = 4;
+  int threads[MAX_SWEEP];
+  int num_threads = 0;
+  int run_multiband = 1, run_feather = 1;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--inputs") && i + 1 < argc) {
+      cfg.inputs = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &cfg.width, &cfg.height) != 2)
+        cfg.height = cfg.width;
+    } else if (!strcmp(argv[i], "--overlap") && i + 1 < argc) {
+      cfg.overlap = (float)atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--layout") && i + 1 < argc) {
+      cfg.grid = !strcmp(argv[++i], "grid");
+    } else if (!strcmp(argv[i], "--bands") && i + 1 < argc) {
+      num_bands = parse_list(argv[++i], bands);
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      num_threads = parse_list(argv[++i], threads);
+    } else if (!strcmp(argv[i], "--blenders") && i + 1 < argc) {
+      const char *list = argv[++i];
+      run_multiband = strstr(list, "multiband") != NULL;
+      run_feather = strstr(list, "feather") != NULL;
+    } else if (!strcmp(argv[i], "--seam-local")) {
+      cfg.seam_local = 1;
+    } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+      cfg.out_path = argv[++i];
+    } else {
+      fprintf(stderr,
+              "usage: %s [--inputs n] [--size WxH] [--overlap r] "
+              "[--layout strip|grid] [--bands a,b] [--threads a,b] "
+              "[--blenders multiband,feather] [--seam-local] [--out file]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (cfg.inputs <= 0 || cfg.width <= 0 || cfg.height <= 0 ||
+      cfg.overlap < 0.0f || cfg.overlap >= 1.0f) {
+    fprintf(stderr, "invalid configuration\n");
+    return 1;
+  }
+
+  if (num_threads == 0) {
+    for (int t = 1; t <= get_no_of_cpu() && num_threads < MAX_SWEEP; t *= 2) {
+      threads[num_threads++] = t;
+    }
+  }
+
+  printf("blender,layout,inputs,width,height,overlap,bands,threads,"
+         "canvas_width,canvas_height,create_ms,feed_ms,blend_ms,save_ms,"
+         "total_ms,mp_per_s,peak_rss_mb,saved\n");
+  fflush(stdout);
+
+  for (int type = MULTIBAND; type <= FEATHER; type++) {
+    if ((type == MULTIBAND && !run_multiband) ||
+        (type == FEATHER && !run_feather))
+      continue;
+
+    // band count only matters for the multiband engine
+    int sweep_bands = type == MULTIBAND ? num_bands : 1;
+    for (int nb = 0; nb < sweep_bands; nb++) {
+      for (int t = 0; t < num_threads; t++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+          exit(run_config(&cfg, (BlenderType)type, bands[nb], threads[t])
+                   ? 0
+                   : 1);
+        }
+
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+          fprintf(stderr, "run failed: %s bands=%d threads=%d\n",
+                  type == MULTIBAND ? "multiband" : "feather", bands[nb],
+                  threads[t]);
+        }
+      }
+    }
+  }
+
+  remove(cfg.out_path);
+  return 0;
+}
@@ -0,0 +1,340 @@
+#include "blender_io.h"
+#include "allocator.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLENDER_FILE_MAGIC "NSBLEND"
+#define BLENDER_FILE_VERSION 1
+#define BLENDER_FILE_ALIGNMENT 64
+// a literal run only ends at this many zero words in a row
+#define MIN_ZERO_RUN 4
+
+// exactly BLENDER_FILE_ALIGNMENT bytes
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t blender_type;
+  uint32_t channels;
+  uint32_t num_bands;
+  int32_t real_out_size[4];
+  int32_t output_size[4];
+  uint32_t compressed;
+  uint32_t section_count;
+} BlenderFileHeader;
+
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+  uint64_t raw_size;
+} BlenderFileSection;
+
+static ImageF *section_plane(const Blender *b, int section) {
+  return section % 2 ? &b->out_mask[section / 2] : &b->out[section / 2];
+}
+
+static size_t plane_floats(const ImageF *plane) {
+  return (size_t)plane->width * plane->height * plane->channels;
+}
+
+static uint64_t align_offset(uint64_t offset) {
+  return (offset + BLENDER_FILE_ALIGNMENT - 1) &
+         ~(uint64_t)(BLENDER_FILE_ALIGNMENT - 1);
+}
+
+static int same_rect(StitchRect r, const int32_t *values) {
+  return r.x == values[0] && r.y == values[1] && r.width == values[2] &&
+         r.height == values[3];
+}
+
+static int blenders_match(const Blender *a, const Blender *b) {
+  int32_t real[4] = {b->real_out_size.x, b->real_out_size.y,
+                     b->real_out_size.width, b->real_out_size.height};
+  return a->blender_type == b->blender_type && a->channels == b->channels &&
+         a->num_bands == b->num_bands && same_rect(a->real_out_size, real);
+}
+
+// the padded output size follows from the real one and the band count
+static int header_matches(const BlenderFileHeader *h, const Blender *b) {
+  return h->blender_type == (uint32_t)b->blender_type &&
+         (int)h->channels == b->channels &&
+         (int)h->num_bands == b->num_bands &&
+         h->section_count == 2 * (uint32_t)(b->num_bands + 1) &&
+         same_rect(b->real_out_size, h->real_out_size) &&
+         same_rect(b->output_size, h->output_size);
+}
+
+void *merge_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  MergeThreadData *m = arg->workerThreadArgs->mtd;
+  for (int row = arg->start_index; row < arg->end_index; row++) {
+    float *dst = m->dst + (size_t)row * m->row_floats;
+    const float *src = m->src + (size_t)row * m->row_floats;
+    for (size_t i = 0; i < m->row_floats; i++) {
+      dst[i] += src[i];
+    }
+  }
+  return NULL;
+}
+
+static void add_plane(ImageF *dst, const float *src) {
+  MergeThreadData m = {dst->data, src,
+                       (size_t)dst->width * dst->channels};
+  WorkerThreadArgs w;
+  w.mtd = &m;
+  ParallelOperatorArgs args = {dst->height, &w};
+  parallel_operator(MERGE, &args);
+}
+
+// a seam-local feed leaves the accumulators empty away from its zones
+static int seam_local_fed(const Blender *b) {
+  if (b->zones) {
+    fprintf(stderr, "Seam-local blenders cannot be saved or merged.\n");
+  }
+  return b->zones != NULL;
+}
+
+int blender_merge(Blender *dst, const Blender *src) {
+  if (seam_local_fed(dst) || seam_local_fed(src)) {
+    return 0;
+  }
+  if (!blenders_match(dst, src)) {
+    fprintf(stderr, "Cannot merge blenders of different layouts.\n");
+    return 0;
+  }
+  for (int section = 0; section < 2 * (dst->num_bands + 1); section++) {
+    add_plane(section_plane(dst, section), section_plane(src, section)->data);
+  }
+  return 1;
+}
+
+static int write_zero_runs(FILE *file, const uint32_t *words, size_t count,
+                           uint64_t *size) {
+  // (zeros, literals) pairs of 32 bit counts, each followed by the literals
+  size_t i = 0;
+  *size = 0;
+  while (i < count) {
+    size_t start = i;
+    while (i < count && !words[i] && i - start < UINT32_MAX)
+      i++;
+    size_t literal_start = i;
+    while (i < count && i - literal_start < UINT32_MAX - MIN_ZERO_RUN) {
+      if (words[i]) {
+        i++;
+        continue;
+      }
+      size_t zeros = i;
+      while (zeros < count && zeros - i < MIN_ZERO_RUN && !words[zeros])
+        zeros++;
+      if (zeros - i == MIN_ZERO_RUN || zeros == count)
+        break;
+      i = zeros;
+    }
+
+    uint32_t run[2] = {(uint32_t)(literal_start - start),
+                       (uint32_t)(i - literal_start)};
+    if (fwrite(run, sizeof(run), 1, file) != 1 ||
+        fwrite(words + literal_start, sizeof(uint32_t), run[1], file) !=
+            run[1])
+      return 0;
+    *size += sizeof(run) + (uint64_t)run[1] * sizeof(uint32_t);
+  }
+  return 1;
+}
+
+// with dst NULL only checks that the runs fill exactly count words
+static int add_zero_runs(float *dst, size_t count, const unsigned char *src,
+                         uint64_t size) {
+  size_t i = 0;
+  uint64_t pos = 0;
+  while (i < count) {
+    uint32_t run[2];
+    if (pos + sizeof(run) > size)
+      return 0;
+    memcpy(run, src + pos, sizeof(run));
+    pos += sizeof(run);
+    if (run[0] > count - i || run[1] > count - i - run[0] ||
+        pos + (uint64_t)run[1] * sizeof(float) > size)
+      return 0;
+    i += run[0];
+
+    // sections are 64 byte aligned and runs whole words, so is the literal
+    const float *literals = (const float *)(src + pos);
+    for (uint32_t k = 0; dst && k < run[1]; k++) {
+      dst[i + k] += literals[k];
+    }
+    i += run[1];
+    pos += (uint64_t)run[1] * sizeof(float);
+  }
+  return pos == size;
+}
+
+static int pad_to(FILE *file, uint64_t offset) {
+  static const unsigned char zeros[BLENDER_FILE_ALIGNMENT] = {0};
+  long pos = ftell(file);
+  if (pos < 0 || (uint64_t)pos > offset)
+    return 0;
+  size_t pad = (size_t)(offset - (uint64_t)pos);
+  return fwrite(zeros, 1, pad, file) == pad;
+}
+
+int blender_save(const Blender *b, const char *path, int compress) {
+  if (seam_local_fed(b)) {
+    return 0;
+  }
+  int count = 2 * (b->num_bands + 1);
+  BlenderFileSection *sections =
+      (BlenderFileSection *)stitch_calloc(count, sizeof(BlenderFileSection));
+  if (!sections)
+    return 0;
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    fprintf(stderr, "Failed to open output file: %s\n", path);
+    stitch_free(sections);
+    return 0;
+  }
+
+  BlenderFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BLENDER_FILE_MAGIC, sizeof(BLENDER_FILE_MAGIC));
+  header.version = BLENDER_FILE_VERSION;
+  header.blender_type = b->blender_type;
+  header.channels = b->channels;
+  header.num_bands = b->num_bands;
+  int32_t real[4] = {b->real_out_size.x, b->real_out_size.y,
+                     b->real_out_size.width, b->real_out_size.height};
+  int32_t full[4] = {b->output_size.x, b->output_size.y, b->output_size.width,
+                     b->output_size.height};
+  memcpy(header.real_out_size, real, sizeof(real));
+  memcpy(header.output_size, full, sizeof(full));
+  header.compressed = compress != 0;
+  header.section_count = count;
+
+  // the table is written once more at the end with the section sizes
+  int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+           fwrite(sections, sizeof(BlenderFileSection), count, file) ==
+               (size_t)count;
+  uint64_t offset =
+      align_offset(sizeof(header) + count * sizeof(BlenderFileSection));
+  for (int i = 0; i < count && ok; i++) {
+    const ImageF *plane = section_plane(b, i);
+    size_t floats = plane_floats(plane);
+    sections[i].offset = offset;
+    sections[i].raw_size = floats * sizeof(float);
+    ok = pad_to(file, offset);
+    if (ok && compress) {
+      ok = write_zero_runs(file, (const uint32_t *)plane->data, floats,
+                           &sections[i].size);
+    } else if (ok) {
+      sections[i].size = sections[i].raw_size;
+      ok = fwrite(plane->data, sizeof(float), floats, file) == floats;
+    }
+    offset = align_offset(offset + sections[i].size);
+  }
+
+  ok = ok && fseek(file, sizeof(header), SEEK_SET) == 0 &&
+       fwrite(sections, sizeof(BlenderFileSection), count, file) ==
+           (size_t)count;
+  ok = fclose(file) == 0 && ok;
+  if (!ok)
+    fprintf(stderr, "Failed to write blender file: %s\n", path);
+  stitch_free(sections);
+  return ok;
+}
+
+int blender_merge_file(Blender *dst, const char *path) {
+  if (seam_local_fed(dst)) {
+    return 0;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open file: %s\n", path);
+    return 0;
+  }
+  struct stat st;
+  size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+  void *mapped = size >= sizeof(BlenderFileHeader)
+                     ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)
+                     : MAP_FAILED;
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    fprintf(stderr, "Failed to map blender file: %s\n", path);
+    return 0;
+  }
+
+  const unsigned char *data = (const unsigned char *)mapped;
+  const BlenderFileHeader *header = (const BlenderFileHeader *)data;
+  const BlenderFileSection *sections =
+      (const BlenderFileSection *)(data + sizeof(BlenderFileHeader));
+  int ok = memcmp(header->magic, BLENDER_FILE_MAGIC,
+                  sizeof(BLENDER_FILE_MAGIC)) == 0 &&
+           header->version == BLENDER_FILE_VERSION &&
+           header_matches(header, dst) &&
+           sizeof(BlenderFileHeader) +
+                   header->section_count * sizeof(BlenderFileSection) <=
+               size;
+
+  // every section is checked before the first one is added, so a damaged
+  // file leaves dst as it was
+  for (uint32_t i = 0; ok && i < header->section_count; i++) {
+    size_t floats = plane_floats(section_plane(dst, i));
+    const BlenderFileSection *s = &sections[i];
+    ok = s->raw_size == floats * sizeof(float) && s->offset <= size &&
+         s->size <= size - s->offset &&
+         s->offset % BLENDER_FILE_ALIGNMENT == 0 &&
+         (header->compressed
+              ? add_zero_runs(NULL, floats, data + s->offset, s->size)
+              : s->size == s->raw_size);
+  }
+  for (uint32_t i = 0; ok && i < header->section_count; i++) {
+    ImageF *plane = section_plane(dst, i);
+    const BlenderFileSection *s = &sections[i];
+    if (header->compressed) {
+      add_zero_runs(plane->data, plane_floats(plane), data + s->offset,
+                    s->size);
+    } else {
+      add_plane(plane, (const float *)(data + s->offset));
+    }
+  }
+
+  if (!ok)
+    fprintf(stderr, "Invalid or mismatched blender file: %s\n", path);
+  munmap(mapped, size);
+  return ok;
+}
+
+Blender *blender_load(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    fprintf(stderr, "Failed to open file: %s\n", path);
+    return NULL;
+  }
+  BlenderFileHeader header;
+  int read = fread(&header, sizeof(header), 1, file) == 1;
+  fclose(file);
+  if (!read ||
+      memcmp(header.magic, BLENDER_FILE_MAGIC, sizeof(BLENDER_FILE_MAGIC)) ||
+      header.version != BLENDER_FILE_VERSION) {
+    fprintf(stderr, "Not a blender file: %s\n", path);
+    return NULL;
+  }
+
+  StitchRect out_size = {header.real_out_size[0], header.real_out_size[1],
+                         header.real_out_size[2], header.real_out_size[3]};
+  Blender *b = create_blender_with_channels(
+      (BlenderType)header.blender_type, out_size, header.num_bands,
+      header.channels);
+  // the accumulators start at zero, so loading is merging into nothing
+  if (b && !blender_merge_file(b, path)) {
+    destroy_blender(b);
+    return NULL;
+  }
+  return b;
+}
@@ -0,0 +1,38 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef BLENDER_IO_HEADERS
+#define BLENDER_IO_HEADERS
+
+#include "blending.h"
+
+/*
+ * The level accumulators out/out_mask are plain sums over the fed images,
+ * so blenders fed with disjoint subsets of the inputs can be added
+ * together and blended as if one blender had seen them all. This is what
+ * lets several processes or machines share one panorama, and a saved
+ * blender doubles as a checkpoint of a long feed.
+ *
+ * Files start with a 64 byte header and a section table, followed by one
+ * 64 byte aligned section per accumulator plane (out[0], out_mask[0],
+ * out[1], ...). Uncompressed sections are the raw floats and are added
+ * straight from a memory mapping; compressed ones store runs of zero
+ * words, which is what most of a partial blender is. Files use the native
+ * byte order.
+ */
+int blender_save(const Blender *b, const char *path, int compress);
+Blender *blender_load(const char *path);
+
+// dst += src, both must have been created with the same type, size,
+// band count and channels; returns 0 when they do not match
+int blender_merge(Blender *dst, const Blender *src);
+int blender_merge_file(Blender *dst, const char *path);
+
+void *merge_worker(void *args);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,11 @@
 #include "blending.h"
+#include "allocator.h"
+#include "blender_io.h"
+#include "deep_zoom.h"
 #include "jpeg.h"
+#include "kernels.h"
+#include "stats.h"
+#include "task_graph.h"
 #include "turbojpeg.h"
 #include "utils.h"
 #include <assert.h>
@@ -10,12 +16,13 @@
 #include <string.h>
 #include <time.h>
 
-Blender *create_multi_band_blender(StitchRect out_size, int nb) {
+Blender *create_multi_band_blender(StitchRect out_size, int nb, int channels) {
 
-  Blender *blender = (Blender *)malloc(sizeof(Blender));
-  blender->blender_type = MULTIBAND;
+  Blender *blender = (Blender *)stitch_calloc(1, sizeof(Blender));
   if (!blender)
     return NULL;
+  blender->blender_type = MULTIBAND;
+  blender->channels = channels;
   blender->real_out_size = out_size;
 
   blender->num_bands = min(MAX_BANDS, nb);
@@ -33,126 +40,156 @@ Blender *create_multi_band_blender(StitchRect out_size, int nb) {
                      (1 << blender->num_bands);
   blender->output_size = out_size;
 
-  blender->out = (ImageF *)malloc((blender->num_bands + 1) * sizeof(ImageF));
-  blender->final_out =
-      (ImageS *)malloc((blender->num_bands + 1) * sizeof(ImageS));
-  blender->out_mask =
-      (ImageF *)malloc((blender->num_bands + 1) * sizeof(ImageF));
-  blender->out_width_levels =
-      (int *)malloc((blender->num_bands + 1) * sizeof(int));
-  blender->out_height_levels =
-      (int *)malloc((blender->num_bands + 1) * sizeof(int));
-  blender->img_laplacians =
-      (ImageS *)malloc((blender->num_bands + 1) * sizeof(Image));
-  blender->mask_gaussian =
-      (ImageS *)malloc((blender->num_bands + 1) * sizeof(Image));
+  int levels = blender->num_bands + 1;
+  blender->out = (ImageF *)stitch_calloc(levels, sizeof(ImageF));
+  blender->final_out = (ImageS *)stitch_calloc(levels, sizeof(ImageS));
+  blender->out_mask = (ImageF *)stitch_calloc(levels, sizeof(ImageF));
+  blender->out_width_levels = (int *)stitch_calloc(levels, sizeof(int));
+  blender->out_height_levels = (int *)stitch_calloc(levels, sizeof(int));
+  blender->img_laplacians = (ImageS *)stitch_calloc(levels, sizeof(ImageS));
+  blender->mask_gaussian = (ImageS *)stitch_calloc(levels, sizeof(ImageS));
 
   if (!blender->out || !blender->final_out || !blender->out_mask ||
       !blender->out_width_levels || !blender->out_height_levels ||
       !blender->img_laplacians || !blender->mask_gaussian) {
-    free(blender->out);
-    free(blender->final_out);
-    free(blender->out_mask);
-    free(blender->out_width_levels);
-    free(blender->out_height_levels);
-    free(blender->img_laplacians);
-    free(blender->mask_gaussian);
-    free(blender);
+    destroy_blender(blender);
     return NULL;
   }
 
-  blender->out[0] = create_empty_image_f(out_size.width, out_size.height, 3);
-  blender->out_mask[0] =
-      create_empty_image_f(out_size.width, out_size.height, 1);
-
   blender->out_width_levels[0] = out_size.width;
   blender->out_height_levels[0] = out_size.height;
 
   for (int i = 1; i <= blender->num_bands; i++) {
     blender->out_width_levels[i] = (blender->out_width_levels[i - 1] + 1) / 2;
     blender->out_height_levels[i] = (blender->out_height_levels[i - 1] + 1) / 2;
+  }
 
-    blender->out[i] = create_empty_image_f(blender->out_width_levels[i],
-                                           blender->out_height_levels[i], 3);
+  for (int i = 0; i <= blender->num_bands; i++) {
+    blender->out[i] = create_empty_image_f(
+        blender->out_width_levels[i], blender->out_height_levels[i], channels);
     blender->out_mask[i] = create_empty_image_f(
         blender->out_width_levels[i], blender->out_height_levels[i], 1);
+    if (!blender->out[i].data || !blender->out_mask[i].data) {
+      destroy_blender(blender);
+      return NULL;
+    }
   }
 
   return blender;
 }
 
-Blender *create_feather_blender(StitchRect out_size) {
-  Blender *blender = (Blender *)malloc(sizeof(Blender));
-  blender->blender_type = FEATHER;
+Blender *create_feather_blender(StitchRect out_size, int channels) {
+  Blender *blender = (Blender *)stitch_calloc(1, sizeof(Blender));
   if (!blender)
     return NULL;
+  blender->blender_type = FEATHER;
+  blender->channels = channels;
   blender->real_out_size = out_size;
   blender->output_size = out_size;
   blender->sharpness = 2.5;
-  blender->out_width_levels = NULL;
-  blender->out_height_levels = NULL;
-  blender->final_out = NULL;
-  blender->img_laplacians = NULL;
-  blender->mask_gaussian = NULL;
-
-  blender->out = (ImageF *)malloc(sizeof(ImageF));
-  blender->final_out = (ImageS *)malloc(sizeof(ImageS));
-  blender->out_mask = (ImageF *)malloc(sizeof(ImageF));
-
-  if (!blender->out || !blender->final_out || !blender->out_mask) {
-    free(blender->out);
-    free(blender->final_out);
-    free(blender->out_mask);
-    free(blender);
+  blender->do_distance_transform = 0;
+
+  blender->out = (ImageF *)stitch_calloc(1, sizeof(ImageF));
+  blender->out_mask = (ImageF *)stitch_calloc(1, sizeof(ImageF));
+
+  if (!blender->out || !blender->out_mask) {
+    destroy_blender(blender);
     return NULL;
   }
 
-  blender->out[0] = create_empty_image_f(out_size.width, out_size.height, 3);
+  blender->out[0] =
+      create_empty_image_f(out_size.width, out_size.height, channels);
   blender->out_mask[0] =
       create_empty_image_f(out_size.width, out_size.height, 1);
-  blender->do_distance_transform = 0;
+  if (!blender->out[0].data || !blender->out_mask[0].data) {
+    destroy_blender(blender);
+    return NULL;
+  }
+
+  return blender;
+}
 
+Blender *create_blender_with_channels(BlenderType blenderType,
+                                      StitchRect out_size, int nb,
+                                      int channels) {
+  if (channels != RGB_CHANNELS && channels != GRAY_CHANNELS) {
+    fprintf(stderr, "Unsupported blender channel count: %d\n", channels);
+    return NULL;
+  }
+  if (blenderType == FEATHER) {
+    return create_feather_blender(out_size, channels);
+  }
+  Blender *blender = create_multi_band_blender(out_size, nb, channels);
+  if (blender && blenderType == FUSION) {
+    blender->blender_type = FUSION;
+    blender->fusion_contrast = 1.f;
+    blender->fusion_saturation = 1.f;
+    blender->fusion_exposedness = 1.f;
+  }
   return blender;
 }
 
 Blender *create_blender(BlenderType blenderType, StitchRect out_size, int nb) {
-  if (blenderType == MULTIBAND) {
-    return create_multi_band_blender(out_size, nb);
+  return create_blender_with_channels(blenderType, out_size, nb, RGB_CHANNELS);
+}
+
+Blender *create_blender_with_allocator(BlenderType blenderType,
+                                       StitchRect out_size, int nb,
+                                       const StitchAllocator *allocator,
+                                       size_t memory_limit) {
+  MemoryContext *memory = create_memory_context(allocator, memory_limit);
+  if (!memory)
+    return NULL;
+
+  MemoryContext *previous = memory_activate(memory);
+  Blender *blender = create_blender(blenderType, out_size, nb);
+  memory_activate(previous);
+
+  if (!blender) {
+    destroy_memory_context(memory);
+    return NULL;
   }
-  return create_feather_blender(out_size);
+  blender->memory = memory;
+  return blender;
+}
+
+MemoryUsage get_blender_memory_usage(const Blender *b) {
+  return memory_context_usage(b->memory);
 }
 
 void destroy_blender(Blender *blender) {
   if (!blender)
     return;
 
-  if (blender->out != NULL) {
-    free(blender->out);
-  }
-
-  if (blender->out_mask != NULL) {
-    free(blender->out_mask);
-  }
-
-  if (blender->out_width_levels != NULL) {
-    free(blender->out_width_levels);
+  // feather blenders have a single level and num_bands == 0
+  for (int i = 0; i <= blender->num_bands; i++) {
+    if (blender->out != NULL)
+      destroy_image_f(&blender->out[i]);
+    if (blender->out_mask != NULL)
+      destroy_image_f(&blender->out_mask[i]);
+    if (blender->final_out != NULL)
+      destroy_image_s(&blender->final_out[i]);
   }
 
-  if (blender->out_height_levels != NULL) {
-    free(blender->out_height_levels);
-  }
+  stitch_free(blender->out);
+  stitch_free(blender->out_mask);
+  stitch_free(blender->final_out);
+  stitch_free(blender->out_width_levels);
+  stitch_free(blender->out_height_levels);
+  stitch_free(blender->img_laplacians);
+  stitch_free(blender->mask_gaussian);
   destroy_image(&blender->result);
-  if (blender->final_out != NULL) {
-    destroy_image_s(blender->final_out);
+  stitch_free(blender->zones);
+  destroy_image(&blender->direct);
+  for (int i = 0; i <= MAX_BANDS; i++) {
+    destroy_image(&blender->level_results[i]);
   }
+  stitch_free(blender->stats);
 
-  if (blender->img_laplacians != NULL) {
-    free(blender->img_laplacians);
-  }
-  if (blender->mask_gaussian != NULL) {
-    free(blender->mask_gaussian);
-  }
-  free(blender);
+  // the blender itself lives in its memory context, release it last
+  MemoryContext *memory = blender->memory;
+  stitch_free(blender);
+  destroy_memory_context(memory);
 }
 
 void *compute_laplacian_worker(void *args) {
@@ -161,77 +198,37 @@ void *compute_laplacian_worker(void *args) {
   int end_row = arg->end_index;
   LaplacianThreadData *l = (LaplacianThreadData *)arg->workerThreadArgs->ltd;
 
-  for (int i = start_row; i < end_row; ++i) {
-    l->upsampled->data[i] = l->original->data[i] - l->upsampled->data[i];
+  short *original = l->original->data + (size_t)start_row * l->row_size;
+  short *upsampled = l->upsampled->data + (size_t)start_row * l->row_size;
+  size_t count = (size_t)(end_row - start_row) * l->row_size;
+  for (size_t i = 0; i < count; ++i) {
+    upsampled[i] = original[i] - upsampled[i];
   }
 
   return NULL;
 }
 
 void compute_laplacian(ImageS *original, ImageS *upsampled) {
-  int total_size = original->width * original->height * original->channels;
-
-  LaplacianThreadData ltd = {original, upsampled, total_size};
+  LaplacianThreadData ltd = {original, upsampled,
+                             (size_t)original->width * original->channels};
   WorkerThreadArgs wtd;
   wtd.ltd = &ltd;
-  ParallelOperatorArgs args = {total_size, &wtd};
+  ParallelOperatorArgs args = {original->height, &wtd};
 
   parallel_operator(LAPLACIAN, &args);
 }
 
 void *feed_worker(void *args) {
   ThreadArgs *arg = (ThreadArgs *)args;
-  int start_row = arg->start_index;
-  int end_row = arg->end_index;
-  FeedThreadData *f = (FeedThreadData *)arg->workerThreadArgs->ftd;
-
-  for (int k = start_row; k < end_row; ++k) {
-    for (int i = 0; i < f->cols; ++i) {
-      int maskIndex = i + (k * f->level_width);
-      int outMaskLevelIndex =
-          ((i + f->x_tl) + ((k + f->y_tl) * f->out_level_width));
-
-      for (char z = 0; z < RGB_CHANNELS; ++z) {
-        int imgIndex = ((i + (k * f->level_width)) * RGB_CHANNELS) + z;
-
-        if (imgIndex < f->img_laplacians[f->level].width *
-                           f->img_laplacians[f->level].height * RGB_CHANNELS &&
-            maskIndex < f->mask_gaussian[f->level].width *
-                            f->mask_gaussian[f->level].height) {
-
-          int outLevelIndex =
-              ((i + f->x_tl) + (k + f->y_tl) * f->out_level_width) *
-                  RGB_CHANNELS +
-              z;
-
-          float maskVal = f->mask_gaussian[f->level].data[maskIndex];
-          float imgVal = f->img_laplacians[f->level].data[imgIndex];
-
-          maskVal = maskVal * (1.0 / 255.0);
-
-          imgVal = imgVal * maskVal;
-
-          if (outLevelIndex <
-                  f->out_level_height * f->out_level_width * RGB_CHANNELS &&
-              outMaskLevelIndex < f->out_level_height * f->out_level_width) {
-            f->out[f->level].data[outLevelIndex] += imgVal;
-
-            if (z == 0) {
-              f->out_mask[f->level].data[outMaskLevelIndex] += maskVal;
-            }
-          }
-        }
-      }
-    }
-  }
-
+  get_kernels()->feed_rows(arg->workerThreadArgs->ftd, arg->start_index,
+                           arg->end_index);
   return NULL;
 }
 
-int multi_band_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
-  ImageS images[b->num_bands + 1];
-  int return_val = 1;
-
+// grows the placement by the pyramid halo and aligns it to the coarsest level
+static void feed_region(Blender *b, int img_width, int img_height,
+                        StitchPoint tl, StitchPoint *tl_out,
+                        StitchPoint *br_out) {
   int gap = 3 * (1 << b->num_bands);
   StitchPoint tl_new, br_new;
 
@@ -239,8 +236,8 @@ int multi_band_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
   tl_new.y = max(b->output_size.y, tl.y - gap);
 
   StitchPoint br_point = br(b->output_size);
-  br_new.x = min(br_point.x, tl.x + img->width + gap);
-  br_new.y = min(br_point.y, tl.y + img->height + gap);
+  br_new.x = min(br_point.x, tl.x + img_width + gap);
+  br_new.y = min(br_point.y, tl.y + img_height + gap);
 
   tl_new.x = b->output_size.x +
              (((tl_new.x - b->output_size.x) >> b->num_bands) << b->num_bands);
@@ -266,50 +263,96 @@ int multi_band_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
   tl_new.y -= dy;
   br_new.y -= dy;
 
-  int top = tl.y - tl_new.y;
-  int left = tl.x - tl_new.x;
-  int bottom = br_new.y - tl.y - img->height;
-  int right = br_new.x - tl.x - img->width;
-
-  add_border_to_image(img, top, bottom, left, right, RGB_CHANNELS,
-                      BORDER_REFLECT);
-  add_border_to_image(mask_img, top, bottom, left, right, 1, BORDER_CONSTANT);
+  *tl_out = tl_new;
+  *br_out = br_new;
+}
 
-  images[0] = create_empty_image_s(img->width, img->height, img->channels);
-  convert_image_to_image_s(img, &images[0]);
-  for (int j = 0; j < b->num_bands; ++j) {
-    images[j + 1] = downsample_s(&images[j]);
-    if (!images[j + 1].data) {
-      return_val = 0;
-      goto clean;
+// columns [start, end) of an image row into row y of the bordered level 0,
+// reflected sideways
+static void store_bordered_row(ImageS *level, int y, const unsigned char *row,
+                               int width, int left, int start, int end) {
+  int channels = level->channels;
+  short *dst = level->data + (size_t)y * level->width * channels;
+  for (int x = start; x < end; x++) {
+    int src_x = x - left;
+    if (src_x < 0)
+      src_x = -src_x - 1;
+    else if (src_x >= width)
+      src_x = 2 * width - src_x - 1;
+    src_x = clamp(src_x, 0, width - 1);
+    for (int c = 0; c < channels; c++) {
+      dst[x * channels + c] = row[src_x * channels + c];
     }
+  }
+}
+
+// the image row that row y of the bordered level 0 shows, reflected like
+// add_border_to_image(BORDER_REFLECT)
+static int bordered_source_row(int y, int top, int height) {
+  int src_y = y - top;
+  if (src_y < 0)
+    src_y = -src_y - 1;
+  else if (src_y >= height)
+    src_y = 2 * height - src_y - 1;
+  return clamp(src_y, 0, height - 1);
+}
+
+// columns [start, end) of a mask row into row y of the bordered mask level,
+// zero around it like BORDER_CONSTANT; a NULL row is a border row
+static void store_mask_row(ImageS *level, int y, const unsigned char *row,
+                           int width, int left, int start, int end) {
+  short *dst = level->data + (size_t)y * level->width;
+  for (int x = start; x < end; x++) {
+    int src_x = x - left;
+    dst[x] = row && src_x >= 0 && src_x < width ? row[src_x] : 0;
+  }
+}
 
+// b->img_laplacians from the gaussian pyramid already in images[0..num_bands]
+static int build_laplacians(Blender *b, ImageS *images) {
+  for (int j = 0; j < b->num_bands; ++j) {
     b->img_laplacians[j] = upsample_image_s(&images[j + 1], 4.f);
-    if (!&b->img_laplacians[j]) {
-      return_val = 0;
-      goto clean;
+    if (!b->img_laplacians[j].data) {
+      return 0;
     }
 
     compute_laplacian(&images[j], &b->img_laplacians[j]);
   }
 
   b->img_laplacians[b->num_bands] = images[b->num_bands];
+  return 1;
+}
+
+// b->mask_gaussian from the mask, bordered as its level 0 is filled
+static int build_mask_pyramid(Blender *b, Image *mask_img, int top, int left,
+                              int bottom, int right) {
   ImageS sampled;
-  ImageS mask_img_ = create_empty_image_s(mask_img->width, mask_img->height,
-                                          mask_img->channels);
-  convert_image_to_image_s(mask_img, &mask_img_);
+  ImageS mask_img_ = create_empty_image_s(
+      mask_img->width + left + right, mask_img->height + top + bottom, 1);
+  if (!mask_img_.data) {
+    return 0;
+  }
+  for (int y = 0; y < mask_img_.height; ++y) {
+    int inside = y >= top && y < top + mask_img->height;
+    store_mask_row(&mask_img_, y,
+                   inside ? mask_img->data + (size_t)(y - top) * mask_img->width
+                          : NULL,
+                   mask_img->width, left, 0, mask_img_.width);
+  }
   for (int j = 0; j < b->num_bands; ++j) {
     b->mask_gaussian[j] = mask_img_;
     sampled = downsample_s(&mask_img_);
     if (!sampled.data) {
-      return_val = 0;
-      goto clean;
+      return 0;
     }
     mask_img_ = sampled;
   }
 
   b->mask_gaussian[b->num_bands] = mask_img_;
+  return 1;
+}
 
+static void feed_levels(Blender *b, StitchPoint tl_new, StitchPoint br_new) {
   int y_tl = tl_new.y - b->output_size.y;
   int y_br = br_new.y - b->output_size.y;
   int x_tl = tl_new.x - b->output_size.x;
@@ -334,6 +377,8 @@ int multi_band_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
     ftd.mask_gaussian = b->mask_gaussian;
     ftd.out = b->out;
     ftd.out_mask = b->out_mask;
+    ftd.start_col = 0;
+    ftd.end_col = 0;
 
     WorkerThreadArgs wtd;
     wtd.ftd = &ftd;
@@ -346,283 +391,2168 @@ int multi_band_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
     x_br /= 2;
     y_br /= 2;
   }
-clean:
-  for (size_t i = 0; i <= b->num_bands; i++) {
-    destroy_image_s(&images[i]);
-  }
+}
 
-  return return_val;
+/*
+ * Each task of the feed and blend graphs works on a tile of TASK_ROWS rows
+ * and TASK_COLS columns of one level. Levels stay row-major, but the rows a
+ * tile reads, halo included, fit in L2 however wide the canvas is.
+ */
+#define TASK_ROWS 32
+#define TASK_COLS 512
+// images of one feed_many whose pyramids may be alive at the same time
+#define FEED_WINDOW 2
+
+static unsigned long long operator_bytes(OperatorType operatorType,
+                                         ParallelOperatorArgs *arg);
+
+static int row_blocks(int rows) { return (rows + TASK_ROWS - 1) / TASK_ROWS; }
+
+static int col_tiles(int cols) { return (cols + TASK_COLS - 1) / TASK_COLS; }
+
+// tiles of a level of the given size, added to the graphs row by row
+static int level_tiles(int width, int height) {
+  return row_blocks(height) * col_tiles(width);
 }
 
-int feather_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
-    if (b->do_distance_transform) {
-        distance_transform(mask_img);
+// graph tasks get their level and tile in one index
+static int level_task(int level, int tile) {
+  return tile * (MAX_BANDS + 1) + level;
+}
+
+static int task_level(int index) { return index % (MAX_BANDS + 1); }
+
+// the pixels of a level of the given size that a task covers
+static StitchRect task_rect(int index, int width, int height) {
+  int tile = index / (MAX_BANDS + 1);
+  StitchRect r;
+  r.x = tile % col_tiles(width) * TASK_COLS;
+  r.y = tile / col_tiles(width) * TASK_ROWS;
+  r.width = min(TASK_COLS, width - r.x);
+  r.height = min(TASK_ROWS, height - r.y);
+  return r;
+}
+
+// task waits for the tiles, added from first_tile on, that hold columns
+// [x0, x1] of rows [y0, y1] of a level of the given size
+static void depend_on_tiles(TaskGraph *g, int task, int first_tile, int width,
+                            int height, int x0, int y0, int x1, int y1) {
+  x0 = max(x0, 0);
+  y0 = max(y0, 0);
+  x1 = min(x1, width - 1);
+  y1 = min(y1, height - 1);
+  if (x1 < x0 || y1 < y0) {
+    return;
+  }
+  for (int block = y0 / TASK_ROWS; block <= y1 / TASK_ROWS; block++) {
+    for (int col = x0 / TASK_COLS; col <= x1 / TASK_COLS; col++) {
+      add_dependency(g, task, first_tile + block * col_tiles(width) + col);
     }
+  }
+}
 
-    const int out_w   = b->output_size.width;
-    const int out_h   = b->output_size.height;
-    const int in_w    = img->width;
-    const int in_h    = img->height;
-    const int mask_w  = mask_img->width;
+// the tile runs on the node that first touched its rows of a canvas level
+static void place_tile(TaskGraph *g, int task, StitchRect r, int rows) {
+  set_task_node(g, task, get_row_node(r.y + r.height / 2, rows));
+}
+
+// task waits for every tile of a level, added from first_tile on
+static void depend_on_level(TaskGraph *g, int task, int first_tile, int width,
+                            int height) {
+  for (int tile = 0; tile < level_tiles(width, height); tile++) {
+    add_dependency(g, task, first_tile + tile);
+  }
+}
 
-    for (int y = 0; y < in_h; y++) {
-        int out_y = y + tl.y;
-        if (out_y < 0 || out_y >= out_h) continue;
+// the share of op over whole rows that the columns of r account for
+static unsigned long long tile_bytes(OperatorType operatorType,
+                                     WorkerThreadArgs *w, StitchRect r,
+                                     int width) {
+  ParallelOperatorArgs args = {r.height, w};
+  return operator_bytes(operatorType, &args) * r.width / max(width, 1);
+}
 
-        for (int x = 0; x < in_w; x++) {
-            int out_x    = x + tl.x;
-            if (out_x < 0 || out_x >= out_w) continue;
+static ImageS level_header(int width, int height, int channels) {
+  ImageS level = {NULL, width, height, channels};
+  return level;
+}
 
-            int image_pos = (y * in_w + x) * RGB_CHANNELS;
-            int mask_pos  = y * mask_w + x;
-            int dst_idx   = (out_y * out_w + out_x) * RGB_CHANNELS;
-            int dst_mask  = out_y * out_w + out_x;
+// every pixel of a level is written by its tasks, no need to clear it
+static int allocate_level(ImageS *level) {
+  level->data = (short *)stitch_malloc((size_t)level->width * level->height *
+                                       level->channels * sizeof(short));
+  return level->data != NULL;
+}
 
-            float weight = mask_img->data[mask_pos] / 255.0f;
-            b->out_mask->data[dst_mask] += weight;
+static int rect_empty(StitchRect r) { return r.width <= 0 || r.height <= 0; }
 
-            for (int channel = 0; channel < RGB_CHANNELS; channel++) {
-                b->out->data[dst_idx + channel] +=
-                    img->data[image_pos + channel] * weight;
-            }
-        }
-    }
+static StitchRect intersect_rects(StitchRect a, StitchRect b) {
+  int x0 = max(a.x, b.x);
+  int y0 = max(a.y, b.y);
+  StitchRect r = {x0, y0, max(min(a.x + a.width, b.x + b.width) - x0, 0),
+                  max(min(a.y + a.height, b.y + b.height) - y0, 0)};
+  return r;
+}
 
-    return 1;
+// the bounding box of both
+static StitchRect unite_rects(StitchRect a, StitchRect b) {
+  if (rect_empty(a) || rect_empty(b)) {
+    return rect_empty(a) ? b : a;
+  }
+  int x0 = min(a.x, b.x);
+  int y0 = min(a.y, b.y);
+  StitchRect r = {x0, y0, max(a.x + a.width, b.x + b.width) - x0,
+                  max(a.y + a.height, b.y + b.height) - y0};
+  return r;
 }
 
+// the pixels of the next coarser level, of the given size, that upsampling
+// r reads, as the tasks depend on them
+static StitchRect upsample_reach(StitchRect r, int width, int height) {
+  if (rect_empty(r)) {
+    return r;
+  }
+  int x0 = max(0, r.x - 2) / 2;
+  int y0 = max(0, r.y - 2) / 2;
+  StitchRect c = {x0, y0, min(width, (r.x + r.width + 1) / 2 + 1) - x0,
+                  min(height, (r.y + r.height + 1) / 2 + 1) - y0};
+  return c;
+}
 
-int feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
-  assert(img->height == mask_img->height && img->width == mask_img->width);
-  if (b->blender_type == MULTIBAND) {
-    return multi_band_feed(b, img, mask_img, tl);
-  } else {
-    return feather_feed(b, img, mask_img, tl);
+// the pixels of the next finer level, of the given size, that downsampling
+// into r reads
+static StitchRect downsample_reach(StitchRect r, int width, int height) {
+  if (rect_empty(r)) {
+    return r;
   }
+  int x0 = max(0, 2 * r.x - 2);
+  int y0 = max(0, 2 * r.y - 2);
+  StitchRect f = {x0, y0, min(width, 2 * (r.x + r.width) + 1) - x0,
+                  min(height, 2 * (r.y + r.height) + 1) - y0};
+  return f;
 }
 
-void *blend_worker(void *args) {
-  ThreadArgs *arg = (ThreadArgs *)args;
-  int start_row = arg->start_index;
-  int end_row = arg->end_index;
-  BlendThreadData *b = (BlendThreadData *)arg->workerThreadArgs->btd;
-  for (int i = start_row; i < end_row; ++i) {
-    if (i < b->out_size) {
-      b->blended_image.data[i] =
-          b->blended_image.data[i] + b->out_level.data[i];
+/*
+ * The end, at most end, of the columns from x on in row y that are either
+ * all inside the union of rects or all outside it; *inside tells which.
+ */
+static int rect_run(const StitchRect *rects, int count, int y, int x, int end,
+                    int *inside) {
+  int stop = x;
+  for (int grown = 1; grown;) {
+    grown = 0;
+    for (int i = 0; i < count; i++) {
+      const StitchRect *r = &rects[i];
+      if (y >= r->y && y < r->y + r->height && stop >= r->x &&
+          stop < r->x + r->width) {
+        stop = r->x + r->width;
+        grown = 1;
+      }
     }
   }
-  return NULL;
+  *inside = stop > x;
+  if (!*inside) {
+    stop = end;
+    for (int i = 0; i < count; i++) {
+      const StitchRect *r = &rects[i];
+      if (y >= r->y && y < r->y + r->height && r->x > x && r->x < stop) {
+        stop = r->x;
+      }
+    }
+  }
+  return min(stop, end);
 }
 
-void *normalize_worker(void *args) {
-  ThreadArgs *arg = (ThreadArgs *)args;
-  int start_row = arg->start_index;
-  int end_row = arg->end_index;
-  NormalThreadData *n = (NormalThreadData *)arg->workerThreadArgs->ntd;
+// columns [x0, x1) of row y of the pixels a seam-local feed copied, as
+// channels bytes each: the colour, then the weight when there is room
+static void copy_direct_row(const Blender *b, int y, int x0, int x1,
+                            unsigned char *dst, int channels) {
+  const Image *direct = &b->direct;
+  const unsigned char *src =
+      direct->data + ((size_t)y * direct->width + x0) * direct->channels;
+  for (int x = x0; x < x1; x++) {
+    memcpy(dst, src, channels);
+    dst += channels;
+    src += direct->channels;
+  }
+}
 
-  for (int y = start_row; y < end_row; ++y) {
-    for (int x = 0; x < n->output_width; ++x) {
-      int maskIndex = x + (y * n->output_width);
-      if (maskIndex < image_size_f(&n->out_mask[n->level])) {
-        float w = n->out_mask[n->level].data[maskIndex];
+typedef struct {
+  Blender *b;
+  Image *img;
+  // NULL for RGBA images, whose gaussian levels carry the weights, and for
+  // fusion images weighted by their content alone
+  Image *mask_img;
+  // set for fusion blenders, whose level 0 weights come from the image
+  const FusionWeights *fusion;
+  StitchPoint tl;
+  StitchPoint tl_new;
+  StitchPoint br_new;
+  // the border around img in level 0
+  int top;
+  int left;
+  int bottom;
+  int right;
+  ImageS gaussian[MAX_BANDS + 1];
+  ImageS mask_gaussian[MAX_BANDS + 1];
+  // the coarsest laplacian level is gaussian[num_bands] itself
+  ImageS laplacians[MAX_BANDS + 1];
+  FeedThreadData feeds[MAX_BANDS + 1];
+  // joins the feed blocks of each level, the next image waits for them
+  int fed[MAX_BANDS + 1];
+  int cleanup;
+  // reach_count rects of each level: those the gaussian pyramid is built on
+  // and those the laplacians are made and fed on, all of every level unless
+  // the feed is seam-local
+  StitchRect *gaussian_reach[MAX_BANDS + 1];
+  StitchRect *laplacian_reach[MAX_BANDS + 1];
+  StitchRect *reach;
+  int reach_count;
+} FeedJob;
+
+static int has_mask_pyramid(const FeedJob *job) {
+  return job->mask_img || job->fusion;
+}
 
-        for (char z = 0; z < RGB_CHANNELS; z++) {
-          int imgIndex = (x + (y * n->output_width)) * RGB_CHANNELS + z;
-          if (imgIndex < image_size_s(&n->final_out[n->level])) {
+static void init_feed_job(FeedJob *job, Blender *b, Image *img,
+                          Image *mask_img, const FusionWeights *fusion,
+                          StitchPoint tl) {
+  memset(job, 0, sizeof(FeedJob));
+  job->b = b;
+  job->img = img;
+  job->mask_img = mask_img;
+  job->fusion = fusion;
+  job->tl = tl;
+  feed_region(b, img->width, img->height, tl, &job->tl_new, &job->br_new);
+  job->top = tl.y - job->tl_new.y;
+  job->left = tl.x - job->tl_new.x;
+  job->bottom = job->br_new.y - tl.y - img->height;
+  job->right = job->br_new.x - tl.x - img->width;
+
+  int width = job->br_new.x - job->tl_new.x;
+  int height = job->br_new.y - job->tl_new.y;
+  int y_tl = job->tl_new.y - b->output_size.y;
+  int y_br = job->br_new.y - b->output_size.y;
+  int x_tl = job->tl_new.x - b->output_size.x;
+  int x_br = job->br_new.x - b->output_size.x;
 
-            n->final_out[n->level].data[imgIndex] =
-                (short)(n->out[n->level].data[imgIndex] / (w + WEIGHT_EPS));
-          }
+  for (int level = 0; level <= b->num_bands; ++level) {
+    int level_width = width >> level;
+    int level_height = height >> level;
+    job->gaussian[level] =
+        level_header(level_width, level_height, img->channels);
+    job->mask_gaussian[level] = level_header(level_width, level_height, 1);
+    job->laplacians[level] =
+        level_header(level_width, level_height, img->channels);
+
+    FeedThreadData *f = &job->feeds[level];
+    f->rows = y_br - y_tl;
+    f->cols = x_br - x_tl;
+    f->x_tl = x_tl;
+    f->y_tl = y_tl;
+    f->out_level_width = b->out_width_levels[level];
+    f->out_level_height = b->out_height_levels[level];
+    f->level_width = level_width;
+    f->level_height = level_height;
+    f->level = level;
+    f->img_laplacians = job->laplacians;
+    f->mask_gaussian =
+        has_mask_pyramid(job) ? job->mask_gaussian : job->gaussian;
+    f->out = b->out;
+    f->out_mask = b->out_mask;
+
+    x_tl /= 2;
+    y_tl /= 2;
+    x_br /= 2;
+    y_br /= 2;
+  }
+}
+
+static int prepare_feed_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  int num_bands = job->b->num_bands;
+  (void)index;
+
+  // a seam-local image away from every zone only has its pixels copied
+  if (!job->reach_count) {
+    return 1;
+  }
+  for (int level = 0; level <= num_bands; ++level) {
+    if (!allocate_level(&job->gaussian[level]) ||
+        (has_mask_pyramid(job) &&
+         !allocate_level(&job->mask_gaussian[level])) ||
+        (level < num_bands && !allocate_level(&job->laplacians[level]))) {
+      return 0;
+    }
+  }
+  job->laplacians[num_bands].data = job->gaussian[num_bands].data;
+  return 1;
+}
+
+/*
+ * Fusion weights of columns [start, end) of row y of the bordered level 0,
+ * which shows image row src_y, times the mask when there is one. The
+ * contrast reads the pixels around each one, the image edges being their
+ * own outer neighbours like in the reflected border. Border pixels get no
+ * weight, like the constant mask border gives them.
+ */
+static void fusion_weight_row(FeedJob *job, int y, int src_y, int inside,
+                              int start, int end) {
+  const Image *img = job->img;
+  ImageS *weights = &job->mask_gaussian[0];
+  short *dst = weights->data + (size_t)y * weights->width;
+  // the image columns of the range
+  int x0 = inside ? clamp(start - job->left, 0, img->width) : 0;
+  int x1 = inside ? clamp(end - job->left, 0, img->width) : 0;
+  for (int x = start; x < end; ++x) {
+    if (x - job->left < x0 || x - job->left >= x1) {
+      dst[x] = 0;
+    }
+  }
+  if (x0 >= x1) {
+    return;
+  }
+
+  size_t row = (size_t)img->width * img->channels;
+  dst += job->left;
+  get_kernels()->fusion_weights_row(
+      job->fusion, img->data + max(src_y - 1, 0) * row,
+      img->data + src_y * row,
+      img->data + min(src_y + 1, img->height - 1) * row, img->channels,
+      img->width, x0, x1, dst);
+
+  if (job->mask_img) {
+    const unsigned char *mask =
+        job->mask_img->data + (size_t)src_y * job->mask_img->width;
+    for (int x = x0; x < x1; ++x) {
+      dst[x] = (short)(dst[x] * mask[x] / 255);
+    }
+  }
+}
+
+/*
+ * Tile r of level 0, read from the image and its mask as the border around
+ * them is made, so neither is ever copied with a border.
+ */
+static void bordered_tile(FeedJob *job, StitchRect r) {
+  const Image *img = job->img;
+  ImageS *level = &job->gaussian[0];
+  size_t row = (size_t)img->width * img->channels;
+  int start = r.x;
+  int end = r.x + r.width;
+  for (int y = r.y; y < r.y + r.height; ++y) {
+    int src_y = bordered_source_row(y, job->top, img->height);
+    int inside = y >= job->top && y < job->top + img->height;
+    store_bordered_row(level, y, img->data + src_y * row, img->width,
+                       job->left, start, end);
+
+    if (job->fusion) {
+      fusion_weight_row(job, y, src_y, inside, start, end);
+    } else if (job->mask_img) {
+      store_mask_row(&job->mask_gaussian[0], y,
+                     inside ? job->mask_img->data +
+                                  (size_t)src_y * job->mask_img->width
+                            : NULL,
+                     img->width, job->left, start, end);
+    } else {
+      // the reflected border must not carry coverage
+      short *alpha = level->data + (size_t)y * level->width * RGBA_CHANNELS + 3;
+      for (int x = start; x < end; ++x) {
+        if (!inside || x < job->left || x >= job->left + img->width) {
+          alpha[x * RGBA_CHANNELS] = 0;
         }
       }
     }
   }
-  return NULL;
 }
 
-void multi_band_blend(Blender *b) {
-  for (int level = 0; level <= b->num_bands; ++level) {
-    b->final_out[level] = create_empty_image_s(
-        b->out[level].width, b->out[level].height, b->out[level].channels);
-
-    NormalThreadData ntd = {b->out[level].width, level, b->out, b->out_mask,
-                            b->final_out};
-    WorkerThreadArgs wtd;
-    wtd.ntd = &ntd;
-    ParallelOperatorArgs args = {b->out[level].height, &wtd};
+// level 0 is the bordered image, every coarser one a downsample of the last
+static int gaussian_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  int level = task_level(index);
+  ImageS *gaussian = &job->gaussian[level];
+  ImageS *mask = &job->mask_gaussian[level];
+  StitchRect tile = task_rect(index, gaussian->width, gaussian->height);
+
+  for (int i = 0; i < job->reach_count; i++) {
+    StitchRect r = intersect_rects(tile, job->gaussian_reach[level][i]);
+    if (rect_empty(r)) {
+      continue;
+    }
+    if (level == 0) {
+      bordered_tile(job, r);
+      continue;
+    }
 
-    parallel_operator(NORMALIZE, &args);
-    destroy_image_f(&b->out[level]);
-    if (level > 0) {
-      destroy_image_f(&b->out_mask[level]);
+    SamplingThreadData s = {0,        gaussian->width,
+                            gaussian->height, &job->gaussian[level - 1],
+                            gaussian->data,   IMAGES};
+    s.start_col = r.x;
+    s.end_col = r.x + r.width;
+    get_kernels()->downsample_s(&s, r.y, r.y + r.height);
+    if (has_mask_pyramid(job)) {
+      SamplingThreadData m = {0,          mask->width,
+                              mask->height, &job->mask_gaussian[level - 1],
+                              mask->data,   IMAGES};
+      m.start_col = r.x;
+      m.end_col = r.x + r.width;
+      get_kernels()->downsample_s(&m, r.y, r.y + r.height);
     }
   }
+  return 1;
+}
 
-  ImageS blended_image = b->final_out[b->num_bands];
+static int laplacian_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  int level = task_level(index);
+  const ImageS *gaussian = &job->gaussian[level];
+  ImageS *lap = &job->laplacians[level];
+  StitchRect tile = task_rect(index, lap->width, lap->height);
+  size_t row = (size_t)lap->width * lap->channels;
+
+  for (int i = 0; i < job->reach_count; i++) {
+    StitchRect r = intersect_rects(tile, job->laplacian_reach[level][i]);
+    if (rect_empty(r)) {
+      continue;
+    }
+    SamplingThreadData s = {4.f,         lap->width,
+                            lap->height, &job->gaussian[level + 1],
+                            lap->data,   IMAGES};
+    s.start_col = r.x;
+    s.end_col = r.x + r.width;
+    get_kernels()->upsample_s(&s, r.y, r.y + r.height);
+
+    for (int y = r.y; y < r.y + r.height; y++) {
+      size_t end = y * row + (size_t)(r.x + r.width) * lap->channels;
+      for (size_t p = y * row + (size_t)r.x * lap->channels; p < end; p++) {
+        lap->data[p] = gaussian->data[p] - lap->data[p];
+      }
+    }
+  }
+  return 1;
+}
 
-  for (int level = b->num_bands; level > 0; --level) {
-    blended_image = upsample_image_s(&blended_image, 4.f);
-    int out_size = image_size_s(&b->final_out[level - 1]);
+// each pixel is fed once, however many of the rects hold it
+static int feed_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  int level = task_level(index);
+  FeedThreadData f = job->feeds[level];
+  StitchRect tile = task_rect(index, f.cols, f.rows);
+  int end = tile.x + tile.width;
+  for (int y = tile.y; y < tile.y + tile.height; y++) {
+    for (int x = tile.x; x < end;) {
+      int inside;
+      int stop = rect_run(job->laplacian_reach[level], job->reach_count, y, x,
+                          end, &inside);
+      if (inside) {
+        f.start_col = x;
+        f.end_col = stop;
+        get_kernels()->feed_rows(&f, y, y + 1);
+      }
+      x = stop;
+    }
+  }
+  return 1;
+}
 
-    BlendThreadData btd = {out_size, blended_image, b->final_out[level - 1]};
-    WorkerThreadArgs wtd;
-    wtd.btd = &btd;
-    ParallelOperatorArgs args = {out_size, &wtd};
-    parallel_operator(BLEND, &args);
-  }
-
-  b->result.data =
-      (unsigned char *)malloc(b->output_size.width * b->output_size.height *
-                              RGB_CHANNELS * sizeof(unsigned char));
-  b->result.channels = blended_image.channels;
-  b->result.width = blended_image.width;
-  b->result.height = blended_image.height;
-
-  convert_images_to_image(&blended_image, &b->result);
-
-  for (size_t i = 0; i < b->result.height; i++) {
-    for (size_t j = 0; j < b->result.width; j++) {
-      int pos = j + (i * b->result.width);
-      float w = b->out_mask[0].data[pos];
-      if (w <= WEIGHT_EPS) {
-        int imgPos = (j + (i * b->result.width)) * RGB_CHANNELS;
-        for (char c = 0; c < RGB_CHANNELS; c++) {
-          b->result.data[imgPos + c] = 0;
+// the pixels of a tile of the image that lie outside every zone, where it
+// is the only input with weight
+static int copy_direct_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  Blender *b = job->b;
+  const Image *img = job->img;
+  const Image *weights = job->mask_img ? job->mask_img : img;
+  Image *direct = &b->direct;
+  int dx = job->tl.x - b->output_size.x;
+  int dy = job->tl.y - b->output_size.y;
+  StitchRect tile = task_rect(index, img->width, img->height);
+  StitchRect placed = {tile.x + dx, tile.y + dy, tile.width, tile.height};
+  StitchRect canvas = {0, 0, direct->width, direct->height};
+  StitchRect r = intersect_rects(placed, canvas);
+
+  for (int y = r.y; y < r.y + r.height; y++) {
+    for (int x = r.x; x < r.x + r.width;) {
+      int inside;
+      int stop = rect_run(b->zones, b->zone_count, y, x, r.x + r.width,
+                          &inside);
+      for (; !inside && x < stop; x++) {
+        size_t src = (size_t)(y - dy) * img->width + x - dx;
+        unsigned char w =
+            weights->data[(src + 1) * weights->channels - 1];
+        if (w) {
+          unsigned char *dst =
+              direct->data + ((size_t)y * direct->width + x) * direct->channels;
+          memcpy(dst, img->data + src * img->channels, b->channels);
+          dst[b->channels] = w;
         }
       }
+      x = stop;
     }
   }
+  return 1;
+}
+
+static int join_task(void *user, int index) {
+  (void)user;
+  (void)index;
+  return 1;
+}
 
-  crop_image_buf(
-      &b->result, 0, max(0, b->result.height - b->real_out_size.height), 0,
-      max(0, b->result.width - b->real_out_size.width), RGB_CHANNELS);
-  free(blended_image.data);
+static int cleanup_feed_task(void *user, int index) {
+  FeedJob *job = (FeedJob *)user;
+  int num_bands = job->b->num_bands;
+  (void)index;
 
-  destroy_image_s(&b->final_out[0]);
-  b->final_out = NULL;
+  job->laplacians[num_bands].data = NULL;
+  for (int level = 0; level <= num_bands; level++) {
+    destroy_image_s(&job->gaussian[level]);
+    destroy_image_s(&job->mask_gaussian[level]);
+    destroy_image_s(&job->laplacians[level]);
+  }
+  return 1;
 }
 
-void feather_blend(Blender *b) {
-  b->final_out[0] = create_empty_image_s(b->out[0].width, b->out[0].height,
-                                         b->out[0].channels);
+/*
+ * Image i of jobs: its pyramid is built tile by tile, each tile as soon as
+ * the pixels it reads are there, and a level is fed once the previous
+ * image has fed it, so the accumulators are summed in image order.
+ */
+static void add_feed_tasks(TaskGraph *g, FeedJob *jobs, int i) {
+  FeedJob *job = &jobs[i];
+  int num_bands = job->b->num_bands;
+  int call = i * (num_bands + 1);
+  int gaussian[MAX_BANDS + 1];
+  int laplacian[MAX_BANDS + 1];
+
+  if (job->b->zones) {
+    for (int tile = 0; tile < level_tiles(job->img->width, job->img->height);
+         tile++) {
+      add_task(g, copy_direct_task, job, level_task(0, tile));
+    }
+  }
 
-  NormalThreadData ntd = {b->out[0].width, 0, b->out, b->out_mask,
-                          b->final_out};
-  WorkerThreadArgs wtd;
-  wtd.ntd = &ntd;
-  ParallelOperatorArgs args = {b->out[0].height, &wtd};
+  int prepare = add_task(g, prepare_feed_task, job, 0);
+  if (i >= FEED_WINDOW) {
+    add_dependency(g, prepare, jobs[i - FEED_WINDOW].cleanup);
+  }
 
-  parallel_operator(NORMALIZE, &args);
-  destroy_image_f(&b->out[0]);
+  for (int level = 0; level <= num_bands; ++level) {
+    ImageS *image = &job->gaussian[level];
+    ImageS *mask = &job->mask_gaussian[level];
+    ImageS *finer = &job->gaussian[level - (level > 0)];
+    gaussian[level] = -1;
+    for (int tile = 0; tile < level_tiles(image->width, image->height);
+         tile++) {
+      int task = add_task(g, gaussian_task, job, level_task(level, tile));
+      if (!tile) {
+        gaussian[level] = task;
+      }
+      if (!level) {
+        add_dependency(g, task, prepare);
+        continue;
+      }
+
+      StitchRect r = task_rect(level_task(level, tile), image->width,
+                               image->height);
+      depend_on_tiles(g, task, gaussian[level - 1], finer->width,
+                      finer->height, 2 * r.x - 2, 2 * r.y - 2,
+                      2 * (r.x + r.width), 2 * (r.y + r.height));
+
+      SamplingThreadData s = {0,    image->width,
+                              image->height, finer,
+                              NULL, IMAGES};
+      SamplingThreadData m = {0,   mask->width,
+                              mask->height, &job->mask_gaussian[level - 1],
+                              NULL, IMAGES};
+      WorkerThreadArgs w;
+      w.std = &s;
+      unsigned long long bytes = tile_bytes(DOWNSAMPLE, &w, r, image->width);
+      if (has_mask_pyramid(job)) {
+        w.std = &m;
+        bytes += tile_bytes(DOWNSAMPLE, &w, r, image->width);
+      }
+      set_task_operator(g, task, DOWNSAMPLE, call + level, bytes);
+    }
+  }
+
+  for (int level = 0; level < num_bands; ++level) {
+    ImageS *lap = &job->laplacians[level];
+    ImageS *coarse = &job->gaussian[level + 1];
+    laplacian[level] = -1;
+    for (int tile = 0; tile < level_tiles(lap->width, lap->height); tile++) {
+      int task = add_task(g, laplacian_task, job, level_task(level, tile));
+      if (!tile) {
+        laplacian[level] = task;
+      }
+      StitchRect r =
+          task_rect(level_task(level, tile), lap->width, lap->height);
+      add_dependency(g, task, gaussian[level] + tile);
+      depend_on_tiles(g, task, gaussian[level + 1], coarse->width,
+                      coarse->height, max(0, r.x - 2) / 2,
+                      max(0, r.y - 2) / 2, (r.x + r.width + 1) / 2,
+                      (r.y + r.height + 1) / 2);
+
+      SamplingThreadData s = {4.f,  lap->width, lap->height,
+                              coarse, NULL,      IMAGES};
+      LaplacianThreadData l = {&job->gaussian[level], lap,
+                               (size_t)lap->width * lap->channels};
+      WorkerThreadArgs sampling, subtract;
+      sampling.std = &s;
+      subtract.ltd = &l;
+      set_task_operator(g, task, LAPLACIAN, call + level,
+                        tile_bytes(UPSAMPLE, &sampling, r, lap->width) +
+                            tile_bytes(LAPLACIAN, &subtract, r, lap->width));
+    }
+  }
+  laplacian[num_bands] = gaussian[num_bands];
+
+  for (int level = 0; level <= num_bands; ++level) {
+    FeedThreadData *f = &job->feeds[level];
+    ImageS *lap = &job->laplacians[level];
+    int tiles = level_tiles(f->cols, f->rows);
+    int first = -1;
+    for (int tile = 0; tile < tiles; tile++) {
+      int task = add_task(g, feed_task, job, level_task(level, tile));
+      if (!tile) {
+        first = task;
+      }
+      StitchRect r = task_rect(level_task(level, tile), f->cols, f->rows);
+      depend_on_tiles(g, task, laplacian[level], lap->width, lap->height, r.x,
+                      r.y, r.x + r.width - 1, r.y + r.height - 1);
+      if (i > 0) {
+        add_dependency(g, task, jobs[i - 1].fed[level]);
+      }
+      StitchRect canvas_rows = {r.x, r.y + f->y_tl, r.width, r.height};
+      place_tile(g, task, canvas_rows, f->out_level_height);
 
-  b->result.data =
-      (unsigned char *)malloc(b->output_size.width * b->output_size.height *
-                              RGB_CHANNELS * sizeof(unsigned char));
+      WorkerThreadArgs w;
+      w.ftd = f;
+      set_task_operator(g, task, FEED, call + level,
+                        tile_bytes(FEED, &w, r, f->cols));
+    }
 
-  b->result.channels = RGB_CHANNELS;
-  b->result.width = b->output_size.width;
-  b->result.height = b->output_size.height;
+    job->fed[level] = add_task(g, join_task, job, level);
+    for (int tile = 0; tile < tiles; tile++) {
+      add_dependency(g, job->fed[level], first + tile);
+    }
+  }
 
-  convert_images_to_image(&b->final_out[0], &b->result);
-  destroy_image_s(&b->final_out[0]);
-  b->final_out = NULL;
+  // everything above may still read the pyramid
+  job->cleanup = add_task(g, cleanup_feed_task, job, 0);
+  set_task_cleanup(g, job->cleanup);
+  for (int task = prepare; task >= 0 && task < job->cleanup; task++) {
+    add_dependency(g, job->cleanup, task);
+  }
 }
 
-void blend(Blender *b) {
-  if (b->blender_type == MULTIBAND) {
-    multi_band_blend(b);
-  } else {
-    feather_blend(b);
+// Mertens' well-exposedness is a gaussian around mid gray
+#define FUSION_SIGMA 0.2f
+
+static void init_fusion_weights(const Blender *b, FusionWeights *w) {
+  w->contrast = b->fusion_contrast;
+  w->saturation = b->fusion_saturation;
+  for (int v = 0; v < 256; v++) {
+    float d = v / 255.f - 0.5f;
+    w->exposedness[v] = expf(-b->fusion_exposedness * d * d /
+                             (2.f * FUSION_SIGMA * FUSION_SIGMA));
   }
 }
 
-void parallel_operator(OperatorType operatorType, ParallelOperatorArgs *arg) {
-  int numThreads = get_cpus_count();
-  int rowsPerThread = arg->rows / numThreads;
-  int remainingRows = arg->rows % numThreads;
+static int allocate_reach(FeedJob *job, int count) {
+  int levels = job->b->num_bands + 1;
+  job->reach = (StitchRect *)stitch_malloc((size_t)max(count, 1) * 2 *
+                                           levels * sizeof(StitchRect));
+  if (!job->reach) {
+    return 0;
+  }
+  for (int level = 0; level < levels; level++) {
+    job->gaussian_reach[level] = job->reach + (size_t)level * count;
+    job->laplacian_reach[level] = job->reach + (size_t)(levels + level) * count;
+  }
+  job->reach_count = count;
+  return 1;
+}
 
-  pthread_t threads[numThreads];
-  ThreadArgs thread_data[numThreads];
+// the pyramid of the job everywhere
+static int reach_whole_levels(FeedJob *job) {
+  if (!allocate_reach(job, 1)) {
+    return 0;
+  }
+  for (int level = 0; level <= job->b->num_bands; level++) {
+    StitchRect whole = {0, 0, job->gaussian[level].width,
+                        job->gaussian[level].height};
+    job->gaussian_reach[level][0] = whole;
+    job->laplacian_reach[level][0] = whole;
+  }
+  return 1;
+}
 
-  int startRow = 0;
-  for (unsigned int i = 0; i < numThreads; ++i) {
-    int endRow = startRow + rowsPerThread + (remainingRows > 0 ? 1 : 0);
-    if (remainingRows > 0) {
-      --remainingRows;
+/*
+ * Rect slot of every level of the job for a zone: the laplacians wherever
+ * the collapse of the zone reads them, and the gaussian levels wherever
+ * those laplacians and the coarser gaussian levels read them, in the
+ * coordinates of the job's levels.
+ */
+static void reach_zone(FeedJob *job, int slot, StitchRect zone) {
+  Blender *b = job->b;
+  int num_bands = b->num_bands;
+  int x_tl = job->tl_new.x - b->output_size.x;
+  int y_tl = job->tl_new.y - b->output_size.y;
+
+  StitchRect canvas = zone;
+  for (int level = 0; level <= num_bands; level++) {
+    if (level) {
+      canvas = upsample_reach(canvas, b->out_width_levels[level],
+                              b->out_height_levels[level]);
     }
+    StitchRect placed = {canvas.x - (x_tl >> level),
+                         canvas.y - (y_tl >> level), canvas.width,
+                         canvas.height};
+    StitchRect whole = {0, 0, job->gaussian[level].width,
+                        job->gaussian[level].height};
+    job->laplacian_reach[level][slot] = intersect_rects(placed, whole);
+  }
 
-    switch (operatorType) {
-    case UPSAMPLE:
-    case DOWNSAMPLE:
-      thread_data[i].end_index = endRow;
-      thread_data[i].start_index = startRow;
-      thread_data[i].workerThreadArgs = arg->workerThreadArgs;
-      if (operatorType == DOWNSAMPLE) {
-        switch (arg->workerThreadArgs->std->image_type) {
-        case IMAGE:
-          pthread_create(&threads[i], NULL, down_sample_operation,
-                         &thread_data[i]);
-          break;
-        case IMAGES:
-          pthread_create(&threads[i], NULL, down_sample_operation_s,
-                         &thread_data[i]);
-          break;
-        case IMAGEF:
-          pthread_create(&threads[i], NULL, down_sample_operation_f,
-                         &thread_data[i]);
-          break;
-        default:
-          break;
-        }
-      } else {
-        switch (arg->workerThreadArgs->std->image_type) {
-        case IMAGE:
-          pthread_create(&threads[i], NULL, upsample_worker, &thread_data[i]);
-          break;
-        case IMAGES:
-          pthread_create(&threads[i], NULL, upsample_worker_s, &thread_data[i]);
-          break;
-        case IMAGEF:
-          pthread_create(&threads[i], NULL, upsample_worker_f, &thread_data[i]);
-          break;
-        default:
-          break;
-        }
-      }
+  for (int level = num_bands; level >= 0; level--) {
+    const ImageS *gaussian = &job->gaussian[level];
+    StitchRect r = job->laplacian_reach[level][slot];
+    if (level > 0) {
+      r = unite_rects(r, upsample_reach(job->laplacian_reach[level - 1][slot],
+                                        gaussian->width, gaussian->height));
+    }
+    if (level < num_bands) {
+      r = unite_rects(r, downsample_reach(job->gaussian_reach[level + 1][slot],
+                                          gaussian->width, gaussian->height));
+    }
+    job->gaussian_reach[level][slot] = r;
+  }
+}
 
-      break;
-    case FEED:
-      thread_data[i].end_index = endRow;
-      thread_data[i].start_index = startRow;
-      thread_data[i].workerThreadArgs = arg->workerThreadArgs;
-      pthread_create(&threads[i], NULL, feed_worker, &thread_data[i]);
-      break;
-    case LAPLACIAN:
-      thread_data[i].end_index = endRow;
-      thread_data[i].start_index = startRow;
-      thread_data[i].workerThreadArgs = arg->workerThreadArgs;
-      pthread_create(&threads[i], NULL, compute_laplacian_worker,
-                     &thread_data[i]);
-      break;
-    case BLEND:
-      thread_data[i].end_index = endRow;
-      thread_data[i].start_index = startRow;
-      thread_data[i].workerThreadArgs = arg->workerThreadArgs;
-      pthread_create(&threads[i], NULL, blend_worker, &thread_data[i]);
-      break;
-    case NORMALIZE:
-      thread_data[i].end_index = endRow;
-      thread_data[i].start_index = startRow;
-      thread_data[i].workerThreadArgs = arg->workerThreadArgs;
-      pthread_create(&threads[i], NULL, normalize_worker, &thread_data[i]);
-      break;
+// the box of the non-zero values of the last channel
+static StitchRect weight_bounds(const Image *img) {
+  int channels = img->channels;
+  int x0 = img->width, y0 = img->height, x1 = 0, y1 = 0;
+  for (int y = 0; y < img->height; y++) {
+    const unsigned char *w =
+        img->data + (size_t)y * img->width * channels + channels - 1;
+    int first = 0;
+    while (first < img->width && !w[first * channels]) {
+      first++;
     }
+    if (first == img->width) {
+      continue;
+    }
+    int last = img->width - 1;
+    while (last >= x1 && last > first && !w[last * channels]) {
+      last--;
+    }
+    x0 = min(x0, first);
+    x1 = max(x1, last + 1);
+    y0 = min(y0, y);
+    y1 = y + 1;
+  }
+  StitchRect r = {x0, y0, max(x1 - x0, 0), max(y1 - y0, 0)};
+  return r;
+}
 
-    startRow = endRow;
+/*
+ * How far from its non-zero weights an input still weighs on the collapse,
+ * in level 0 pixels. Down the pyramid the 5 tap filters of level l spread
+ * a weight by 2 of its pixels, up the collapse they gather from as far
+ * again, plus the rounding of the coarse coordinates.
+ */
+static int seam_reach(const Blender *b) { return 5 << b->num_bands; }
+
+/*
+ * The zones of a seam-local feed: where the grown weights of two inputs
+ * overlap. Every job builds its pyramid for the zones it is part of, and
+ * b->direct receives the pixels outside all of them.
+ */
+static int find_seam_zones(Blender *b, FeedJob *jobs, int count) {
+  int reach = seam_reach(b);
+  StitchRect canvas = {0, 0, b->output_size.width, b->output_size.height};
+  StitchRect *grown = (StitchRect *)stitch_malloc(count * sizeof(StitchRect));
+  int *zones = (int *)stitch_calloc(count, sizeof(int));
+  b->direct =
+      create_empty_image(min(b->output_size.width, b->real_out_size.width),
+                         min(b->output_size.height, b->real_out_size.height),
+                         b->channels + 1);
+  int return_val = 0;
+  if (!grown || !zones || !b->direct.data) {
+    goto clean;
   }
 
-  for (unsigned int i = 0; i < numThreads; ++i) {
-    pthread_join(threads[i], NULL);
+  for (int i = 0; i < count; i++) {
+    FeedJob *job = &jobs[i];
+    StitchRect r =
+        weight_bounds(job->mask_img ? job->mask_img : job->img);
+    if (!rect_empty(r)) {
+      r.x += job->tl.x - b->output_size.x - reach;
+      r.y += job->tl.y - b->output_size.y - reach;
+      r.width += 2 * reach;
+      r.height += 2 * reach;
+      r = intersect_rects(r, canvas);
+    }
+    grown[i] = r;
+  }
+
+  b->zone_count = 0;
+  for (int i = 0; i < count; i++) {
+    for (int j = i + 1; j < count; j++) {
+      if (!rect_empty(intersect_rects(grown[i], grown[j]))) {
+        zones[i]++;
+        zones[j]++;
+        b->zone_count++;
+      }
+    }
+  }
+  b->zones = (StitchRect *)stitch_malloc(max(b->zone_count, 1) *
+                                         sizeof(StitchRect));
+  if (!b->zones) {
+    goto clean;
+  }
+  for (int i = 0; i < count; i++) {
+    if (!allocate_reach(&jobs[i], zones[i])) {
+      goto clean;
+    }
+    zones[i] = 0;
+  }
+
+  b->zone_count = 0;
+  for (int i = 0; i < count; i++) {
+    for (int j = i + 1; j < count; j++) {
+      StitchRect zone = intersect_rects(grown[i], grown[j]);
+      if (!rect_empty(zone)) {
+        b->zones[b->zone_count++] = zone;
+        reach_zone(&jobs[i], zones[i]++, zone);
+        reach_zone(&jobs[j], zones[j]++, zone);
+      }
+    }
+  }
+  return_val = 1;
+
+clean:
+  if (!return_val) {
+    stitch_free(b->zones);
+    b->zones = NULL;
+    b->zone_count = 0;
+    destroy_image(&b->direct);
+  }
+  stitch_free(grown);
+  stitch_free(zones);
+  return return_val;
+}
+
+static int multi_band_feed_many(Blender *b, Image **imgs, Image **masks,
+                                StitchPoint *tls, int count) {
+  FeedJob *jobs = (FeedJob *)stitch_calloc(count, sizeof(FeedJob));
+  TaskGraph *g = create_task_graph();
+  FusionWeights fusion;
+  if (b->blender_type == FUSION) {
+    init_fusion_weights(b, &fusion);
+  }
+
+  int return_val = 0;
+  if (jobs && g) {
+    for (int i = 0; i < count; i++) {
+      init_feed_job(&jobs[i], b, imgs[i], masks ? masks[i] : NULL,
+                    b->blender_type == FUSION ? &fusion : NULL, tls[i]);
+    }
+    int reached = 1;
+    if (b->seam_local && b->blender_type == MULTIBAND) {
+      reached = find_seam_zones(b, jobs, count);
+    } else {
+      for (int i = 0; i < count && reached; i++) {
+        reached = reach_whole_levels(&jobs[i]);
+      }
+    }
+    if (reached) {
+      for (int i = 0; i < count; i++) {
+        add_feed_tasks(g, jobs, i);
+      }
+      return_val = run_task_graph(g, get_cpus_count());
+    }
+  }
+  for (int i = 0; jobs && i < count; i++) {
+    stitch_free(jobs[i].reach);
+  }
+  destroy_task_graph(g);
+  stitch_free(jobs);
+  return return_val;
+}
+
+void *feather_feed_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  int start_row = arg->start_index;
+  int end_row = arg->end_index;
+  FeatherThreadData *f = (FeatherThreadData *)arg->workerThreadArgs->fth;
+  int channels = f->out->channels;
+
+  for (int k = start_row; k < end_row; ++k) {
+    int src_y = f->src_y + k;
+    int dst_y = f->dst_y + k;
+    const unsigned char *src =
+        f->img->data + ((size_t)src_y * f->img->width + f->src_x) * channels;
+    const unsigned char *mask =
+        f->mask_img->data + (size_t)src_y * f->mask_img->width + f->src_x;
+    float *dst =
+        f->out->data + ((size_t)dst_y * f->out_width + f->dst_x) * channels;
+    float *dst_mask =
+        f->out_mask->data + (size_t)dst_y * f->out_width + f->dst_x;
+
+    if (channels == GRAY_CHANNELS) {
+      get_kernels()->feather_accumulate_gray_row(src, mask, dst, dst_mask,
+                                                 f->cols);
+    } else {
+      feather_accumulate_row(src, mask, dst, dst_mask, f->cols);
+    }
+  }
+
+  return NULL;
+}
+
+int feather_feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
+  double stage_start = stats_begin();
+  if (b->do_distance_transform) {
+    distance_transform(mask_img);
+  }
+
+  // clip the placement against the canvas once instead of per pixel
+  int x_tl = max(tl.x, 0);
+  int y_tl = max(tl.y, 0);
+  int x_br = min(tl.x + img->width, b->output_size.width);
+  int y_br = min(tl.y + img->height, b->output_size.height);
+
+  if (x_br <= x_tl || y_br <= y_tl) {
+    stats_record_stage(STAGE_FEED, stage_start);
+    return 1;
+  }
+
+  FeatherThreadData fth;
+  fth.cols = x_br - x_tl;
+  fth.src_x = x_tl - tl.x;
+  fth.src_y = y_tl - tl.y;
+  fth.dst_x = x_tl;
+  fth.dst_y = y_tl;
+  fth.out_width = b->output_size.width;
+  fth.img = img;
+  fth.mask_img = mask_img;
+  fth.out = b->out;
+  fth.out_mask = b->out_mask;
+  fth.result = NULL;
+
+  WorkerThreadArgs wtd;
+  wtd.fth = &fth;
+  ParallelOperatorArgs args = {y_br - y_tl, &wtd};
+
+  parallel_operator(FEATHER_FEED, &args);
+  stats_record_stage(STAGE_FEED, stage_start);
+
+  return 1;
+}
+
+// feather has no pyramid, split the alpha off and take the usual path
+static int feather_feed_rgba(Blender *b, Image *img, StitchPoint tl) {
+  Image rgb = create_empty_image(img->width, img->height, RGB_CHANNELS);
+  Image mask = create_empty_image(img->width, img->height, 1);
+  int return_val = 0;
+  if (rgb.data && mask.data) {
+    size_t pixels = (size_t)img->width * img->height;
+    for (size_t i = 0; i < pixels; i++) {
+      memcpy(rgb.data + i * RGB_CHANNELS, img->data + i * RGBA_CHANNELS,
+             RGB_CHANNELS);
+      mask.data[i] = img->data[i * RGBA_CHANNELS + 3];
+    }
+    return_val = feather_feed(b, &rgb, &mask, tl);
+  }
+  destroy_image(&rgb);
+  destroy_image(&mask);
+  return return_val;
+}
+
+int feed_many(Blender *b, Image **imgs, Image **masks, StitchPoint *tls,
+              int count) {
+  for (int i = 0; i < count; i++) {
+    Image *mask_img = masks ? masks[i] : NULL;
+    if (mask_img) {
+      assert(imgs[i]->height == mask_img->height &&
+             imgs[i]->width == mask_img->width);
+      assert(imgs[i]->channels == b->channels);
+    } else if (b->blender_type == FUSION) {
+      assert(imgs[i]->channels == b->channels);
+    } else {
+      assert(imgs[i]->channels == RGBA_CHANNELS &&
+             b->channels == RGB_CHANNELS);
+    }
+  }
+
+  if (b->zones) {
+    fprintf(stderr, "Seam-local blenders take all images in one feed_many.\n");
+    return 0;
+  }
+
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+  int return_val = 1;
+  if (b->blender_type != FEATHER) {
+    double stage_start = stats_begin();
+    return_val = multi_band_feed_many(b, imgs, masks, tls, count);
+    stats_record_stage(STAGE_FEED, stage_start);
+  } else {
+    for (int i = 0; i < count && return_val; i++) {
+      if (masks && masks[i]) {
+        return_val = feather_feed(b, imgs[i], masks[i], tls[i]);
+      } else {
+        return_val = feather_feed_rgba(b, imgs[i], tls[i]);
+      }
+    }
+  }
+  memory_activate(previous_memory);
+  stats_activate(previous);
+  return return_val;
+}
+
+int feed(Blender *b, Image *img, Image *mask_img, StitchPoint tl) {
+  return feed_many(b, &img, &mask_img, &tl, 1);
+}
+
+int feed_rgba(Blender *b, Image *img, StitchPoint tl) {
+  return feed_many(b, &img, NULL, &tl, 1);
+}
+
+#define SCANLINE_BATCH 16
+// level 0 rows decoded between two rounds of the downsample cascade
+#define CASCADE_ROWS 128
+
+static void copy_level_row(ImageS *level, int dst_y, int src_y) {
+  size_t row_size = (size_t)level->width * level->channels;
+  memcpy(level->data + dst_y * row_size, level->data + src_y * row_size,
+         row_size * sizeof(short));
+}
+
+/*
+ * Decodes straight into the bordered level 0 and downsamples every level as
+ * soon as the rows it reads (2y - 2 .. 2y + 2) are in, so the gaussian
+ * pyramid is built while they are still in cache. The 8 bit image, its
+ * bordered copy and the widening pass of feed() are never made.
+ * Border rows and columns mirror the image through bordered_source_row()
+ * and store_bordered_row(), as the feed of an 8 bit image does.
+ */
+static int stream_gaussian_pyramid(Blender *b, JpegScanlineReader *reader,
+                                   int width, int height, int top, int left,
+                                   int bottom, int right, ImageS *images) {
+  int channels = b->channels;
+  images[0] = create_empty_image_s(width + left + right, height + top + bottom,
+                                   channels);
+  if (!images[0].data)
+    return 0;
+
+  SamplingThreadData levels[MAX_BANDS + 1];
+  int done[MAX_BANDS + 1] = {0};
+  for (int l = 1; l <= b->num_bands; l++) {
+    images[l] = create_empty_image_s(images[l - 1].width / 2,
+                                     images[l - 1].height / 2, channels);
+    if (!images[l].data)
+      return 0;
+    SamplingThreadData std = {0,           images[l].width, images[l].height,
+                              &images[l - 1], images[l].data, IMAGES};
+    levels[l] = std;
+  }
+
+  unsigned char *rows = (unsigned char *)stitch_malloc(
+      (size_t)width * channels * SCANLINE_BATCH);
+  if (!rows)
+    return 0;
+
+  int decoded = 0, cascaded = 0, top_done = top == 0;
+  while (decoded < height) {
+    int count = read_jpeg_scanlines(reader, rows, SCANLINE_BATCH);
+    if (count <= 0)
+      break;
+    for (int i = 0; i < count; i++) {
+      store_bordered_row(&images[0], top + decoded + i,
+                         rows + (size_t)i * width * channels, width, left, 0,
+                         images[0].width);
+    }
+    decoded += count;
+    if (decoded < height && decoded - cascaded < CASCADE_ROWS)
+      continue;
+    cascaded = decoded;
+
+    int ready = 0;
+    if (!top_done && decoded >= min(top, height)) {
+      for (int y = 0; y < top; y++) {
+        copy_level_row(&images[0], y, top + bordered_source_row(y, top, height));
+      }
+      top_done = 1;
+    }
+    if (top_done)
+      ready = top + decoded;
+    if (decoded == height) {
+      for (int y = top + height; y < images[0].height; y++) {
+        copy_level_row(&images[0], y, top + bordered_source_row(y, top, height));
+      }
+      ready = images[0].height;
+    }
+
+    for (int l = 1; l <= b->num_bands; l++) {
+      int available = l == 1 ? ready : done[l - 1];
+      int target = available == images[l - 1].height
+                       ? images[l].height
+                       : min(images[l].height, max(0, (available - 1) / 2));
+      if (target > done[l]) {
+        WorkerThreadArgs wtd;
+        wtd.std = &levels[l];
+        ParallelOperatorArgs args = {target - done[l], &wtd, done[l]};
+        parallel_operator(DOWNSAMPLE, &args);
+        done[l] = target;
+      }
+    }
+  }
+
+  stitch_free(rows);
+  return decoded == height;
+}
+
+static int multi_band_feed_jpeg(Blender *b, JpegScanlineReader *reader,
+                                int width, int height, Image *mask_img,
+                                StitchPoint tl) {
+  ImageS images[b->num_bands + 1];
+  int return_val = 1;
+
+  memset(images, 0, sizeof(images));
+  memset(b->img_laplacians, 0, (b->num_bands + 1) * sizeof(ImageS));
+  memset(b->mask_gaussian, 0, (b->num_bands + 1) * sizeof(ImageS));
+
+  StitchPoint tl_new, br_new;
+  feed_region(b, width, height, tl, &tl_new, &br_new);
+
+  int top = tl.y - tl_new.y;
+  int left = tl.x - tl_new.x;
+  int bottom = br_new.y - tl.y - height;
+  int right = br_new.x - tl.x - width;
+
+  double stage_start = stats_begin();
+  if (!stream_gaussian_pyramid(b, reader, width, height, top, left, bottom,
+                               right, images) ||
+      !build_laplacians(b, images) ||
+      !build_mask_pyramid(b, mask_img, top, left, bottom, right)) {
+    return_val = 0;
+    goto clean;
+  }
+  stats_record_stage(STAGE_PYRAMID, stage_start);
+
+  stage_start = stats_begin();
+  feed_levels(b, tl_new, br_new);
+  stats_record_stage(STAGE_FEED, stage_start);
+clean:
+  b->img_laplacians[b->num_bands].data = NULL;
+  for (int i = 0; i <= b->num_bands; i++) {
+    destroy_image_s(&images[i]);
+    destroy_image_s(&b->img_laplacians[i]);
+    destroy_image_s(&b->mask_gaussian[i]);
+  }
+
+  return return_val;
+}
+
+/*
+ * Feather reads every pixel once and fusion weighs each by its neighbours,
+ * decode whole and take the usual path.
+ */
+static int decoded_feed_jpeg(Blender *b, JpegScanlineReader *reader,
+                             int width, int height, Image *mask_img,
+                             StitchPoint tl) {
+  Image img = create_empty_image(width, height, b->channels);
+  if (!img.data)
+    return 0;
+  Image *img_ptr = &img;
+  int ok = read_jpeg_scanlines(reader, img.data, height) == height &&
+           (b->blender_type == FEATHER
+                ? feather_feed(b, &img, mask_img, tl)
+                : multi_band_feed_many(b, &img_ptr, &mask_img, &tl, 1));
+  destroy_image(&img);
+  return ok;
+}
+
+int feed_jpeg(Blender *b, const unsigned char *jpeg, unsigned long size,
+              Image *mask_img, StitchPoint tl) {
+  if (b->seam_local && b->blender_type == MULTIBAND) {
+    fprintf(stderr, "Seam-local blenders take all images in one feed_many.\n");
+    return 0;
+  }
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+  int width, height;
+  int return_val = 0;
+  JpegScanlineReader *reader =
+      open_jpeg_scanlines(jpeg, size, b->channels, &width, &height);
+  int mask_fits = mask_img ? width == mask_img->width &&
+                                  height == mask_img->height
+                            : b->blender_type == FUSION;
+  if (reader && mask_fits) {
+    if (b->blender_type == MULTIBAND) {
+      return_val =
+          multi_band_feed_jpeg(b, reader, width, height, mask_img, tl);
+    } else {
+      return_val = decoded_feed_jpeg(b, reader, width, height, mask_img, tl);
+    }
+  } else if (reader) {
+    fprintf(stderr, "JPEG and mask sizes differ.\n");
+  }
+  close_jpeg_scanlines(reader);
+  memory_activate(previous_memory);
+  stats_activate(previous);
+  return return_val;
+}
+
+void *blend_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  int start_row = arg->start_index;
+  int end_row = arg->end_index;
+  BlendThreadData *b = (BlendThreadData *)arg->workerThreadArgs->btd;
+  short *blended = b->blended_image.data + (size_t)start_row * b->row_size;
+  const short *level = b->out_level.data + (size_t)start_row * b->row_size;
+  size_t count = (size_t)(end_row - start_row) * b->row_size;
+  for (size_t i = 0; i < count; ++i) {
+    blended[i] = blended[i] + level[i];
+  }
+  return NULL;
+}
+
+void *normalize_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  get_kernels()->normalize_rows(arg->workerThreadArgs->ntd, arg->start_index,
+                                arg->end_index);
+  return NULL;
+}
+
+// appends the accumulated weight of every pixel to an RGB result as alpha
+static int attach_coverage_alpha(Image *img, const ImageF *coverage) {
+  size_t pixels = (size_t)img->width * img->height;
+  unsigned char *rgba =
+      (unsigned char *)stitch_malloc(pixels * RGBA_CHANNELS);
+  if (!rgba) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < pixels; i++) {
+    memcpy(rgba + i * RGBA_CHANNELS, img->data + i * RGB_CHANNELS,
+           RGB_CHANNELS);
+    rgba[i * RGBA_CHANNELS + 3] =
+        (unsigned char)clamp((int)(coverage->data[i] * 255.0f + 0.5f), 0, 255);
+  }
+
+  stitch_free(img->data);
+  img->data = rgba;
+  img->channels = RGBA_CHANNELS;
+  return 1;
+}
+
+// a finished collapse level as 8 bit, uncovered pixels cleared, cropped to
+// the real canvas size at that scale
+static Image level_rendition(Blender *b, ImageS *collapsed, int level) {
+  int real_width = (b->real_out_size.width + (1 << level) - 1) >> level;
+  int real_height = (b->real_out_size.height + (1 << level) - 1) >> level;
+  Image out = create_empty_image(min(collapsed->width, real_width),
+                                 min(collapsed->height, real_height),
+                                 collapsed->channels);
+  if (!out.data) {
+    return out;
+  }
+
+  size_t row = (size_t)collapsed->width * collapsed->channels;
+  for (int y = 0; y < out.height; y++) {
+    get_kernels()->render_row(
+        collapsed->data + y * row, NULL,
+        b->out_mask[level].data + (size_t)y * collapsed->width,
+        out.data + (size_t)y * out.width * out.channels, out.channels, 0,
+        out.width);
+  }
+  return out;
+}
+
+static void emit_level(Blender *b, ImageS *collapsed, int level) {
+  Image rendition = level_rendition(b, collapsed, level);
+  destroy_image_f(&b->out_mask[level]);
+  if (b->level_sink) {
+    if (rendition.data) {
+      b->level_sink(b->level_sink_user, &rendition, level);
+    }
+    destroy_image(&rendition);
+    return;
+  }
+  destroy_image(&b->level_results[level]);
+  b->level_results[level] = rendition;
+}
+
+typedef struct {
+  Blender *b;
+  unsigned int levels;
+  // collapsed[j] is the blend down to level j, collapsed[num_bands] the
+  // normalized coarsest level
+  ImageS collapsed[MAX_BANDS + 1];
+  NormalThreadData normal[MAX_BANDS + 1];
+  // reach_count rects of each level that are normalized and collapsed: all
+  // of it, or what the collapse of the zones of a seam-local feed reads
+  StitchRect *reach[MAX_BANDS + 1];
+  StitchRect *reach_rects;
+  int reach_count;
+} BlendJob;
+
+static int init_blend_reach(BlendJob *job) {
+  Blender *b = job->b;
+  int levels = b->num_bands + 1;
+  int count = b->zones ? b->zone_count : 1;
+  job->reach_rects = (StitchRect *)stitch_malloc(
+      (size_t)max(count, 1) * levels * sizeof(StitchRect));
+  if (!job->reach_rects) {
+    return 0;
+  }
+  job->reach_count = count;
+  for (int level = 0; level < levels; level++) {
+    job->reach[level] = job->reach_rects + (size_t)level * count;
+  }
+  for (int i = 0; i < count; i++) {
+    for (int level = 0; level < levels; level++) {
+      int width = b->out_width_levels[level];
+      int height = b->out_height_levels[level];
+      StitchRect whole = {0, 0, width, height};
+      if (!b->zones) {
+        job->reach[level][i] = whole;
+      } else if (!level) {
+        job->reach[level][i] = intersect_rects(b->zones[i], whole);
+      } else {
+        job->reach[level][i] =
+            upsample_reach(job->reach[level - 1][i], width, height);
+      }
+    }
+  }
+  return 1;
+}
+
+static int normalize_task(void *user, int index) {
+  BlendJob *job = (BlendJob *)user;
+  int level = task_level(index);
+  NormalThreadData n = job->normal[level];
+  const ImageS *normal = &n.final_out[level];
+  StitchRect tile = task_rect(index, normal->width, normal->height);
+  for (int i = 0; i < job->reach_count; i++) {
+    StitchRect r = intersect_rects(tile, job->reach[level][i]);
+    if (!rect_empty(r)) {
+      n.start_col = r.x;
+      n.end_col = r.x + r.width;
+      get_kernels()->normalize_rows(&n, r.y, r.y + r.height);
+    }
+  }
+  return 1;
+}
+
+// once a level is normalized only a requested rendition needs its weights
+static int release_accumulators_task(void *user, int level) {
+  BlendJob *job = (BlendJob *)user;
+  Blender *b = job->b;
+  destroy_image_f(&b->out[level]);
+  if (level > 0 && !(job->levels & (1u << level))) {
+    destroy_image_f(&b->out_mask[level]);
+  }
+  return 1;
+}
+
+static int allocate_collapse_task(void *user, int level) {
+  BlendJob *job = (BlendJob *)user;
+  const ImageS *normalized = &job->b->final_out[level];
+  job->collapsed[level] = level_header(normalized->width, normalized->height,
+                                       normalized->channels);
+  return allocate_level(&job->collapsed[level]);
+}
+
+static int collapse_task(void *user, int index) {
+  BlendJob *job = (BlendJob *)user;
+  int level = task_level(index);
+  ImageS *collapsed = &job->collapsed[level];
+  const ImageS *normalized = &job->b->final_out[level];
+  StitchRect tile = task_rect(index, collapsed->width, collapsed->height);
+  size_t row = (size_t)collapsed->width * collapsed->channels;
+
+  for (int i = 0; i < job->reach_count; i++) {
+    StitchRect r = intersect_rects(tile, job->reach[level][i]);
+    if (rect_empty(r)) {
+      continue;
+    }
+    SamplingThreadData s = {4.f,           collapsed->width,
+                            collapsed->height, &job->collapsed[level + 1],
+                            collapsed->data,   IMAGES};
+    s.start_col = r.x;
+    s.end_col = r.x + r.width;
+    get_kernels()->upsample_s(&s, r.y, r.y + r.height);
+
+    for (int y = r.y; y < r.y + r.height; y++) {
+      size_t end = y * row + (size_t)(r.x + r.width) * collapsed->channels;
+      for (size_t p = y * row + (size_t)r.x * collapsed->channels; p < end;
+           p++) {
+        collapsed->data[p] = collapsed->data[p] + normalized->data[p];
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * The finest collapse goes straight into b->result: each row of a tile is
+ * upsampled, added to the normalized level and rendered, so level 0 is
+ * never collapsed into a buffer of its own and needs no separate
+ * conversion, masking or crop. Without bands the normalized level is
+ * rendered as is. Outside the zones of a seam-local feed the pixels it
+ * copied are taken instead.
+ */
+static int render_task(void *user, int index) {
+  BlendJob *job = (BlendJob *)user;
+  Blender *b = job->b;
+  Image *result = &b->result;
+  const ImageS *normal =
+      b->num_bands ? &b->final_out[0] : &job->collapsed[0];
+  StitchRect r = task_rect(index, result->width, result->height);
+  int channels = normal->channels;
+  size_t row = (size_t)normal->width * channels;
+
+  short *upsampled = NULL;
+  if (b->num_bands) {
+    upsampled = (short *)stitch_malloc(row * sizeof(short));
+    if (!upsampled) {
+      return 0;
+    }
+  }
+  SamplingThreadData s = {4.f,           normal->width, normal->height,
+                          &job->collapsed[1], upsampled,  IMAGES};
+  int end = r.x + r.width;
+  for (int y = r.y; y < r.y + r.height; y++) {
+    for (int x = r.x; x < end;) {
+      int inside;
+      int stop =
+          rect_run(job->reach[0], job->reach_count, y, x, end, &inside);
+      unsigned char *dst =
+          result->data + ((size_t)y * result->width + x) * result->channels;
+      if (!inside) {
+        copy_direct_row(b, y, x, stop, dst, result->channels);
+        x = stop;
+        continue;
+      }
+
+      const short *level = normal->data + y * row + x * channels;
+      if (upsampled) {
+        s.first_row = y;
+        s.start_col = x;
+        s.end_col = stop;
+        get_kernels()->upsample_s(&s, y, y + 1);
+      }
+      get_kernels()->render_row(
+          upsampled ? upsampled + x * channels : level,
+          upsampled ? level : NULL,
+          b->out_mask[0].data + (size_t)y * normal->width + x, dst, channels,
+          result->channels > channels, stop - x);
+      x = stop;
+    }
+  }
+  stitch_free(upsampled);
+  return 1;
+}
+
+// renditions are emitted one at a time, coarsest first, like the sinks expect
+static int emit_task(void *user, int level) {
+  BlendJob *job = (BlendJob *)user;
+  emit_level(job->b, &job->collapsed[level], level);
+  return 1;
+}
+
+static int release_collapse_task(void *user, int level) {
+  BlendJob *job = (BlendJob *)user;
+  destroy_image_s(&job->collapsed[level + 1]);
+  destroy_image_s(&job->b->final_out[level]);
+  return 1;
+}
+
+/*
+ * Normalizes every level from first_level on and collapses them into
+ * job->collapsed[first_level], or b->result for level 0. A tile of a level
+ * is collapsed as soon as its normalized pixels and the coarse ones it
+ * upsamples are there, and each level is released as soon as the next
+ * finer one no longer needs it.
+ */
+static int collapse_levels(BlendJob *job, int first_level) {
+  Blender *b = job->b;
+  int num_bands = b->num_bands;
+  int normalized[MAX_BANDS + 1];
+  TaskGraph *g = create_task_graph();
+  if (!g) {
+    return 0;
+  }
+
+  // coarse levels first, the collapse starts from them
+  for (int level = num_bands; level >= first_level; --level) {
+    NormalThreadData *n = &job->normal[level];
+    const ImageS *normal = &n->final_out[level];
+    int tiles = level_tiles(normal->width, normal->height);
+    normalized[level] = -1;
+    for (int tile = 0; tile < tiles; tile++) {
+      int task = add_task(g, normalize_task, job, level_task(level, tile));
+      if (!tile) {
+        normalized[level] = task;
+      }
+      StitchRect r =
+          task_rect(level_task(level, tile), normal->width, normal->height);
+      place_tile(g, task, r, normal->height);
+      WorkerThreadArgs w;
+      w.ntd = n;
+      set_task_operator(g, task, NORMALIZE, level,
+                        tile_bytes(NORMALIZE, &w, r, normal->width));
+    }
+
+    int released = add_task(g, release_accumulators_task, job, level);
+    set_task_cleanup(g, released);
+    depend_on_level(g, released, normalized[level], normal->width,
+                    normal->height);
+  }
+
+  int coarse = normalized[num_bands];
+  int coarse_width = job->collapsed[num_bands].width;
+  int coarse_height = job->collapsed[num_bands].height;
+  int emitted = -1;
+  if (num_bands > 0 && (job->levels & (1u << num_bands))) {
+    emitted = add_task(g, emit_task, job, num_bands);
+    depend_on_level(g, emitted, coarse, coarse_width, coarse_height);
+  }
+  int coarse_emitted = emitted;
+
+  for (int level = num_bands - 1; level >= first_level; --level) {
+    ImageS *normal = &b->final_out[level];
+    // level 0 is only rendered as far as the result reaches
+    int width = level ? normal->width : b->result.width;
+    int height = level ? normal->height : b->result.height;
+    int allocated = -1;
+    if (level) {
+      allocated = add_task(g, allocate_collapse_task, job, level);
+      if (level + 1 < num_bands) {
+        add_dependency(g, allocated, coarse);
+      }
+    }
+
+    int first = -1;
+    for (int tile = 0; tile < level_tiles(width, height); tile++) {
+      int task = add_task(g, level ? collapse_task : render_task, job,
+                          level_task(level, tile));
+      if (!tile) {
+        first = task;
+      }
+      StitchRect r = task_rect(level_task(level, tile), width, height);
+      place_tile(g, task, r, height);
+      if (level) {
+        add_dependency(g, task, allocated);
+      }
+      depend_on_tiles(g, task, normalized[level], normal->width,
+                      normal->height, r.x, r.y, r.x + r.width - 1,
+                      r.y + r.height - 1);
+      depend_on_tiles(g, task, coarse, coarse_width, coarse_height,
+                      max(0, r.x - 2) / 2, max(0, r.y - 2) / 2,
+                      (r.x + r.width + 1) / 2, (r.y + r.height + 1) / 2);
+
+      SamplingThreadData s = {4.f,  normal->width,
+                              normal->height, &job->collapsed[level + 1],
+                              NULL, IMAGES};
+      BlendThreadData btd = {(size_t)normal->width * normal->channels,
+                             *normal, *normal};
+      WorkerThreadArgs sampling, add;
+      sampling.std = &s;
+      add.btd = &btd;
+      set_task_operator(g, task, BLEND, level,
+                        tile_bytes(UPSAMPLE, &sampling, r, normal->width) +
+                            tile_bytes(BLEND, &add, r, normal->width));
+    }
+
+    // the coarser blend may still be on its way to a level sink
+    int released = add_task(g, release_collapse_task, job, level);
+    set_task_cleanup(g, released);
+    depend_on_level(g, released, first, width, height);
+    if (coarse_emitted >= 0) {
+      add_dependency(g, released, coarse_emitted);
+    }
+
+    coarse_emitted = -1;
+    if (level > 0 && (job->levels & (1u << level))) {
+      coarse_emitted = add_task(g, emit_task, job, level);
+      depend_on_level(g, coarse_emitted, first, width, height);
+      if (emitted >= 0) {
+        add_dependency(g, coarse_emitted, emitted);
+      }
+      emitted = coarse_emitted;
+    }
+    coarse = first;
+    coarse_width = width;
+    coarse_height = height;
+  }
+
+  if (!num_bands && first_level == 0) {
+    const ImageS *normal = &job->collapsed[0];
+    Image *result = &b->result;
+    for (int tile = 0; tile < level_tiles(result->width, result->height);
+         tile++) {
+      int task = add_task(g, render_task, job, level_task(0, tile));
+      StitchRect r =
+          task_rect(level_task(0, tile), result->width, result->height);
+      place_tile(g, task, r, result->height);
+      depend_on_tiles(g, task, normalized[0], normal->width, normal->height,
+                      r.x, r.y, r.x + r.width - 1, r.y + r.height - 1);
+    }
+  }
+
+  int return_val = run_task_graph(g, get_cpus_count());
+  destroy_task_graph(g);
+  return return_val;
+}
+
+void multi_band_blend(Blender *b) {
+  // levels finer than the finest requested rendition are never needed
+  unsigned int levels = b->output_levels & ((2u << b->num_bands) - 1);
+  int first_level = levels ? __builtin_ctz(levels) : 0;
+
+  if (b->zones && (levels & ~1u)) {
+    fprintf(stderr, "Seam-local blenders only render the full size result.\n");
+    levels &= 1u;
+    first_level = 0;
+  }
+
+  BlendJob job;
+  memset(&job, 0, sizeof(job));
+  job.b = b;
+  job.levels = levels;
+
+  double stage_start = stats_begin();
+  if (!init_blend_reach(&job)) {
+    return;
+  }
+  if (first_level == 0) {
+    int channels = b->output_alpha && b->channels == RGB_CHANNELS
+                       ? RGBA_CHANNELS
+                       : b->channels;
+    b->result = create_empty_image(
+        min(b->output_size.width, b->real_out_size.width),
+        min(b->output_size.height, b->real_out_size.height), channels);
+    if (!b->result.data) {
+      stitch_free(job.reach_rects);
+      return;
+    }
+  }
+
+  for (int level = 0; level <= b->num_bands; ++level) {
+    if (level < first_level) {
+      destroy_image_f(&b->out[level]);
+      destroy_image_f(&b->out_mask[level]);
+      continue;
+    }
+
+    b->final_out[level] = create_empty_image_s(
+        b->out[level].width, b->out[level].height, b->out[level].channels);
+    if (!b->final_out[level].data) {
+      destroy_image(&b->result);
+      stitch_free(job.reach_rects);
+      return;
+    }
+    NormalThreadData ntd = {b->out[level].width, level, b->out, b->out_mask,
+                            b->final_out};
+    job.normal[level] = ntd;
+  }
+
+  // the coarsest level is normalized straight into the collapse
+  job.collapsed[b->num_bands] = b->final_out[b->num_bands];
+  job.normal[b->num_bands].final_out = job.collapsed;
+  b->final_out[b->num_bands].data = NULL;
+  int collapsed = collapse_levels(&job, first_level);
+  stats_record_stage(STAGE_COLLAPSE, stage_start);
+  stitch_free(job.reach_rects);
+
+  if (!collapsed) {
+    // whatever the failed graph left behind
+    for (int level = first_level; level <= b->num_bands; ++level) {
+      destroy_image_s(&job.collapsed[level]);
+      destroy_image_s(&b->final_out[level]);
+    }
+    destroy_image(&b->result);
+    return;
+  }
+  destroy_image_s(&job.collapsed[first_level]);
+  destroy_image_f(&b->out_mask[0]);
+  destroy_image(&b->direct);
+}
+
+void *feather_normalize_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  int start_row = arg->start_index;
+  int end_row = arg->end_index;
+  FeatherThreadData *f = (FeatherThreadData *)arg->workerThreadArgs->fth;
+  int channels = f->result->channels;
+
+  for (int y = start_row; y < end_row; ++y) {
+    const float *src = f->out->data + (size_t)y * f->out_width * channels;
+    const float *weights = f->out_mask->data + (size_t)y * f->out_width;
+    unsigned char *dst =
+        f->result->data + (size_t)y * f->out_width * channels;
+
+    if (channels == GRAY_CHANNELS) {
+      get_kernels()->feather_normalize_gray_row(src, weights, dst, f->cols);
+    } else {
+      feather_normalize_row(src, weights, dst, f->cols);
+    }
+  }
+  return NULL;
+}
+
+void feather_blend(Blender *b) {
+  double stage_start = stats_begin();
+  b->result = create_empty_image(b->output_size.width, b->output_size.height,
+                                 b->channels);
+  if (!b->result.data) {
+    return;
+  }
+
+  FeatherThreadData fth;
+  fth.cols = b->output_size.width;
+  fth.out_width = b->output_size.width;
+  fth.out = b->out;
+  fth.out_mask = b->out_mask;
+  fth.result = &b->result;
+
+  WorkerThreadArgs wtd;
+  wtd.fth = &fth;
+  ParallelOperatorArgs args = {b->output_size.height, &wtd};
+
+  parallel_operator(FEATHER_NORMALIZE, &args);
+  if (b->output_alpha && b->channels == RGB_CHANNELS &&
+      !attach_coverage_alpha(&b->result, &b->out_mask[0])) {
+    destroy_image(&b->result);
+  }
+  destroy_image_f(&b->out[0]);
+  destroy_image_f(&b->out_mask[0]);
+  stats_record_stage(STAGE_NORMALIZE, stage_start);
+}
+
+void blend(Blender *b) {
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+  if (b->blender_type != FEATHER) {
+    multi_band_blend(b);
+  } else {
+    feather_blend(b);
+  }
+  memory_activate(previous_memory);
+  stats_activate(previous);
+}
+
+// normalized samples of rect r at one level, like normalize_rows
+static ImageS normalize_rect(Blender *b, int level, StitchRect r) {
+  ImageS n = create_empty_image_s(r.width, r.height, b->channels);
+  if (!n.data) {
+    return n;
+  }
+  const ImageF *out = &b->out[level];
+  const ImageF *out_mask = &b->out_mask[level];
+  for (int y = 0; y < r.height; y++) {
+    for (int x = 0; x < r.width; x++) {
+      size_t pos = (size_t)(r.y + y) * out->width + r.x + x;
+      float w = out_mask->data[pos] + WEIGHT_EPS;
+      for (int c = 0; c < b->channels; c++) {
+        n.data[((size_t)y * r.width + x) * b->channels + c] =
+            (short)(out->data[pos * b->channels + c] / w);
+      }
+    }
+  }
+  return n;
+}
+
+/*
+ * fine += upsample(coarse) over rect r, evaluated exactly like
+ * upsample_image_s on the whole level followed by blend_worker. coarse
+ * holds rect cr of the next level.
+ */
+static void collapse_rect(const ImageS *coarse, StitchRect cr, ImageS *fine,
+                          StitchRect r, int level_width, int level_height) {
+  int channels = fine->channels;
+  for (int y = 0; y < r.height; y++) {
+    for (int x = 0; x < r.width; x++) {
+      for (int c = 0; c < channels; c++) {
+        float sum = 0;
+        for (int ki = 0; ki < 5; ki++) {
+          for (int kj = 0; kj < 5; kj++) {
+            int src_i = reflect_index(r.y + y + ki - 2, level_height);
+            int src_j = reflect_index(r.x + x + kj - 2, level_width);
+            int pixel_val = 0;
+            if (src_i % 2 == 0 && src_j % 2 == 0) {
+              int pos = (src_i / 2 - cr.y) * cr.width + src_j / 2 - cr.x;
+              pixel_val = coarse->data[pos * channels + c] * 4.f;
+            }
+            sum += GAUSSIAN_KERNEL[ki][kj] * pixel_val;
+          }
+        }
+        short upsampled = sum;
+        short *dst = &fine->data[((size_t)y * r.width + x) * channels + c];
+        *dst = upsampled + *dst;
+      }
+    }
+  }
+}
+
+static int multi_band_blend_roi(Blender *b, StitchRect roi, Image *out) {
+  StitchRect need[MAX_BANDS + 1];
+  ImageS levels[MAX_BANDS + 1];
+  memset(levels, 0, sizeof(levels));
+
+  // each coarser level needs the 5 tap footprint of the finer one, halved
+  need[0] = roi;
+  for (int level = 0; level < b->num_bands; level++) {
+    StitchRect r = need[level];
+    int x0 = max(0, r.x - 2) / 2;
+    int y0 = max(0, r.y - 2) / 2;
+    int x1 = min(b->out_width_levels[level], r.x + r.width + 2);
+    int y1 = min(b->out_height_levels[level], r.y + r.height + 2);
+    need[level + 1].x = x0;
+    need[level + 1].y = y0;
+    need[level + 1].width =
+        min(b->out_width_levels[level + 1], (x1 - 1) / 2 + 1) - x0;
+    need[level + 1].height =
+        min(b->out_height_levels[level + 1], (y1 - 1) / 2 + 1) - y0;
+  }
+
+  int return_val = 0;
+  double stage_start = stats_begin();
+  for (int level = 0; level <= b->num_bands; level++) {
+    levels[level] = normalize_rect(b, level, need[level]);
+    if (!levels[level].data) {
+      goto clean;
+    }
+  }
+  stats_record_stage(STAGE_NORMALIZE, stage_start);
+
+  stage_start = stats_begin();
+  for (int level = b->num_bands; level > 0; --level) {
+    collapse_rect(&levels[level], need[level], &levels[level - 1],
+                  need[level - 1], b->out_width_levels[level - 1],
+                  b->out_height_levels[level - 1]);
+  }
+  stats_record_stage(STAGE_COLLAPSE, stage_start);
+
+  int channels = b->output_alpha && b->channels == RGB_CHANNELS
+                     ? RGBA_CHANNELS
+                     : b->channels;
+  *out = create_empty_image(roi.width, roi.height, channels);
+  if (!out->data) {
+    goto clean;
+  }
+
+  // outside the zones of a seam-local feed, the pixels it copied
+  for (int y = 0; y < roi.height; y++) {
+    for (int x = 0; x < roi.width;) {
+      int inside = 1;
+      int stop = b->zones ? rect_run(b->zones, b->zone_count, roi.y + y,
+                                     roi.x + x, roi.x + roi.width, &inside) -
+                                roi.x
+                          : roi.width;
+      unsigned char *dst = out->data + ((size_t)y * roi.width + x) * channels;
+      if (inside) {
+        get_kernels()->render_row(
+            levels[0].data + ((size_t)y * roi.width + x) * b->channels, NULL,
+            b->out_mask[0].data +
+                (size_t)(roi.y + y) * b->out_mask[0].width + roi.x + x,
+            dst, b->channels, channels > b->channels, stop - x);
+      } else {
+        copy_direct_row(b, roi.y + y, roi.x + x, roi.x + stop, dst, channels);
+      }
+      x = stop;
+    }
+  }
+  return_val = 1;
+
+clean:
+  for (int level = 0; level <= b->num_bands; level++) {
+    destroy_image_s(&levels[level]);
+  }
+  return return_val;
+}
+
+static int feather_blend_roi(Blender *b, StitchRect roi, Image *out) {
+  int channels = b->output_alpha && b->channels == RGB_CHANNELS
+                     ? RGBA_CHANNELS
+                     : b->channels;
+  *out = create_empty_image(roi.width, roi.height, channels);
+  Image row = create_empty_image(roi.width, 1, b->channels);
+  if (!out->data || !row.data) {
+    destroy_image(out);
+    destroy_image(&row);
+    return 0;
+  }
+
+  int width = b->output_size.width;
+  for (int y = 0; y < roi.height; y++) {
+    size_t pos = (size_t)(roi.y + y) * width + roi.x;
+    const float *src = b->out[0].data + pos * b->channels;
+    const float *weights = b->out_mask[0].data + pos;
+    if (b->channels == GRAY_CHANNELS) {
+      get_kernels()->feather_normalize_gray_row(src, weights, row.data,
+                                                roi.width);
+    } else {
+      feather_normalize_row(src, weights, row.data, roi.width);
+    }
+    for (int x = 0; x < roi.width; x++) {
+      unsigned char *dst = out->data + ((size_t)y * roi.width + x) * channels;
+      memcpy(dst, row.data + x * b->channels, b->channels);
+      if (channels == RGBA_CHANNELS) {
+        dst[3] = clamp((int)(weights[x] * 255.0f + 0.5f), 0, 255);
+      }
+    }
+  }
+  destroy_image(&row);
+  return 1;
+}
+
+int blend_roi(Blender *b, StitchRect roi, Image *out) {
+  out->data = NULL;
+  out->width = out->height = out->channels = 0;
+
+  // canvas coordinates, clipped to the real output
+  int x0 = max(roi.x, b->output_size.x) - b->output_size.x;
+  int y0 = max(roi.y, b->output_size.y) - b->output_size.y;
+  int x1 = min(roi.x + roi.width, b->output_size.x + b->real_out_size.width) -
+           b->output_size.x;
+  int y1 =
+      min(roi.y + roi.height, b->output_size.y + b->real_out_size.height) -
+      b->output_size.y;
+  if (x1 <= x0 || y1 <= y0 || !b->out || !b->out[0].data) {
+    return 0;
+  }
+  StitchRect r = {x0, y0, x1 - x0, y1 - y0};
+
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+  int return_val = b->blender_type != FEATHER
+                       ? multi_band_blend_roi(b, r, out)
+                       : feather_blend_roi(b, r, out);
+  memory_activate(previous_memory);
+  stats_activate(previous);
+  return return_val;
+}
+
+int save_blended_image(Blender *b, const char *out_filename) {
+  if (!b->result.data) {
+    return 0;
+  }
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+  double stage_start = stats_begin();
+  int return_val = save_image(&b->result, out_filename);
+  stats_record_stage(STAGE_ENCODE, stage_start);
+  memory_activate(previous_memory);
+  stats_activate(previous);
+  return return_val;
+}
+
+int enable_blender_stats(Blender *b) {
+  if (!b->stats) {
+    MemoryContext *previous_memory = memory_activate(b->memory);
+    b->stats = (BlenderStats *)stitch_calloc(1, sizeof(BlenderStats));
+    memory_activate(previous_memory);
+  }
+  return b->stats != NULL;
+}
+
+const BlenderStats *get_blender_stats(const Blender *b) { return b->stats; }
+
+void reset_blender_stats(Blender *b) {
+  if (b->stats) {
+    memset(b->stats, 0, sizeof(BlenderStats));
+  }
+}
+
+// runs on the pool thread with the caller's memory context and timing mode,
+// pinned on NUMA hosts, so that the rows a ZERO worker clears are placed on
+// the node get_row_node reports for them
+static void *operator_thread(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  if (arg->cpu >= 0) {
+    pin_thread_to_cpu(arg->cpu);
+  }
+  memory_activate(arg->memory);
+  return arg->timed ? stats_timed_worker(args) : arg->worker(args);
+}
+
+static WorkerFunc operator_worker(OperatorType operatorType,
+                                  ParallelOperatorArgs *arg) {
+  switch (operatorType) {
+  case DOWNSAMPLE:
+    switch (arg->workerThreadArgs->std->image_type) {
+    case IMAGE:
+      return down_sample_operation;
+    case IMAGES:
+      return down_sample_operation_s;
+    case IMAGEF:
+      return down_sample_operation_f;
+    }
+    break;
+  case UPSAMPLE:
+    switch (arg->workerThreadArgs->std->image_type) {
+    case IMAGE:
+      return upsample_worker;
+    case IMAGES:
+      return upsample_worker_s;
+    case IMAGEF:
+      return upsample_worker_f;
+    }
+    break;
+  case FEED:
+    return feed_worker;
+  case LAPLACIAN:
+    return compute_laplacian_worker;
+  case BLEND:
+    return blend_worker;
+  case NORMALIZE:
+    return normalize_worker;
+  case FEATHER_FEED:
+    return feather_feed_worker;
+  case FEATHER_NORMALIZE:
+    return feather_normalize_worker;
+  case ENCODE_TILES:
+    return encode_tiles_worker;
+  case DECODE_SEGMENTS:
+    return decode_segments_worker;
+  case DECODE_FILES:
+    return decode_files_worker;
+  case ENCODE_STRIPES:
+    return encode_stripes_worker;
+  case MERGE:
+    return merge_worker;
+  case ZERO:
+    return zero_worker;
+  default:
+    break;
+  }
+  return NULL;
+}
+
+static unsigned long long sampling_bytes(SamplingThreadData *s) {
+  // Image, ImageS and ImageF share the same layout apart from the pixel type
+  Image *img = (Image *)s->img;
+  unsigned long long pixel_size = s->image_type == IMAGE    ? 1
+                                  : s->image_type == IMAGES ? sizeof(short)
+                                                            : sizeof(float);
+  return ((unsigned long long)img->width * img->height +
+          (unsigned long long)s->new_width * s->new_height) *
+         img->channels * pixel_size;
+}
+
+static unsigned long long operator_bytes(OperatorType operatorType,
+                                         ParallelOperatorArgs *arg) {
+  WorkerThreadArgs *w = arg->workerThreadArgs;
+  unsigned long long pixels;
+  int channels;
+
+  switch (operatorType) {
+  case DOWNSAMPLE:
+  case UPSAMPLE:
+    // streamed pyramids run the sampling a few rows at a time
+    return sampling_bytes(w->std) * arg->rows / max(w->std->new_height, 1);
+  case LAPLACIAN:
+    return (unsigned long long)arg->rows * w->ltd->row_size * sizeof(short) *
+           3;
+  case FEED:
+    pixels = (unsigned long long)arg->rows * w->ftd->cols;
+    // RGBA feeds read the weights out of the gaussian level they stride over
+    return pixels * ((w->ftd->img_laplacians[w->ftd->level].channels +
+                      w->ftd->mask_gaussian[w->ftd->level].channels) *
+                         sizeof(short) +
+                     (w->ftd->out[w->ftd->level].channels + 1) *
+                         sizeof(float) * 2);
+  case BLEND:
+    return (unsigned long long)arg->rows * w->btd->row_size * sizeof(short) *
+           3;
+  case NORMALIZE:
+    pixels = (unsigned long long)arg->rows * w->ntd->output_width;
+    channels = w->ntd->final_out[w->ntd->level].channels;
+    return pixels *
+           ((channels + 1) * sizeof(float) + channels * sizeof(short));
+  case FEATHER_FEED:
+    pixels = (unsigned long long)arg->rows * w->fth->cols;
+    channels = w->fth->out->channels;
+    return pixels * ((channels + 1) + (channels + 1) * sizeof(float) * 2);
+  case FEATHER_NORMALIZE:
+    pixels = (unsigned long long)arg->rows * w->fth->cols;
+    channels = w->fth->out->channels;
+    return pixels * ((channels + 1) * sizeof(float) + channels);
+  case ENCODE_TILES:
+    // pixels read, the JPEG output is not counted
+    return (unsigned long long)image_size((Image *)w->etd->img);
+  case DECODE_SEGMENTS:
+    // pixels written, the compressed input is not counted
+    return (unsigned long long)image_size(w->jtd->img);
+  case DECODE_FILES:
+    pixels = 0;
+    for (int i = 0; i < arg->rows; i++) {
+      pixels += image_size(&w->jbd->images[i]);
+    }
+    return pixels;
+  case ENCODE_STRIPES:
+    // pixels read, the JPEG output is not counted
+    return (unsigned long long)image_size((Image *)w->jst->img);
+  case MERGE:
+    return (unsigned long long)arg->rows * w->mtd->row_floats *
+           sizeof(float) * 3;
+  case ZERO:
+    return (unsigned long long)arg->rows * w->ztd->row_bytes;
+  default:
+    return 0;
+  }
+}
+
+void parallel_operator(OperatorType operatorType, ParallelOperatorArgs *arg) {
+  WorkerFunc worker = operator_worker(operatorType, arg);
+  if (!worker) {
+    return;
+  }
+
+  int timed = stats_active() != NULL;
+  MemoryContext *memory = memory_active();
+  double start = stats_begin();
+
+  int numThreads = get_cpus_count();
+  int rowsPerThread = arg->rows / numThreads;
+  int remainingRows = arg->rows % numThreads;
+
+  pthread_t threads[numThreads];
+  ThreadArgs thread_data[numThreads];
+
+  int startRow = arg->first_row;
+  for (unsigned int i = 0; i < numThreads; ++i) {
+    int endRow = startRow + rowsPerThread + (remainingRows > 0 ? 1 : 0);
+    if (remainingRows > 0) {
+      --remainingRows;
+    }
+
+    thread_data[i].end_index = endRow;
+    thread_data[i].start_index = startRow;
+    thread_data[i].workerThreadArgs = arg->workerThreadArgs;
+    thread_data[i].worker = worker;
+    thread_data[i].timed = timed;
+    thread_data[i].busy_seconds = 0.0;
+    thread_data[i].memory = memory;
+    thread_data[i].cpu = get_worker_cpu(i, numThreads);
+    pthread_create(&threads[i], NULL, operator_thread, &thread_data[i]);
+
+    startRow = endRow;
+  }
+
+  for (unsigned int i = 0; i < numThreads; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (timed) {
+    stats_record_operator(operatorType, start,
+                          operator_bytes(operatorType, arg), thread_data,
+                          numThreads);
   }
 }
@@ -2,12 +2,17 @@
 extern "C" {
 #endif
 
+#ifndef BLENDING_HEADERS
+#define BLENDING_HEADERS
 
 #include "image_operations.h"
+#include "stats.h"
 
 typedef enum{
     MULTIBAND,
-    FEATHER
+    FEATHER,
+    // multiband with weights computed from the images themselves
+    FUSION
 } BlenderType;
 
 typedef struct
@@ -24,15 +29,95 @@ typedef struct
     ImageS *img_laplacians;
     ImageS *mask_gaussian;
     BlenderType blender_type;
+    int channels;
     float sharpness;
     int do_distance_transform;
+    // FUSION weighs every pixel by contrast^fusion_contrast *
+    // saturation^fusion_saturation * well-exposedness^fusion_exposedness,
+    // all 1 by default (exposure fusion); 1, 0, 0 stacks focus
+    float fusion_contrast;
+    float fusion_saturation;
+    float fusion_exposedness;
+    int output_alpha;
+    // bit l > 0 asks blend() for the 1/2^l rendition in level_results[l],
+    // bit 0 for result; without it the collapse stops at the finest level asked
+    unsigned int output_levels;
+    Image level_results[MAX_BANDS + 1];
+    // when set, renditions go here as they are produced instead of
+    // level_results and are released right after the call
+    void (*level_sink)(void *user, const Image *rendition, int level);
+    void *level_sink_user;
+    BlenderStats *stats;
+    MemoryContext *memory;
+    // multiband only, set before feeding: see feed_many
+    int seam_local;
+    // once fed seam-locally, the canvas rects blended from the pyramid, and
+    // every other pixel as copied from its one input, weight last
+    StitchRect *zones;
+    int zone_count;
+    Image direct;
 } Blender;
 
 Blender *create_blender(BlenderType blender_type, StitchRect out_size, int nb);
+// channels is RGB_CHANNELS or GRAY_CHANNELS, create_blender uses RGB
+Blender *create_blender_with_channels(BlenderType blender_type,
+                                      StitchRect out_size, int nb,
+                                      int channels);
+// fusion blenders multiply their weights by maskImg, which may be NULL
 int feed(Blender *b, Image *img, Image *maskImg, StitchPoint tl);
+int feed_rgba(Blender *b, Image *img, StitchPoint tl);
+/*
+ * Feeds count images in one go, with the same result as feeding them one
+ * after the other. Multiband blenders overlap the pyramid of the next image
+ * with the feeding of the current one. masks may be NULL, or masks[i], for
+ * RGBA images fed like feed_rgba, or for fusion blenders, images weighted
+ * by their content alone. The images are only read.
+ *
+ * With seam_local set, a multiband blender builds pyramids only around the
+ * zones where two masks come within reach of the filters of each other,
+ * and copies every other pixel straight from the one input covering it.
+ * Those pixels skip the pyramid: away from the edge of the covered canvas
+ * they are within num_bands + 1 of a full blend, and the zones are
+ * unchanged. All images must come in one feed_many call, blend() renders
+ * only the full size result and the accumulators cannot be saved or merged.
+ */
+int feed_many(Blender *b, Image **imgs, Image **masks, StitchPoint *tls,
+              int count);
+/*
+ * Feeds a JPEG without decoding it into an image first: multiband blenders
+ * build the gaussian pyramid from the scanlines as they are decoded. The
+ * result matches feed() with decompress_jpeg() for RGB blenders; grayscale
+ * blenders decode to gray. Fusion blenders decode the whole image and take
+ * a NULL mask_img like feed().
+ */
+int feed_jpeg(Blender *b, const unsigned char *jpeg, unsigned long size,
+              Image *mask_img, StitchPoint tl);
 void blend(Blender *b);
+/*
+ * Blends only roi (canvas coordinates, clipped to the output) into *out.
+ * Unlike blend() it leaves the accumulators in place, so it can be called
+ * repeatedly between feeds. Returns 0 when nothing is left to blend.
+ */
+int blend_roi(Blender *b, StitchRect roi, Image *out);
+Blender *create_blender_with_allocator(BlenderType blender_type,
+                                       StitchRect out_size, int nb,
+                                       const StitchAllocator *allocator,
+                                       size_t memory_limit);
 void destroy_blender(Blender *blender);
+MemoryUsage get_blender_memory_usage(const Blender *b);
+int save_blended_image(Blender *b, const char *out_filename);
 
+int enable_blender_stats(Blender *b);
+const BlenderStats *get_blender_stats(const Blender *b);
+void reset_blender_stats(Blender *b);
+
+void compute_laplacian(ImageS *original, ImageS *upsampled);
+void *compute_laplacian_worker(void *args);
+void *feed_worker(void *args);
+void *normalize_worker(void *args);
+void *blend_worker(void *args);
+
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,232 @@
+#include "deep_zoom.h"
+#include "allocator.h"
+#include "stats.h"
+#include "turbojpeg.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DEEP_ZOOM_PATH_MAX 4096
+
+typedef struct {
+  const char *base_path;
+  int tile_size;
+  int overlap;
+  int quality;
+  int max_level;
+  int coarsest;
+  int failed;
+} DeepZoomWriter;
+
+static int make_dir(const char *path) {
+  if (mkdir(path, 0755) == 0 || errno == EEXIST)
+    return 1;
+  fprintf(stderr, "Failed to create directory: %s\n", path);
+  return 0;
+}
+
+void *encode_tiles_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  TileEncodeThreadData *e = (TileEncodeThreadData *)arg->workerThreadArgs->etd;
+  const Image *img = e->img;
+
+  int pixel_format = img->channels == GRAY_CHANNELS   ? TJPF_GRAY
+                     : img->channels == RGBA_CHANNELS ? TJPF_RGBX
+                                                      : TJPF_RGB;
+  int subsamp = img->channels == GRAY_CHANNELS ? TJSAMP_GRAY : TJSAMP_444;
+  int pitch = img->width * img->channels;
+
+  // one handle and one worst-case output buffer per worker, reused per tile
+  int max_side = e->tile_size + 2 * e->overlap;
+  unsigned long capacity = tjBufSize(max_side, max_side, subsamp);
+  tjhandle handle = tjInitCompress();
+  unsigned char *jpeg = tjAlloc((int)capacity);
+  if (!handle || !jpeg) {
+    fprintf(stderr, "Failed to initialize TurboJPEG compressor.\n");
+    __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+    if (handle)
+      tjDestroy(handle);
+    tjFree(jpeg);
+    return NULL;
+  }
+
+  char path[DEEP_ZOOM_PATH_MAX];
+  for (int i = arg->start_index; i < arg->end_index; i++) {
+    int col = i % e->cols;
+    int row = i / e->cols;
+    int x0 = max(0, col * e->tile_size - e->overlap);
+    int y0 = max(0, row * e->tile_size - e->overlap);
+    int x1 = min(img->width, (col + 1) * e->tile_size + e->overlap);
+    int y1 = min(img->height, (row + 1) * e->tile_size + e->overlap);
+
+    unsigned long size = capacity;
+    if (tjCompress2(handle,
+                    img->data + ((size_t)y0 * img->width + x0) * img->channels,
+                    x1 - x0, pitch, y1 - y0, pixel_format, &jpeg, &size,
+                    subsamp, e->quality,
+                    TJFLAG_FASTDCT | TJFLAG_NOREALLOC) < 0) {
+      fprintf(stderr, "Failed to compress tile: %s\n", tjGetErrorStr());
+      __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%d_%d.jpg", e->dir, col, row);
+    FILE *file = fopen(path, "wb");
+    if (!file || fwrite(jpeg, 1, size, file) != size) {
+      fprintf(stderr, "Failed to write tile: %s\n", path);
+      __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (file)
+      fclose(file);
+  }
+
+  tjFree(jpeg);
+  tjDestroy(handle);
+  return NULL;
+}
+
+static void write_level(DeepZoomWriter *w, const Image *img, int dzi_level) {
+  char dir[DEEP_ZOOM_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s_files/%d", w->base_path, dzi_level);
+  if (!make_dir(dir)) {
+    w->failed = 1;
+    return;
+  }
+
+  int cols = (img->width + w->tile_size - 1) / w->tile_size;
+  int rows = (img->height + w->tile_size - 1) / w->tile_size;
+  TileEncodeThreadData etd = {img,        dir,  w->tile_size, w->overlap,
+                              w->quality, cols, 0};
+  WorkerThreadArgs wtd;
+  wtd.etd = &etd;
+  ParallelOperatorArgs args = {cols * rows, &wtd};
+
+  double stage_start = stats_begin();
+  parallel_operator(ENCODE_TILES, &args);
+  stats_record_stage(STAGE_ENCODE, stage_start);
+  if (etd.failed)
+    w->failed = 1;
+}
+
+// 2x2 box average with ceil sizes, as the Deep Zoom levels are defined
+static Image halve_image(const Image *img) {
+  Image out = create_empty_image((img->width + 1) / 2, (img->height + 1) / 2,
+                                 img->channels);
+  if (!out.data)
+    return out;
+
+  size_t stride = (size_t)img->width * img->channels;
+  for (int y = 0; y < out.height; y++) {
+    int y0 = 2 * y, y1 = min(2 * y + 1, img->height - 1);
+    const unsigned char *row0 = img->data + y0 * stride;
+    const unsigned char *row1 = img->data + y1 * stride;
+    unsigned char *dst = out.data + (size_t)y * out.width * out.channels;
+    for (int x = 0; x < out.width; x++) {
+      int x0 = 2 * x, x1 = min(2 * x + 1, img->width - 1);
+      for (int c = 0; c < img->channels; c++) {
+        int sum = row0[x0 * img->channels + c] + row0[x1 * img->channels + c] +
+                  row1[x0 * img->channels + c] + row1[x1 * img->channels + c];
+        dst[x * out.channels + c] = (sum + 2) / 4;
+      }
+    }
+  }
+  return out;
+}
+
+// pyramid level l is Deep Zoom level max_level - l
+static void write_rendition(DeepZoomWriter *w, const Image *img, int level) {
+  write_level(w, img, w->max_level - level);
+  if (level != w->coarsest)
+    return;
+
+  // the levels past the pyramid are small, halve down to a single pixel
+  Image current = {NULL, 0, 0, 0};
+  const Image *previous = img;
+  for (int dzi_level = w->max_level - level - 1; dzi_level >= 0;
+       dzi_level--) {
+    Image next = halve_image(previous);
+    destroy_image(&current);
+    if (!next.data) {
+      w->failed = 1;
+      return;
+    }
+    current = next;
+    previous = &current;
+    write_level(w, &current, dzi_level);
+  }
+  destroy_image(&current);
+}
+
+static void deep_zoom_level_sink(void *user, const Image *rendition,
+                                 int level) {
+  write_rendition((DeepZoomWriter *)user, rendition, level);
+}
+
+static int write_descriptor(const DeepZoomWriter *w, int width, int height) {
+  char path[DEEP_ZOOM_PATH_MAX];
+  snprintf(path, sizeof(path), "%s.dzi", w->base_path);
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "Failed to open output file: %s\n", path);
+    return 0;
+  }
+  fprintf(file,
+          "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+          "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+          "Format=\"jpg\" Overlap=\"%d\" TileSize=\"%d\">\n"
+          "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+          "</Image>\n",
+          w->overlap, w->tile_size, width, height);
+  fclose(file);
+  return 1;
+}
+
+int save_deep_zoom(Blender *b, const char *base_path, int tile_size,
+                   int overlap, int quality) {
+  if (tile_size <= 0 || overlap < 0) {
+    return 0;
+  }
+
+  int width = b->real_out_size.width;
+  int height = b->real_out_size.height;
+  DeepZoomWriter w = {base_path, tile_size, overlap, quality, 0, 0, 0};
+  while ((1 << w.max_level) < max(width, height)) {
+    w.max_level++;
+  }
+
+  char dir[DEEP_ZOOM_PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s_files", base_path);
+  if (!make_dir(dir)) {
+    return 0;
+  }
+
+  BlenderStats *previous = stats_activate(b->stats);
+  MemoryContext *previous_memory = memory_activate(b->memory);
+
+  // the collapse hands over every level it passes through; a seam-local
+  // feed only has the full level, which is halved like a feather result
+  unsigned int output_levels = b->output_levels;
+  if (b->blender_type != FEATHER && !b->zones) {
+    w.coarsest = min(b->num_bands, w.max_level);
+    b->output_levels = (2u << w.coarsest) - 1;
+    b->level_sink = deep_zoom_level_sink;
+    b->level_sink_user = &w;
+  }
+  blend(b);
+  b->output_levels = output_levels;
+  b->level_sink = NULL;
+  b->level_sink_user = NULL;
+
+  int return_val = 0;
+  if (b->result.data) {
+    write_rendition(&w, &b->result, 0);
+    return_val = !w.failed && write_descriptor(&w, width, height);
+  }
+
+  memory_activate(previous_memory);
+  stats_activate(previous);
+  return return_val;
+}
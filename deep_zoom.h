@@ -0,0 +1,26 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef DEEP_ZOOM_HEADERS
+#define DEEP_ZOOM_HEADERS
+
+#include "blending.h"
+
+/*
+ * Deep Zoom output. save_deep_zoom() takes the place of blend(): every
+ * collapse level of the multiband blend is cut into JPEG tiles as soon as
+ * it is finished, the levels below the pyramid are halved from the
+ * coarsest one, and <base_path>.dzi describes the result. Tiles land in
+ * <base_path>_files/<level>/<col>_<row>.jpg and are encoded in parallel.
+ */
+int save_deep_zoom(Blender *b, const char *base_path, int tile_size,
+                   int overlap, int quality);
+
+void *encode_tiles_worker(void *args);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
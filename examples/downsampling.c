@@ -29,7 +29,7 @@ int main() {
     if (save_image(&down, buf)) {
       printf("downsample image  saved \n");
     }
-    free(img->data);
+    destroy_image(img);
     img->data = down.data;
     img->width = down.width;
     img->height = down.height;
@@ -42,7 +42,7 @@ int main() {
       printf("upsample image  saved . shape %d %d %d \n", up.width, up.height,
              up.channels);
     }
-    free(img->data);
+    destroy_image(img);
     img->data = up.data;
     img->width = up.width;
     img->height = up.height;
@@ -53,7 +53,7 @@ int main() {
   for (int i = 0; i < 10; i++) {
     Image down = downsample(&img_);
     printf("image downsample   %d %d %d \n", i + 1, down.width, down.height);
-    free(img_.data);
+    destroy_image(&img_);
     img_.data = down.data;
     img_.width = down.width;
     img_.height = down.height;
@@ -2,6 +2,8 @@
 extern "C" {
 #endif
 
+#ifndef IMAGE_OPERATIONS_HEADERS
+#define IMAGE_OPERATIONS_HEADERS
 
 #include "turbojpeg.h"
 #include <stdlib.h>
@@ -10,6 +12,7 @@ extern "C" {
 #include <math.h>
 #include <time.h>
 #include <string.h>
+#include "allocator.h"
 #include "jpeg.h"
 #include "utils.h"
 
@@ -32,7 +35,16 @@ typedef enum
     LAPLACIAN,
     FEED,
     BLEND,
-    NORMALIZE
+    NORMALIZE,
+    FEATHER_FEED,
+    FEATHER_NORMALIZE,
+    ENCODE_TILES,
+    DECODE_SEGMENTS,
+    DECODE_FILES,
+    ENCODE_STRIPES,
+    MERGE,
+    ZERO,
+    OPERATOR_TYPE_COUNT
 } OperatorType;
 
 typedef struct
@@ -59,13 +71,20 @@ typedef struct
     void *img;
     void *sampled;
     ImageType image_type;
+    // output row held by the start of sampled, for callers producing a few
+    // rows at a time; only the upsample kernels honour it
+    int first_row;
+    // output columns [start_col, end_col) to produce, all of them when
+    // end_col is 0; honoured by all but the 8 bit downsample
+    int start_col;
+    int end_col;
 } SamplingThreadData;
 
 typedef struct
 {
     ImageS *original;
     ImageS *upsampled;
-    int total_size;
+    size_t row_size;
 } LaplacianThreadData;
 
 typedef struct
@@ -83,8 +102,21 @@ typedef struct
     ImageS *mask_gaussian;
     ImageF *out;
     ImageF *out_mask;
+    // columns [start_col, end_col) of the region, all of them when end_col
+    // is 0
+    int start_col;
+    int end_col;
 } FeedThreadData;
 
+// per pixel weights of a fusion blender, see fusion_weights_row
+typedef struct
+{
+    float contrast;
+    float saturation;
+    // well-exposedness of every 8 bit value, already raised to its exponent
+    float exposedness[256];
+} FusionWeights;
+
 typedef struct
 {
     int output_width;
@@ -92,15 +124,92 @@ typedef struct
     ImageF *out;
     ImageF *out_mask;
     ImageS *final_out;
+    // columns [start_col, end_col), all of them when end_col is 0
+    int start_col;
+    int end_col;
 } NormalThreadData;
 
 typedef struct
 {
-    int out_size;
+    size_t row_size;
     ImageS blended_image;
     ImageS out_level;
 } BlendThreadData;
 
+typedef struct
+{
+    int cols;
+    int src_x;
+    int src_y;
+    int dst_x;
+    int dst_y;
+    int out_width;
+    Image *img;
+    Image *mask_img;
+    ImageF *out;
+    ImageF *out_mask;
+    Image *result;
+} FeatherThreadData;
+
+typedef struct
+{
+    const Image *img;
+    const char *dir;
+    int tile_size;
+    int overlap;
+    int quality;
+    int cols;
+    int failed;
+} TileEncodeThreadData;
+
+typedef struct
+{
+    const unsigned char *jpeg;
+    size_t header_size;
+    size_t sof_offset;
+    const size_t *interval_start;
+    const size_t *interval_end;
+    int interval_count;
+    int intervals_per_group;
+    int group_count;
+    int group_height;
+    int context;
+    Image *img;
+    int failed;
+} JpegDecodeThreadData;
+
+typedef struct
+{
+    const char **filenames;
+    Image *images;
+    int parallel;
+} JpegBatchThreadData;
+
+typedef struct
+{
+    const Image *img;
+    int stripe_height;
+    int pixel_format;
+    int subsamp;
+    int quality;
+    unsigned char **stripes;
+    unsigned long *stripe_sizes;
+    int failed;
+} JpegStripeThreadData;
+
+typedef struct
+{
+    float *dst;
+    const float *src;
+    size_t row_floats;
+} MergeThreadData;
+
+typedef struct
+{
+    unsigned char *data;
+    size_t row_bytes;
+} ZeroThreadData;
+
 typedef union
 {
     SamplingThreadData *std;
@@ -108,19 +217,35 @@ typedef union
     FeedThreadData *ftd;
     BlendThreadData *btd;
     NormalThreadData *ntd;
+    FeatherThreadData *fth;
+    TileEncodeThreadData *etd;
+    JpegDecodeThreadData *jtd;
+    JpegBatchThreadData *jbd;
+    JpegStripeThreadData *jst;
+    MergeThreadData *mtd;
+    ZeroThreadData *ztd;
 } WorkerThreadArgs;
 
+// the workers split rows [first_row, first_row + rows) between them
 typedef struct
 {
     int rows;
     WorkerThreadArgs *workerThreadArgs;
+    int first_row;
 } ParallelOperatorArgs;
 
+typedef void *(*WorkerFunc)(void *);
+
 typedef struct
 {
     int start_index;
     int end_index;
     WorkerThreadArgs *workerThreadArgs;
+    WorkerFunc worker;
+    int timed;
+    double busy_seconds;
+    MemoryContext *memory;
+    int cpu;
 } ThreadArgs;
 
 
@@ -135,9 +260,9 @@ ImageF create_empty_image_f(int width, int height, int channels);
 Image create_image_mask(int width, int height, float range, int left, int right);
 int save_image(const Image *img, const char *out_filename);
 
-int image_size(Image *img);
-int image_size_s(ImageS *img);
-int image_size_f(ImageF *img);
+size_t image_size(Image *img);
+size_t image_size_s(ImageS *img);
+size_t image_size_f(ImageF *img);
 
 void destroy_image(Image *img);
 void destroy_image_s(ImageS *img);
@@ -155,13 +280,21 @@ void *upsample_worker(void *args);
 void *upsample_worker_s(void *args);
 void *upsample_worker_f(void *args);
 
+void *zero_worker(void *args);
+
 Image downsample(Image *img);
 ImageS downsample_s(ImageS *img);
 ImageF downsample_f(ImageF *img);
 
+void feather_accumulate_row(const unsigned char *src, const unsigned char *mask,
+                            float *dst, float *dst_mask, int cols);
+void feather_normalize_row(const float *src, const float *weights,
+                           unsigned char *dst, int cols);
+
 void crop_image(Image *img, int cut_top, int cut_bottom, int cut_left, int cut_right);
 void parallel_operator(OperatorType operatorType, ParallelOperatorArgs *arg);
 
+#endif
 
 #ifdef __cplusplus
 }
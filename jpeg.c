@@ -1,153 +1,654 @@
+#include "allocator.h"
+#include "image_operations.h"
 #include "jpeg.h"
 #include "turbojpeg.h"
 #include "utils.h"
+#include <fcntl.h>
 #include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// after stdio.h, which jpeglib.h relies on for FILE
+#include <jpeglib.h>
 
-Image decompress_jpeg(const char *filename) {
-  Image result;
-  result.data = NULL;
-  result.width = result.height = 0;
-  result.channels = RGB_CHANNELS;
-  tjhandle handle = tjInitDecompress();
+static pthread_key_t compressor_key;
+static pthread_key_t decompressor_key;
+static pthread_once_t handle_keys_once = PTHREAD_ONCE_INIT;
+
+static void destroy_handle(void *handle) { tjDestroy((tjhandle)handle); }
+
+static void create_handle_keys(void) {
+  pthread_key_create(&compressor_key, destroy_handle);
+  pthread_key_create(&decompressor_key, destroy_handle);
+}
+
+// handles are not thread safe, so every thread keeps its own and reuses it
+static tjhandle thread_handle(int compress) {
+  pthread_once(&handle_keys_once, create_handle_keys);
+  pthread_key_t key = compress ? compressor_key : decompressor_key;
+  tjhandle handle = (tjhandle)pthread_getspecific(key);
   if (!handle) {
-    fprintf(stderr, "Failed to initialize TurboJPEG decompressor.\n");
-    return result;
+    handle = compress ? tjInitCompress() : tjInitDecompress();
+    if (handle)
+      pthread_setspecific(key, handle);
   }
+  return handle;
+}
 
-  FILE *file = fopen(filename, "rb");
-  if (!file) {
-    fprintf(stderr, "Failed to open file: %s\n", filename);
-    tjDestroy(handle);
-    return result;
+// below this the thread start-up costs more than the decode saves
+#define PARALLEL_DECODE_MIN_PIXELS (1 << 20)
+
+static int gcd(int a, int b) {
+  while (b) {
+    int t = a % b;
+    a = b;
+    b = t;
   }
+  return a;
+}
 
-  fseek(file, 0, SEEK_END);
-  long fileSize = ftell(file);
-  fseek(file, 0, SEEK_SET);
+/*
+ * Fills d with the layout of a single-scan baseline JPEG whose restart
+ * intervals line up with MCU rows. A group is the smallest run of MCU rows
+ * that starts and ends on a restart marker. Returns 0 when the image
+ * cannot be split this way.
+ */
+static int parse_restart_layout(const unsigned char *jpeg, size_t size,
+                                JpegDecodeThreadData *d) {
+  if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8)
+    return 0;
 
-  unsigned char *jpegBuf = (unsigned char *)malloc(fileSize);
-  if (!jpegBuf) {
-    fprintf(stderr, "Failed to allocate memory for JPEG buffer.\n");
-    fclose(file);
-    tjDestroy(handle);
-    return result;
+  size_t pos = 2;
+  size_t sof = 0;
+  int restart = 0, width = 0, height = 0, components = 0;
+  int hmax = 1, vmax = 1;
+  for (;;) {
+    while (pos + 1 < size && jpeg[pos] == 0xFF && jpeg[pos + 1] == 0xFF)
+      pos++;
+    if (pos + 4 > size || jpeg[pos] != 0xFF)
+      return 0;
+    int marker = jpeg[pos + 1];
+    size_t length = ((size_t)jpeg[pos + 2] << 8) | jpeg[pos + 3];
+    if (length < 2 || pos + 2 + length > size)
+      return 0;
+    const unsigned char *seg = jpeg + pos + 4;
+
+    if (marker == 0xC0 || marker == 0xC1) {
+      if (length < 8)
+        return 0;
+      height = (seg[1] << 8) | seg[2];
+      width = (seg[3] << 8) | seg[4];
+      components = seg[5];
+      if (length < 8 + 3 * (size_t)components)
+        return 0;
+      for (int c = 0; c < components; c++) {
+        hmax = max(hmax, seg[7 + 3 * c] >> 4);
+        vmax = max(vmax, seg[7 + 3 * c] & 15);
+      }
+      sof = pos;
+    } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 &&
+               marker != 0xC8 && marker != 0xCC) {
+      // progressive, lossless and arithmetic coded
+      return 0;
+    } else if (marker == 0xDD && length >= 4) {
+      restart = (seg[0] << 8) | seg[1];
+    } else if (marker == 0xDA) {
+      if (!sof || length < 3 || seg[0] != components)
+        return 0;
+      pos += 2 + length;
+      break;
+    }
+    pos += 2 + length;
+  }
+
+  if (!restart || width <= 0 || height <= 0 ||
+      (size_t)width * height < PARALLEL_DECODE_MIN_PIXELS)
+    return 0;
+
+  // a single-component scan is not interleaved, its MCU is one block
+  if (components == 1)
+    hmax = vmax = 1;
+  int mcus_per_row = (width + 8 * hmax - 1) / (8 * hmax);
+  int mcu_rows = (height + 8 * vmax - 1) / (8 * vmax);
+  int rows_per_group = restart / gcd(restart, mcus_per_row);
+  d->intervals_per_group = mcus_per_row * rows_per_group / restart;
+  d->group_count = (mcu_rows + rows_per_group - 1) / rows_per_group;
+  d->group_height = rows_per_group * 8 * vmax;
+  d->interval_count =
+      (int)(((long long)mcus_per_row * mcu_rows + restart - 1) / restart);
+  if (d->group_count < 2)
+    return 0;
+
+  size_t *starts = (size_t *)stitch_malloc(2 * d->interval_count *
+                                           sizeof(size_t));
+  if (!starts)
+    return 0;
+  size_t *ends = starts + d->interval_count;
+
+  int n = 0;
+  starts[0] = pos;
+  while (pos + 1 < size) {
+    const unsigned char *p =
+        (const unsigned char *)memchr(jpeg + pos, 0xFF, size - pos - 1);
+    if (!p)
+      break;
+    pos = p - jpeg;
+    int marker = jpeg[pos + 1];
+    if (marker == 0x00) {
+      pos += 2;
+    } else if (marker == 0xFF) {
+      pos++;
+    } else if (marker >= 0xD0 && marker <= 0xD7 && n + 1 < d->interval_count) {
+      ends[n++] = pos;
+      starts[n] = pos + 2;
+      pos += 2;
+    } else {
+      if (marker == 0xD9)
+        ends[n++] = pos;
+      break;
+    }
+  }
+
+  if (n != d->interval_count || jpeg[ends[n - 1] + 1] != 0xD9) {
+    stitch_free(starts);
+    return 0;
   }
 
-  fread(jpegBuf, 1, fileSize, file);
-  fclose(file);
+  d->jpeg = jpeg;
+  d->header_size = starts[0];
+  d->sof_offset = sof;
+  d->interval_start = starts;
+  d->interval_end = ends;
+  // vertically subsampled chroma is upsampled from the neighbouring rows,
+  // so each segment also decodes one group on either side and drops it
+  d->context = components > 1 && vmax > 1;
+  d->failed = 0;
+  return 1;
+}
+
+void *decode_segments_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  JpegDecodeThreadData *d = arg->workerThreadArgs->jtd;
+  if (arg->start_index >= arg->end_index)
+    return NULL;
+
+  Image *img = d->img;
+  int first = max(0, arg->start_index - d->context);
+  int last = min(d->group_count, arg->end_index + d->context);
+  int i0 = first * d->intervals_per_group;
+  int i1 = min(d->interval_count, last * d->intervals_per_group);
+  int y0 = first * d->group_height;
+  int y1 = min(img->height, last * d->group_height);
+  int core_y0 = arg->start_index * d->group_height;
+  int core_y1 = min(img->height, arg->end_index * d->group_height);
+
+  // the segment becomes a JPEG of its own: same headers, a shorter frame
+  // and its intervals with the restart markers renumbered from 0
+  size_t size = d->header_size + 2;
+  for (int k = i0; k < i1; k++) {
+    size += d->interval_end[k] - d->interval_start[k] + 2;
+  }
+  unsigned char *segment = (unsigned char *)stitch_malloc(size);
+  size_t pitch = (size_t)img->width * RGB_CHANNELS;
+  int context = first != arg->start_index || last != arg->end_index;
+  unsigned char *dst =
+      context ? (unsigned char *)stitch_malloc((size_t)(y1 - y0) * pitch)
+              : img->data + (size_t)core_y0 * pitch;
+  tjhandle handle = thread_handle(0);
+  if (!segment || !dst || !handle) {
+    __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+    stitch_free(segment);
+    if (context)
+      stitch_free(dst);
+    return NULL;
+  }
+
+  memcpy(segment, d->jpeg, d->header_size);
+  segment[d->sof_offset + 5] = (unsigned char)((y1 - y0) >> 8);
+  segment[d->sof_offset + 6] = (unsigned char)(y1 - y0);
+  size_t pos = d->header_size;
+  for (int k = i0; k < i1; k++) {
+    size_t length = d->interval_end[k] - d->interval_start[k];
+    memcpy(segment + pos, d->jpeg + d->interval_start[k], length);
+    pos += length;
+    segment[pos++] = 0xFF;
+    segment[pos++] = k + 1 < i1 ? 0xD0 + ((k - i0) & 7) : 0xD9;
+  }
+
+  if (tjDecompress2(handle, segment, pos, dst, img->width, (int)pitch,
+                    y1 - y0, TJPF_RGB, TJFLAG_FASTDCT) < 0) {
+    __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+  } else if (context) {
+    memcpy(img->data + (size_t)core_y0 * pitch,
+           dst + (size_t)(core_y0 - y0) * pitch,
+           (size_t)(core_y1 - core_y0) * pitch);
+  }
+
+  stitch_free(segment);
+  if (context)
+    stitch_free(dst);
+  return NULL;
+}
+
+static Image decode_buffer(const unsigned char *jpegBuf,
+                           unsigned long jpegSize, int parallel) {
+  Image result;
+  result.data = NULL;
+  result.width = result.height = 0;
+  result.channels = RGB_CHANNELS;
+  tjhandle handle = thread_handle(0);
+  if (!handle) {
+    fprintf(stderr, "Failed to initialize TurboJPEG decompressor.\n");
+    return result;
+  }
 
   int jpegSubsamp;
-  if (tjDecompressHeader2(handle, jpegBuf, fileSize, &result.width,
-                          &result.height, &jpegSubsamp) < 0) {
+  if (tjDecompressHeader2(handle, (unsigned char *)jpegBuf, jpegSize,
+                          &result.width, &result.height, &jpegSubsamp) < 0) {
     fprintf(stderr, "Failed to read JPEG header: %s\n", tjGetErrorStr());
-    free(jpegBuf);
-    tjDestroy(handle);
     return result;
   }
 
-  result.data = (unsigned char *)malloc(result.width * result.height * 3);
+  result.data = (unsigned char *)stitch_malloc((size_t)result.width *
+                                               result.height * RGB_CHANNELS);
   if (!result.data) {
     fprintf(stderr, "Failed to allocate memory for image buffer.\n");
-    free(jpegBuf);
-    tjDestroy(handle);
     return result;
   }
 
-  if (tjDecompress2(handle, jpegBuf, fileSize, result.data, result.width, 0,
+  JpegDecodeThreadData d;
+  if (parallel && get_cpus_count() > 1 &&
+      parse_restart_layout(jpegBuf, jpegSize, &d)) {
+    d.img = &result;
+    WorkerThreadArgs w;
+    w.jtd = &d;
+    ParallelOperatorArgs args = {d.group_count, &w};
+    parallel_operator(DECODE_SEGMENTS, &args);
+    stitch_free((void *)d.interval_start);
+    if (!d.failed)
+      return result;
+  }
+
+  if (tjDecompress2(handle, jpegBuf, jpegSize, result.data, result.width, 0,
                     result.height, TJPF_RGB, TJFLAG_FASTDCT) < 0) {
     fprintf(stderr, "Failed to decompress JPEG: %s\n", tjGetErrorStr());
-    free(jpegBuf);
-    free(result.data);
-    tjDestroy(handle);
-    return result;
+    stitch_free(result.data);
+    result.data = NULL;
   }
 
-  free(jpegBuf);
-  tjDestroy(handle);
   return result;
 }
 
-Image convert_RGB_to_gray(const Image *img) {
+Image decompress_jpeg_buffer(const unsigned char *jpegBuf,
+                             unsigned long jpegSize) {
+  return decode_buffer(jpegBuf, jpegSize, 1);
+}
+
+// the file is mapped instead of read, falling back to a copy without mmap
+static Image decode_file(const char *filename, int parallel) {
   Image result;
   result.data = NULL;
   result.width = result.height = 0;
-  result.channels = 1;
-  int numPixels = img->width * img->height;
-  unsigned char *grayBuffer = (unsigned char *)malloc(numPixels);
-  if (!grayBuffer) {
-    fprintf(stderr, "Failed to allocate memory for grayscale buffer.\n");
+  result.channels = RGB_CHANNELS;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open file: %s\n", filename);
     return result;
   }
 
-  for (int i = 0; i < numPixels; ++i) {
-    unsigned char r = img->data[i * 3];
-    unsigned char g = img->data[i * 3 + 1];
-    unsigned char b = img->data[i * 3 + 2];
-    grayBuffer[i] = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    fprintf(stderr, "Failed to read file: %s\n", filename);
+    close(fd);
+    return result;
+  }
+  size_t fileSize = (size_t)st.st_size;
+
+  void *mapped = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped != MAP_FAILED) {
+    madvise(mapped, fileSize, MADV_WILLNEED);
+    result = decode_buffer((const unsigned char *)mapped, fileSize, parallel);
+    munmap(mapped, fileSize);
+    close(fd);
+    return result;
   }
 
-  result.channels = 1;
-  result.width = img->width;
-  result.height = img->height;
-  result.data = grayBuffer;
+  unsigned char *jpegBuf = (unsigned char *)stitch_malloc(fileSize);
+  if (!jpegBuf) {
+    fprintf(stderr, "Failed to allocate memory for JPEG buffer.\n");
+    close(fd);
+    return result;
+  }
+  size_t done = 0;
+  while (done < fileSize) {
+    ssize_t n = read(fd, jpegBuf + done, fileSize - done);
+    if (n <= 0)
+      break;
+    done += (size_t)n;
+  }
+  close(fd);
 
+  if (done == fileSize) {
+    result = decode_buffer(jpegBuf, fileSize, parallel);
+  } else {
+    fprintf(stderr, "Failed to read file: %s\n", filename);
+  }
+  stitch_free(jpegBuf);
   return result;
 }
 
-int compress_jpeg(const char *outputFilename, const Image *img, int quality) {
-  tjhandle handle = tjInitCompress();
-  if (!handle) {
-    fprintf(stderr, "Failed to initialize TurboJPEG compressor.\n");
-    return 0;
+Image decompress_jpeg(const char *filename) {
+  return decode_file(filename, 1);
+}
+
+void *decode_files_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  JpegBatchThreadData *b = arg->workerThreadArgs->jbd;
+  for (int i = arg->start_index; i < arg->end_index; i++) {
+    b->images[i] = decode_file(b->filenames[i], b->parallel);
   }
+  return NULL;
+}
 
-  unsigned char *jpegBuf = NULL;
-  unsigned long jpegSize = 0;
+int decompress_jpeg_batch(const char **filenames, int count, Image *images) {
+  // with fewer files than threads each file still splits its own decode
+  JpegBatchThreadData b = {filenames, images, count < get_cpus_count()};
+  WorkerThreadArgs w;
+  w.jbd = &b;
+  ParallelOperatorArgs args = {count, &w};
+  parallel_operator(DECODE_FILES, &args);
+
+  int ok = 1;
+  for (int i = 0; i < count; i++) {
+    ok = ok && images[i].data != NULL;
+  }
+  return ok;
+}
 
-  if (tjCompress2(handle, img->data, img->width, 0, img->height, TJPF_RGB,
-                  &jpegBuf, &jpegSize, TJSAMP_444, quality,
-                  TJFLAG_FASTDCT) < 0) {
-    fprintf(stderr, "Failed to compress JPEG: %s\n", tjGetErrorStr());
-    tjDestroy(handle);
-    return 0;
+struct JpegScanlineReader {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr error;
+  jmp_buf error_jump;
+};
+
+static void scanline_error_exit(j_common_ptr cinfo) {
+  JpegScanlineReader *reader = (JpegScanlineReader *)cinfo->client_data;
+  char message[JMSG_LENGTH_MAX];
+  cinfo->err->format_message(cinfo, message);
+  fprintf(stderr, "Failed to decompress JPEG: %s\n", message);
+  longjmp(reader->error_jump, 1);
+}
+
+// warnings are not fatal, as with TurboJPEG
+static void scanline_message(j_common_ptr cinfo, int level) {
+  (void)cinfo;
+  (void)level;
+}
+
+JpegScanlineReader *open_jpeg_scanlines(const unsigned char *jpegBuf,
+                                        unsigned long jpegSize, int channels,
+                                        int *width, int *height) {
+  JpegScanlineReader *reader =
+      (JpegScanlineReader *)stitch_calloc(1, sizeof(JpegScanlineReader));
+  if (!reader)
+    return NULL;
+
+  reader->cinfo.err = jpeg_std_error(&reader->error);
+  reader->error.error_exit = scanline_error_exit;
+  reader->error.emit_message = scanline_message;
+  reader->cinfo.client_data = reader;
+  if (setjmp(reader->error_jump)) {
+    jpeg_destroy_decompress(&reader->cinfo);
+    stitch_free(reader);
+    return NULL;
   }
 
-  FILE *outFile = fopen(outputFilename, "wb");
-  if (!outFile) {
-    fprintf(stderr, "Failed to open output file: %s\n", outputFilename);
-    tjFree(jpegBuf);
-    tjDestroy(handle);
+  jpeg_create_decompress(&reader->cinfo);
+  jpeg_mem_src(&reader->cinfo, (unsigned char *)jpegBuf, jpegSize);
+  jpeg_read_header(&reader->cinfo, TRUE);
+  reader->cinfo.out_color_space =
+      channels == GRAY_CHANNELS ? JCS_GRAYSCALE : JCS_RGB;
+  // TJFLAG_FASTDCT, so rows match decompress_jpeg
+  reader->cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&reader->cinfo);
+
+  *width = reader->cinfo.output_width;
+  *height = reader->cinfo.output_height;
+  return reader;
+}
+
+int read_jpeg_scanlines(JpegScanlineReader *reader, unsigned char *rows,
+                        int max_rows) {
+  if (setjmp(reader->error_jump))
+    return -1;
+
+  size_t pitch = (size_t)reader->cinfo.output_width *
+                 reader->cinfo.output_components;
+  int count = 0;
+  while (count < max_rows &&
+         reader->cinfo.output_scanline < reader->cinfo.output_height) {
+    JSAMPROW row = rows + count * pitch;
+    count += jpeg_read_scanlines(&reader->cinfo, &row, 1);
+  }
+  return count;
+}
+
+void close_jpeg_scanlines(JpegScanlineReader *reader) {
+  if (!reader)
+    return;
+  jpeg_destroy_decompress(&reader->cinfo);
+  stitch_free(reader);
+}
+
+static void jpeg_format(const Image *img, int *pixelFormat, int *subsamp) {
+  // JPEG has no alpha, RGBA results are written as RGBX
+  *pixelFormat = img->channels == GRAY_CHANNELS   ? TJPF_GRAY
+                 : img->channels == RGBA_CHANNELS ? TJPF_RGBX
+                                                  : TJPF_RGB;
+  *subsamp = img->channels == GRAY_CHANNELS ? TJSAMP_GRAY : TJSAMP_444;
+}
+
+// a restart interval counts MCUs in 16 bits
+#define MAX_RESTART_INTERVAL 65535
+#define PARALLEL_ENCODE_MIN_PIXELS (1 << 20)
+#define STRIPES_PER_THREAD 4
+
+unsigned long jpeg_buffer_size(const Image *img) {
+  int pixelFormat, subsamp;
+  jpeg_format(img, &pixelFormat, &subsamp);
+  // striped output adds a DRI segment and a marker and padding per stripe
+  return tjBufSize(img->width, img->height, subsamp) +
+         3 * ((img->height + 7) / 8) + 6;
+}
+
+void *encode_stripes_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  JpegStripeThreadData *e = arg->workerThreadArgs->jst;
+  const Image *img = e->img;
+  size_t pitch = (size_t)img->width * img->channels;
+  tjhandle handle = thread_handle(1);
+
+  for (int i = arg->start_index; i < arg->end_index; i++) {
+    int y0 = i * e->stripe_height;
+    int rows = min(e->stripe_height, img->height - y0);
+    if (!handle ||
+        tjCompress2(handle, img->data + (size_t)y0 * pitch, img->width,
+                    (int)pitch, rows, e->pixel_format, &e->stripes[i],
+                    &e->stripe_sizes[i], e->subsamp, e->quality,
+                    TJFLAG_FASTDCT) < 0) {
+      __atomic_store_n(&e->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return NULL;
+}
+
+// offsets of the frame header and the scan header, 0 when malformed
+static size_t find_scan(const unsigned char *jpeg, size_t size, size_t *sof,
+                        size_t *sos) {
+  size_t pos = 2;
+  *sof = 0;
+  while (pos + 4 <= size && jpeg[pos] == 0xFF) {
+    int marker = jpeg[pos + 1];
+    size_t length = ((size_t)jpeg[pos + 2] << 8) | jpeg[pos + 3];
+    if (marker == 0xC0 || marker == 0xC1)
+      *sof = pos;
+    if (marker == 0xDA) {
+      *sos = pos;
+      return *sof && pos + 2 + length <= size ? pos + 2 + length : 0;
+    }
+    pos += 2 + length;
+  }
+  return 0;
+}
+
+/*
+ * Every stripe starts with fresh DC predictors like a restart interval
+ * does, so the entropy-coded data of the stripes, separated by RST
+ * markers, is the scan of the whole image with one stripe per interval.
+ * TurboJPEG writes the same tables for every stripe.
+ */
+static int join_stripes(const JpegStripeThreadData *e, int count,
+                        int restart, unsigned char **jpegBuf,
+                        unsigned long *jpegSize) {
+  size_t sof, sos;
+  const unsigned char *first = e->stripes[0];
+  size_t header = find_scan(first, e->stripe_sizes[0], &sof, &sos);
+  if (!header)
     return 0;
+
+  // one DRI segment, then each stripe's data and the marker that follows it
+  size_t total = header + 6;
+  for (int i = 0; i < count; i++) {
+    const unsigned char *stripe = e->stripes[i];
+    size_t size = e->stripe_sizes[i];
+    size_t stripe_sof, stripe_sos;
+    if (find_scan(stripe, size, &stripe_sof, &stripe_sos) != header ||
+        size < header + 2 || stripe[size - 1] != 0xD9 ||
+        memcmp(stripe, first, sof + 5) ||
+        memcmp(stripe + sof + 7, first + sof + 7, header - sof - 7))
+      return 0;
+    total += size - header;
   }
 
-  fwrite(jpegBuf, 1, jpegSize, outFile);
-  fclose(outFile);
+  unsigned char *out;
+  if (*jpegBuf) {
+    if (total > *jpegSize) {
+      fprintf(stderr, "Failed to compress JPEG: buffer too small\n");
+      return 0;
+    }
+    out = *jpegBuf;
+  } else {
+    out = tjAlloc((int)total);
+    if (!out)
+      return 0;
+  }
 
-  tjFree(jpegBuf);
-  tjDestroy(handle);
+  size_t pos = sos;
+  memcpy(out, first, sos);
+  out[sof + 5] = (unsigned char)(e->img->height >> 8);
+  out[sof + 6] = (unsigned char)e->img->height;
+  const unsigned char dri[6] = {0xFF, 0xDD, 0, 4, (unsigned char)(restart >> 8),
+                                (unsigned char)restart};
+  memcpy(out + pos, dri, sizeof(dri));
+  pos += sizeof(dri);
+  memcpy(out + pos, first + sos, header - sos);
+  pos += header - sos;
+
+  for (int i = 0; i < count; i++) {
+    // the entropy-coded data runs up to the stripe's EOI marker
+    size_t length = e->stripe_sizes[i] - header - 2;
+    memcpy(out + pos, e->stripes[i] + header, length);
+    pos += length;
+    out[pos++] = 0xFF;
+    out[pos++] = i + 1 < count ? 0xD0 + (i & 7) : 0xD9;
+  }
 
+  *jpegBuf = out;
+  *jpegSize = pos;
   return 1;
 }
 
-int compress_grayscale_jpeg(const char *outputFilename, const Image *img,
-                            int quality) {
-  tjhandle handle = tjInitCompress();
+static int compress_striped(const Image *img, int quality, int pixelFormat,
+                            int subsamp, unsigned char **jpegBuf,
+                            unsigned long *jpegSize) {
+  // 4:4:4 and grayscale MCUs are 8x8
+  int mcus_per_row = (img->width + 7) / 8;
+  int mcu_rows = (img->height + 7) / 8;
+  if (mcus_per_row > MAX_RESTART_INTERVAL)
+    return 0;
+  int stripe_rows = (mcu_rows + get_cpus_count() * STRIPES_PER_THREAD - 1) /
+                    (get_cpus_count() * STRIPES_PER_THREAD);
+  stripe_rows = clamp(stripe_rows, 1, MAX_RESTART_INTERVAL / mcus_per_row);
+  int count = (mcu_rows + stripe_rows - 1) / stripe_rows;
+  if (count < 2)
+    return 0;
+
+  unsigned char **stripes =
+      (unsigned char **)stitch_calloc(count, sizeof(unsigned char *));
+  unsigned long *sizes =
+      (unsigned long *)stitch_calloc(count, sizeof(unsigned long));
+  int ok = 0;
+  if (stripes && sizes) {
+    JpegStripeThreadData e = {img,     stripe_rows * 8, pixelFormat, subsamp,
+                              quality, stripes,         sizes,       0};
+    WorkerThreadArgs w;
+    w.jst = &e;
+    ParallelOperatorArgs args = {count, &w};
+    parallel_operator(ENCODE_STRIPES, &args);
+    ok = !e.failed && join_stripes(&e, count, stripe_rows * mcus_per_row,
+                                   jpegBuf, jpegSize);
+  }
+
+  for (int i = 0; stripes && i < count; i++) {
+    tjFree(stripes[i]);
+  }
+  stitch_free(stripes);
+  stitch_free(sizes);
+  return ok;
+}
+
+int compress_jpeg_buffer(const Image *img, int quality,
+                         unsigned char **jpegBuf, unsigned long *jpegSize) {
+  tjhandle handle = thread_handle(1);
   if (!handle) {
     fprintf(stderr, "Failed to initialize TurboJPEG compressor.\n");
     return 0;
   }
 
+  int pixelFormat, subsamp;
+  jpeg_format(img, &pixelFormat, &subsamp);
+  if (get_cpus_count() > 1 &&
+      (size_t)img->width * img->height >= PARALLEL_ENCODE_MIN_PIXELS &&
+      compress_striped(img, quality, pixelFormat, subsamp, jpegBuf,
+                       jpegSize)) {
+    return 1;
+  }
+
+  int flags = TJFLAG_FASTDCT;
+  if (*jpegBuf) {
+    flags |= TJFLAG_NOREALLOC;
+  } else {
+    *jpegSize = 0;
+  }
+
+  if (tjCompress2(handle, img->data, img->width, 0, img->height, pixelFormat,
+                  jpegBuf, jpegSize, subsamp, quality, flags) < 0) {
+    fprintf(stderr, "Failed to compress JPEG: %s\n", tjGetErrorStr());
+    return 0;
+  }
+  return 1;
+}
+
+static int write_jpeg_file(const char *outputFilename, const Image *img,
+                           int quality) {
   unsigned char *jpegBuf = NULL;
   unsigned long jpegSize = 0;
-
-  if (tjCompress2(handle, img->data, img->width, 0, img->height, TJPF_GRAY,
-                  &jpegBuf, &jpegSize, TJSAMP_GRAY, quality,
-                  TJFLAG_FASTDCT) < 0) {
-    fprintf(stderr, "Failed to compress grayscale JPEG: %s\n", tjGetErrorStr());
-    tjDestroy(handle);
+  if (!compress_jpeg_buffer(img, quality, &jpegBuf, &jpegSize)) {
     return 0;
   }
 
@@ -155,17 +656,51 @@ int compress_grayscale_jpeg(const char *outputFilename, const Image *img,
   if (!outFile) {
     fprintf(stderr, "Failed to open output file: %s\n", outputFilename);
     tjFree(jpegBuf);
-    tjDestroy(handle);
     return 0;
   }
 
-  fwrite(jpegBuf, 1, jpegSize, outFile);
+  int written = fwrite(jpegBuf, 1, jpegSize, outFile) == jpegSize;
   fclose(outFile);
-
   tjFree(jpegBuf);
-  tjDestroy(handle);
+  return written;
+}
 
-  return 1;
+Image convert_RGB_to_gray(const Image *img) {
+  Image result;
+  result.data = NULL;
+  result.width = result.height = 0;
+  result.channels = 1;
+  size_t numPixels = (size_t)img->width * img->height;
+  unsigned char *grayBuffer = (unsigned char *)stitch_malloc(numPixels);
+  if (!grayBuffer) {
+    fprintf(stderr, "Failed to allocate memory for grayscale buffer.\n");
+    return result;
+  }
+
+  for (size_t i = 0; i < numPixels; ++i) {
+    unsigned char r = img->data[i * 3];
+    unsigned char g = img->data[i * 3 + 1];
+    unsigned char b = img->data[i * 3 + 2];
+    grayBuffer[i] = (unsigned char)(0.299 * r + 0.587 * g + 0.114 * b);
+  }
+
+  result.channels = 1;
+  result.width = img->width;
+  result.height = img->height;
+  result.data = grayBuffer;
+
+  return result;
+}
+
+int compress_jpeg(const char *outputFilename, const Image *img, int quality) {
+  return write_jpeg_file(outputFilename, img, quality);
+}
+
+int compress_grayscale_jpeg(const char *outputFilename, const Image *img,
+                            int quality) {
+  Image gray = *img;
+  gray.channels = GRAY_CHANNELS;
+  return write_jpeg_file(outputFilename, &gray, quality);
 }
 
 Image create_mask(int width, int height, float range, int left, int right) {
@@ -173,13 +708,14 @@ Image create_mask(int width, int height, float range, int left, int right) {
   result.data = NULL;
   result.width = result.height = 0;
   result.channels = 1;
-  unsigned char *grayBuffer = (unsigned char *)malloc(width * height);
+  unsigned char *grayBuffer =
+      (unsigned char *)stitch_malloc((size_t)width * height);
   if (!grayBuffer) {
     fprintf(stderr, "Failed to allocate memory for mask buffer.\n");
     exit(EXIT_FAILURE);
   }
 
-  memset(grayBuffer, 255, width * height);
+  memset(grayBuffer, 255, (size_t)width * height);
 
   if (!(left || right))
     return result;
@@ -189,7 +725,7 @@ Image create_mask(int width, int height, float range, int left, int right) {
   if (left) {
     for (int i = 0; i < cut; ++i) {
       for (int j = 0; j < height; ++j) {
-        grayBuffer[i + width * j] = 0;
+        grayBuffer[i + (size_t)width * j] = 0;
       }
     }
   }
@@ -197,7 +733,7 @@ Image create_mask(int width, int height, float range, int left, int right) {
   if (right) {
     for (int i = 0; i < cut; ++i) {
       for (int j = 0; j < height; ++j) {
-        grayBuffer[(width - i - 1) + width * j] = 0;
+        grayBuffer[(width - i - 1) + (size_t)width * j] = 0;
       }
     }
   }
@@ -216,24 +752,25 @@ Image create_vertical_mask(int width, int height, float range, int top,
   result.data = NULL;
   result.width = result.height = 0;
   result.channels = 1;
-  unsigned char *grayBuffer = (unsigned char *)malloc(width * height);
+  unsigned char *grayBuffer =
+      (unsigned char *)stitch_malloc((size_t)width * height);
   if (!grayBuffer) {
     return result;
   }
-  memset(grayBuffer, 255, width * height);
+  memset(grayBuffer, 255, (size_t)width * height);
 
   if (!(top || bottom)) {
     return result;
   }
 
-  int cut = (int)(range * height * width);
+  size_t cut = (size_t)(range * height * width);
 
   if (top) {
     memset(grayBuffer, 0, cut);
   }
 
   if (bottom) {
-    memset(grayBuffer + (width * height - cut), 0, cut);
+    memset(grayBuffer + ((size_t)width * height - cut), 0, cut);
   }
 
   result.data = grayBuffer;
@@ -250,21 +787,24 @@ void add_border_to_image(Image *img, int borderTop, int borderBottom,
   int newWidth = img->width + borderLeft + borderRight;
   int newHeight = img->height + borderTop + borderBottom;
 
-  unsigned char *borderedImage = (unsigned char *)calloc(
-      newWidth * newHeight * channels, sizeof(unsigned char));
+  // the replacement buffer is charged to whoever owns the original one
+  MemoryContext *previous = memory_activate(memory_context_of(img->data));
+  unsigned char *borderedImage = (unsigned char *)stitch_calloc(
+      (size_t)newWidth * newHeight * channels, sizeof(unsigned char));
+  memory_activate(previous);
   if (!borderedImage) {
     return;
   }
 
   for (int y = 0; y < newHeight; ++y) {
     for (int x = 0; x < newWidth; ++x) {
-      int newIdx = (y * newWidth + x) * channels;
+      size_t newIdx = ((size_t)y * newWidth + x) * channels;
 
       if (x >= borderLeft && x < (img->width + borderLeft) && y >= borderTop &&
           y < (img->height + borderTop)) {
         int origX = x - borderLeft;
         int origY = y - borderTop;
-        int origIdx = (origY * (img->width) + origX) * channels;
+        size_t origIdx = ((size_t)origY * img->width + origX) * channels;
 
         for (int c = 0; c < channels; ++c) {
           borderedImage[newIdx + c] = img->data[origIdx + c];
@@ -273,7 +813,7 @@ void add_border_to_image(Image *img, int borderTop, int borderBottom,
         int origX = clamp(x - borderLeft, 0, img->width - 1);
         int origY = clamp(y - borderTop, 0, img->height - 1);
 
-        int origIdx = (origY * (img->width) + origX) * channels;
+        size_t origIdx = ((size_t)origY * img->width + origX) * channels;
 
         for (int c = 0; c < channels; ++c) {
           borderedImage[newIdx + c] = 0;
@@ -294,7 +834,7 @@ void add_border_to_image(Image *img, int borderTop, int borderBottom,
         origX = clamp(origX, 0, img->width - 1);
         origY = clamp(origY, 0, img->height - 1);
 
-        int origIdx = (origY * (img->width) + origX) * channels;
+        size_t origIdx = ((size_t)origY * img->width + origX) * channels;
 
         for (int c = 0; c < channels; ++c) {
           borderedImage[newIdx + c] = img->data[origIdx + c];
@@ -303,7 +843,7 @@ void add_border_to_image(Image *img, int borderTop, int borderBottom,
     }
   }
 
-  free(img->data);
+  stitch_free(img->data);
   img->data = borderedImage;
   img->width = newWidth;
   img->height = newHeight;
@@ -322,8 +862,10 @@ void crop_image_buf(Image *img, int cut_top, int cut_bottom, int cut_left,
     return;
   }
 
+  MemoryContext *previous = memory_activate(memory_context_of(img->data));
   unsigned char *cropped =
-      (unsigned char *)malloc(new_width * new_height * channels);
+      (unsigned char *)stitch_malloc((size_t)new_width * new_height * channels);
+  memory_activate(previous);
 
   if (!cropped) {
     return;
@@ -331,12 +873,13 @@ void crop_image_buf(Image *img, int cut_top, int cut_bottom, int cut_left,
 
   for (int y = 0; y < new_height; y++) {
     int src_y = y + cut_top;
-    int src_offset = (src_y * (img->width) + cut_left) * channels;
-    int dest_offset = y * new_width * channels;
-    memcpy(cropped + dest_offset, img->data + src_offset, new_width * channels);
+    size_t src_offset = ((size_t)src_y * img->width + cut_left) * channels;
+    size_t dest_offset = (size_t)y * new_width * channels;
+    memcpy(cropped + dest_offset, img->data + src_offset,
+           (size_t)new_width * channels);
   }
 
-  free(img->data);
+  stitch_free(img->data);
   img->data = cropped;
   img->width = new_width;
   img->height = new_height;
@@ -344,7 +887,8 @@ void crop_image_buf(Image *img, int cut_top, int cut_bottom, int cut_left,
 
 #define IMAGE_CONVERT_FUNC(NAME, IMAGE_T_IN, IMAGE_T_OUT, OUT_TYPE)            \
   void NAME(IMAGE_T_IN *in, IMAGE_T_OUT *out) {                                \
-    for (size_t i = 0; i < in->channels * in->height * in->width; i++) {       \
+    size_t size = (size_t)in->channels * in->height * in->width;               \
+    for (size_t i = 0; i < size; i++) {                                        \
       out->data[i] = (OUT_TYPE)clamp((int)in->data[i], 0, 255);                \
     }                                                                          \
   }
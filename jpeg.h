@@ -7,6 +7,7 @@ extern "C" {
 #define IMAGE_HEADERS
 #define RGB_CHANNELS 3
 #define GRAY_CHANNELS 1
+#define RGBA_CHANNELS 4
 
 typedef enum {
     BORDER_CONSTANT,
@@ -45,7 +46,42 @@ typedef enum {
     IMAGEF
 } ImageType;
 
+/*
+ * Baseline JPEGs with restart markers on MCU-row boundaries are decoded
+ * in horizontal segments on several threads; everything else, and small
+ * images, take the single-threaded path.
+ */
 Image decompress_jpeg(const char *filename);
+// decodes count files concurrently into images[], returns 0 if any failed
+int decompress_jpeg_batch(const char **filenames, int count, Image *images);
+void *decode_segments_worker(void *args);
+void *decode_files_worker(void *args);
+Image decompress_jpeg_buffer(const unsigned char *jpegBuf, unsigned long jpegSize);
+/*
+ * Encodes into *jpegBuf. A non-NULL *jpegBuf is the caller's buffer of
+ * *jpegSize bytes (jpeg_buffer_size() is always enough) and is never
+ * reallocated; with NULL TurboJPEG allocates one, release it with tjFree.
+ * Large images are encoded as horizontal stripes on several threads and
+ * joined with restart markers into one baseline JPEG.
+ */
+int compress_jpeg_buffer(const Image *img, int quality,
+                         unsigned char **jpegBuf, unsigned long *jpegSize);
+unsigned long jpeg_buffer_size(const Image *img);
+void *encode_stripes_worker(void *args);
+
+/*
+ * Pulls decoded rows out of a JPEG a few at a time, as 8 bit RGB or
+ * grayscale, with the same DCT as decompress_jpeg. For consumers that do
+ * not want the whole image in memory at once.
+ */
+typedef struct JpegScanlineReader JpegScanlineReader;
+JpegScanlineReader *open_jpeg_scanlines(const unsigned char *jpegBuf,
+                                        unsigned long jpegSize, int channels,
+                                        int *width, int *height);
+// reads up to max_rows rows into rows, returns the count or -1 on error
+int read_jpeg_scanlines(JpegScanlineReader *reader, unsigned char *rows,
+                        int max_rows);
+void close_jpeg_scanlines(JpegScanlineReader *reader);
 Image convert_RGB_to_gray(const Image *img);
 int compress_jpeg(const char *outputFilename, const Image *img, int quality);
 int compress_grayscale_jpeg(const char *outputFilename, const Image *img, int quality);
@@ -0,0 +1,1057 @@
+#include "kernels.h"
+#include "simde/simde/x86/avx2.h"
+#if defined(__AVX512BW__)
+#include "simde/simde/x86/avx512.h"
+#endif
+#include <math.h>
+#include <stdlib.h>
+
+/*
+ * This file is compiled once per instruction set. CMake defines
+ * KERNEL_VARIANT and the matching -m flags for each copy; everything here
+ * is static except the table, whose name carries the variant suffix.
+ */
+#ifndef KERNEL_VARIANT
+#define KERNEL_VARIANT baseline
+#endif
+
+#define KERNEL_CONCAT_(name, variant) name##_##variant
+#define KERNEL_CONCAT(name, variant) KERNEL_CONCAT_(name, variant)
+#define KERNEL_STRING_(variant) #variant
+#define KERNEL_STRING(variant) KERNEL_STRING_(variant)
+
+static int convolve_1d_v_simd(int x, int width, int *row0, int *row1,
+                              int *row2, int *row3, int *row4,
+                              unsigned char *out_row) {
+
+  // v0 + v4 + 2v2 + 4(v1 + v3 + v2)
+#if defined(__AVX512BW__)
+  for (; x < width - 16; x += 16) {
+    simde__m512i r0 = simde_mm512_loadu_si512((const void *)(row0 + x));
+    simde__m512i r1 = simde_mm512_loadu_si512((const void *)(row1 + x));
+    simde__m512i r2 = simde_mm512_loadu_si512((const void *)(row2 + x));
+    simde__m512i r3 = simde_mm512_loadu_si512((const void *)(row3 + x));
+    simde__m512i r4 = simde_mm512_loadu_si512((const void *)(row4 + x));
+
+    simde__m512i sum = simde_mm512_add_epi32(r0, r4);
+    sum = simde_mm512_add_epi32(sum, simde_mm512_slli_epi32(r2, 1));
+    simde__m512i t = simde_mm512_add_epi32(simde_mm512_add_epi32(r1, r3), r2);
+    sum = simde_mm512_add_epi32(sum, simde_mm512_slli_epi32(t, 2));
+    sum = simde_mm512_srli_epi32(
+        simde_mm512_add_epi32(sum, simde_mm512_set1_epi32(128)), 8);
+
+    // the taps are non-negative, unsigned saturation matches packs + packus
+    simde_mm_storeu_si128((simde__m128i *)out_row,
+                          simde_mm512_cvtusepi32_epi8(sum));
+    out_row += 16;
+  }
+#endif
+  for (; x < width - 8; x += 8) {
+    simde__m256i r0 = simde_mm256_loadu_si256((const simde__m256i *)(row0 + x));
+    simde__m256i r1 = simde_mm256_loadu_si256((const simde__m256i *)(row1 + x));
+    simde__m256i r2 = simde_mm256_loadu_si256((const simde__m256i *)(row2 + x));
+    simde__m256i r3 = simde_mm256_loadu_si256((const simde__m256i *)(row3 + x));
+    simde__m256i r4 = simde_mm256_loadu_si256((const simde__m256i *)(row4 + x));
+
+    simde__m256i sum = simde_mm256_add_epi32(r0, r4);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(r2, 1));
+    simde__m256i t = simde_mm256_add_epi32(simde_mm256_add_epi32(r1, r3), r2);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(t, 2));
+
+    const simde__m256i bias = simde_mm256_set1_epi32(128);
+    sum = simde_mm256_add_epi32(sum, bias);
+    sum = simde_mm256_srli_epi32(sum, 8);
+
+    simde__m128i lo16 = simde_mm256_castsi256_si128(sum);
+    simde__m128i hi16 = simde_mm256_extracti128_si256(sum, 1);
+    simde__m128i packed = simde_mm_packs_epi32(lo16, hi16);
+    simde__m128i out8 = simde_mm_packus_epi16(packed, packed);
+    simde_mm_storel_epi64((simde__m128i *)out_row, out8);
+
+    out_row += 8;
+  }
+
+  return x;
+}
+
+static int convolve_1d_3c(int x, int width, unsigned char *cur_src,
+                          int src_width, int *temp_out) {
+  for (; x < width; ++x) {
+    int xx = (x * 2);
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+      int p0 = reflect_index(xx - 2, src_width),
+          p1 = reflect_index(xx - 1, src_width), p2 = xx,
+          p3 = reflect_index(xx + 1, src_width),
+          p4 = reflect_index(xx + 2, src_width);
+      int s0 = cur_src[p0 * RGB_CHANNELS + c];
+      int s1 = cur_src[p1 * RGB_CHANNELS + c];
+      int s2 = cur_src[p2 * RGB_CHANNELS + c];
+      int s3 = cur_src[p3 * RGB_CHANNELS + c];
+      int s4 = cur_src[p4 * RGB_CHANNELS + c];
+
+      temp_out[0] = s0 + s1 * 4 + s2 * 6 + s3 * 4 + s4;
+      ++temp_out;
+    }
+  }
+  return x;
+}
+
+static void char_convolve_3(int range_start, int range_end, int src_width,
+                            int src_height, unsigned char *src,
+                            unsigned char *dst) {
+
+  int y = range_start;
+  int yy = y * 2;
+  int width = src_width / 2, height = src_height / 2;
+
+  size_t src_row = (size_t)src_width * RGB_CHANNELS;
+  unsigned char *rows[5] = {src + reflect_index(yy - 2, src_height) * src_row,
+                            src + reflect_index(yy - 1, src_height) * src_row,
+                            src + yy * src_row,
+                            src + reflect_index(yy + 1, src_height) * src_row,
+                            src + reflect_index(yy + 2, src_height) * src_row};
+
+  int *temp_dst_out =
+      (int *)stitch_malloc(5 * width * RGB_CHANNELS * sizeof(int));
+  if (!temp_dst_out)
+    return;
+
+  int cache[16];
+
+  int *temp_dst_rows[5] = {temp_dst_out, temp_dst_out + (width * RGB_CHANNELS),
+                           temp_dst_out + (2 * width * RGB_CHANNELS),
+                           temp_dst_out + (3 * width * RGB_CHANNELS),
+                           temp_dst_out + (4 * width * RGB_CHANNELS)};
+  int s_y = -2;
+  int e_y = 3;
+
+  for (; y < range_end; y++) {
+
+    for (; s_y < e_y; s_y++) {
+      unsigned char *cur_src = rows[s_y + 2];
+      int *temp_out = temp_dst_rows[s_y + 2];
+      int x = 0;
+      const unsigned char *src0 = cur_src;
+      const unsigned char *src1 = cur_src + 3;
+      const unsigned char *src2 = cur_src + 6;
+      const unsigned char *src3 = cur_src + 9;
+      const unsigned char *src4 = cur_src + 12;
+
+      x = convolve_1d_3c(x, min(3, width), cur_src, src_width, temp_out);
+      temp_out = temp_out + (x * 3);
+
+      for (; x <= width - 3; x += 3) {
+        simde__m256i a_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src0));
+
+        simde__m256i b_16 = simde_mm256_slli_epi16(
+            simde_mm256_cvtepu8_epi16(
+                simde_mm_loadu_si128((const simde__m128i *)src1)),
+            2);
+
+        simde__m256i c_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src2));
+
+        c_16 = simde_mm256_add_epi16(
+            simde_mm256_add_epi16(simde_mm256_slli_epi16(c_16, 1), c_16),
+            simde_mm256_add_epi16(simde_mm256_slli_epi16(c_16, 1), c_16));
+
+        simde__m256i d_16 = simde_mm256_slli_epi16(
+            simde_mm256_cvtepu8_epi16(
+                simde_mm_loadu_si128((const simde__m128i *)src3)),
+            2);
+
+        simde__m256i e_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src4));
+
+        simde__m256i sum = simde_mm256_add_epi16(
+            a_16, simde_mm256_add_epi16(
+                      b_16, simde_mm256_add_epi16(
+                                c_16, simde_mm256_add_epi16(d_16, e_16))));
+
+        simde__m256i lo_sum =
+            simde_mm256_cvtepi16_epi32(simde_mm256_castsi256_si128(sum));
+        simde__m256i hi_sum =
+            simde_mm256_cvtepi16_epi32(simde_mm256_extracti128_si256(sum, 1));
+
+        simde_mm256_storeu_si256((simde__m256i *)cache, lo_sum);
+        simde_mm256_storeu_si256((simde__m256i *)(cache + 8), hi_sum);
+
+        temp_out[0] = cache[0], temp_out[1] = cache[1], temp_out[2] = cache[2];
+        temp_out[3] = cache[6], temp_out[4] = cache[7], temp_out[5] = cache[8];
+        temp_out[6] = cache[12], temp_out[7] = cache[13],
+        temp_out[8] = cache[14];
+
+        temp_out += (3 * RGB_CHANNELS);
+        src0 += (6 * RGB_CHANNELS), src1 += (6 * RGB_CHANNELS);
+        src2 += (6 * RGB_CHANNELS);
+        src3 += (6 * RGB_CHANNELS), src4 += (6 * RGB_CHANNELS);
+      }
+
+      convolve_1d_3c(x, width, cur_src, src_width, temp_out);
+    }
+
+    yy = y * 2;
+    unsigned char *out_row = dst + (size_t)RGB_CHANNELS * width * y;
+
+    int *row0 = temp_dst_rows[0], *row1 = temp_dst_rows[1],
+        *row2 = temp_dst_rows[2], *row3 = temp_dst_rows[3],
+        *row4 = temp_dst_rows[4];
+
+    int xx =
+        convolve_1d_v_simd(0, width * 3, row0, row1, row2, row3, row4, out_row);
+    int x = xx / 3;
+    out_row = out_row + (x * RGB_CHANNELS);
+
+    for (; x < width; ++x) {
+      int xx = x * RGB_CHANNELS;
+      for (int c = 0; c < RGB_CHANNELS; c++) {
+        out_row[0] = clamp((row0[xx + c] + row1[xx + c] * 4 + row2[xx + c] * 6 +
+                            4 * row3[xx + c] + row4[xx + c]) >>
+                               8,
+                           0, 255);
+
+        ++out_row;
+      }
+    }
+
+    rows[0] = rows[2], rows[1] = rows[3], rows[2] = rows[4];
+    rows[3] = src + reflect_index(((y + 1) * 2) + 1, src_height) * src_row;
+    rows[4] = src + reflect_index(((y + 1) * 2) + 2, src_height) * src_row;
+
+    int *temp1 = temp_dst_rows[0], *temp2 = temp_dst_rows[1];
+    temp_dst_rows[0] = temp_dst_rows[2], temp_dst_rows[1] = temp_dst_rows[3],
+    temp_dst_rows[2] = temp_dst_rows[4], temp_dst_rows[3] = temp1,
+    temp_dst_rows[4] = temp2;
+
+    s_y = 1;
+  }
+
+  stitch_free(temp_dst_out);
+}
+
+static int convolve_1d_1c(int x, int width, unsigned char *cur_src,
+                          int src_width, int *temp_out) {
+  for (; x < width; ++x) {
+    int xx = x * 2;
+    int s0 = cur_src[reflect_index(xx - 2, src_width)];
+    int s1 = cur_src[reflect_index(xx - 1, src_width)];
+    int s2 = cur_src[xx];
+    int s3 = cur_src[reflect_index(xx + 1, src_width)];
+    int s4 = cur_src[reflect_index(xx + 2, src_width)];
+
+    temp_out[0] = s0 + s1 * 4 + s2 * 6 + s3 * 4 + s4;
+    ++temp_out;
+  }
+  return x;
+}
+
+static void char_convolve_1(int range_start, int range_end, int src_width,
+                            int src_height, unsigned char *src,
+                            unsigned char *dst) {
+
+  int y = range_start;
+  int yy = y * 2;
+  int width = src_width / 2, height = src_height / 2;
+
+  size_t src_row = src_width;
+  unsigned char *rows[5] = {src + reflect_index(yy - 2, src_height) * src_row,
+                            src + reflect_index(yy - 1, src_height) * src_row,
+                            src + yy * src_row,
+                            src + reflect_index(yy + 1, src_height) * src_row,
+                            src + reflect_index(yy + 2, src_height) * src_row};
+
+  int *temp_dst_out = (int *)stitch_malloc(5 * width * sizeof(int));
+  if (!temp_dst_out)
+    return;
+
+  int *temp_dst_rows[5] = {
+      temp_dst_out, temp_dst_out + width, temp_dst_out + (2 * width),
+      temp_dst_out + (3 * width), temp_dst_out + (4 * width)};
+
+  int s_y = -2;
+  int e_y = 3;
+
+  for (; y < range_end; y++) {
+    for (; s_y < e_y; s_y++) {
+      unsigned char *cur_src = rows[s_y + 2];
+      int *temp_out = temp_dst_rows[s_y + 2];
+      int x = 0;
+      const unsigned char *src01 = cur_src;
+      const unsigned char *src23 = cur_src + 2;
+      const unsigned char *src4 = cur_src + 3;
+
+      const simde__m256i w1_4 = simde_mm256_setr_epi16(1, 4, 1, 4, 1, 4, 1, 4,
+                                                       1, 4, 1, 4, 1, 4, 1, 4);
+      const simde__m256i w6_4 = simde_mm256_setr_epi16(6, 4, 6, 4, 6, 4, 6, 4,
+                                                       6, 4, 6, 4, 6, 4, 6, 4);
+
+      x = convolve_1d_1c(x, 1, cur_src, src_width, temp_out);
+      temp_out = temp_out + x;
+      for (; x < width - 8;
+           x += 8, src01 += 16, src23 += 16, src4 += 16, temp_out += 8) {
+        simde__m256i a01_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src01));
+        simde__m256i m1 = simde_mm256_madd_epi16(a01_16, w1_4);
+
+        simde__m256i a23_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src23));
+        simde__m256i m2 = simde_mm256_madd_epi16(a23_16, w6_4);
+
+        simde__m256i a4_16 = simde_mm256_cvtepu8_epi16(
+            simde_mm_loadu_si128((const simde__m128i *)src4));
+        simde__m256i fifth = simde_mm256_srli_epi32(a4_16, 16);
+
+        simde__m256i sum =
+            simde_mm256_add_epi32(simde_mm256_add_epi32(m1, m2), fifth);
+
+        simde_mm256_storeu_si256((simde__m256i *)temp_out, sum);
+      }
+
+      convolve_1d_1c(x, width, cur_src, src_width, temp_out);
+    }
+
+    yy = y * 2;
+    unsigned char *out_row = dst + (size_t)width * y;
+
+    int *row0 = temp_dst_rows[0], *row1 = temp_dst_rows[1],
+        *row2 = temp_dst_rows[2], *row3 = temp_dst_rows[3],
+        *row4 = temp_dst_rows[4];
+
+    int x = convolve_1d_v_simd(0, width, row0, row1, row2, row3, row4, out_row);
+    out_row = out_row + x;
+
+    for (; x < width; ++x) {
+      out_row[0] = clamp(
+          (row0[x] + row1[x] * 4 + row2[x] * 6 + 4 * row3[x] + row4[x]) >> 8, 0,
+          255);
+
+      ++out_row;
+    }
+
+    rows[0] = rows[2], rows[1] = rows[3], rows[2] = rows[4];
+    rows[3] = src + reflect_index(((y + 1) * 2) + 1, src_height) * src_row;
+    rows[4] = src + reflect_index(((y + 1) * 2) + 2, src_height) * src_row;
+
+    int *temp1 = temp_dst_rows[0], *temp2 = temp_dst_rows[1];
+    temp_dst_rows[0] = temp_dst_rows[2], temp_dst_rows[1] = temp_dst_rows[3],
+    temp_dst_rows[2] = temp_dst_rows[4], temp_dst_rows[3] = temp1,
+    temp_dst_rows[4] = temp2;
+
+    s_y = 1;
+  }
+
+  stitch_free(temp_dst_out);
+}
+
+// the end of the output columns a sampling call produces
+static inline int sampling_end_col(const SamplingThreadData *s) {
+  return s->end_col ? s->end_col : s->new_width;
+}
+
+#define DEFINE_DOWNSAMPLE_KERNEL(NAME, IMAGE_T, PIXEL_T)                       \
+  static void NAME(SamplingThreadData *data, int start_row, int end_row) {     \
+    IMAGE_T *img = (IMAGE_T *)data->img;                                       \
+    size_t imageSize = image_size(data->img);                                  \
+    PIXEL_T *sampled = (PIXEL_T *)data->sampled;                               \
+    if (data->image_type == IMAGE) {                                           \
+      switch (img->channels) {                                                 \
+      case GRAY_CHANNELS:                                                      \
+        char_convolve_1(start_row, end_row, img->width, img->height,           \
+                        (unsigned char *)img->data, (unsigned char *)sampled); \
+        break;                                                                 \
+      case RGB_CHANNELS:                                                       \
+        char_convolve_3(start_row, end_row, img->width, img->height,           \
+                        (unsigned char *)img->data, (unsigned char *)sampled); \
+        break;                                                                 \
+      default:                                                                 \
+        break;                                                                 \
+      }                                                                        \
+    } else {                                                                   \
+      for (int y = start_row; y < end_row; ++y) {                              \
+        for (int x = data->start_col; x < sampling_end_col(data); ++x) {       \
+          for (char c = 0; c < img->channels; ++c) {                           \
+            float sum = 0.0;                                                   \
+            for (int i = -2; i < 3; i++) {                                     \
+              for (int j = -2; j < 3; j++) {                                   \
+                int src_row = 2 * y + i;                                       \
+                int src_col = 2 * x + j;                                       \
+                int rr = reflect_index(src_row, img->height);                  \
+                int cc = reflect_index(src_col, img->width);                   \
+                size_t pos =                                                   \
+                    (cc + (size_t)rr * img->width) * img->channels + c;        \
+                if (pos < imageSize) {                                         \
+                  sum += GAUSSIAN_KERNEL[i + 2][j + 2] * img->data[pos];       \
+                }                                                              \
+              }                                                                \
+            }                                                                  \
+            if (data->image_type == IMAGE) {                                   \
+              sum = (PIXEL_T)clamp(ceil(sum), 0, 255);                         \
+            }                                                                  \
+            sampled[((size_t)y * data->new_width + x) * img->channels + c] =   \
+                sum;                                                           \
+          }                                                                    \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+DEFINE_DOWNSAMPLE_KERNEL(downsample_rows, Image, unsigned char)
+DEFINE_DOWNSAMPLE_KERNEL(downsample_rows_generic_s, ImageS, short)
+DEFINE_DOWNSAMPLE_KERNEL(downsample_rows_f, ImageF, float)
+
+static void convolve_1d_4c_pixel(int x, const short *src, int src_width,
+                                 int *out) {
+  int xx = x * 2;
+  const short *s0 = src + reflect_index(xx - 2, src_width) * RGBA_CHANNELS;
+  const short *s1 = src + reflect_index(xx - 1, src_width) * RGBA_CHANNELS;
+  const short *s2 = src + xx * RGBA_CHANNELS;
+  const short *s3 = src + reflect_index(xx + 1, src_width) * RGBA_CHANNELS;
+  const short *s4 = src + reflect_index(xx + 2, src_width) * RGBA_CHANNELS;
+  for (int c = 0; c < RGBA_CHANNELS; c++) {
+    out[c] = s0[c] + s1[c] * 4 + s2[c] * 6 + s3[c] * 4 + s4[c];
+  }
+}
+
+// two neighbouring output pixels, each a whole RGBA quad of 32 bit lanes
+static simde__m256i load_4c_pair(const short *a, const short *b) {
+  return simde_mm256_cvtepi16_epi32(
+      simde_mm_unpacklo_epi64(simde_mm_loadl_epi64((const simde__m128i *)a),
+                              simde_mm_loadl_epi64((const simde__m128i *)b)));
+}
+
+// outputs [start, end) of a row, temp_out starting with output start
+static void convolve_1d_4c(const short *src, int src_width, int start, int end,
+                           int *temp_out) {
+  int x = start;
+  for (; x < end && x < 1; ++x) {
+    convolve_1d_4c_pixel(x, src, src_width,
+                         temp_out + (x - start) * RGBA_CHANNELS);
+  }
+
+  for (; x + 1 < end && 2 * x + 4 < src_width; x += 2) {
+    const short *s = src + (2 * x - 2) * RGBA_CHANNELS;
+    simde__m256i t0 = load_4c_pair(s, s + 8);
+    simde__m256i t1 = load_4c_pair(s + 4, s + 12);
+    simde__m256i t2 = load_4c_pair(s + 8, s + 16);
+    simde__m256i t3 = load_4c_pair(s + 12, s + 20);
+    simde__m256i t4 = load_4c_pair(s + 16, s + 24);
+
+    // t0 + t4 + 2t2 + 4(t1 + t3 + t2)
+    simde__m256i sum = simde_mm256_add_epi32(t0, t4);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(t2, 1));
+    simde__m256i t = simde_mm256_add_epi32(simde_mm256_add_epi32(t1, t3), t2);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(t, 2));
+    simde_mm256_storeu_si256(
+        (simde__m256i *)(temp_out + (x - start) * RGBA_CHANNELS), sum);
+  }
+
+  for (; x < end; ++x) {
+    convolve_1d_4c_pixel(x, src, src_width,
+                         temp_out + (x - start) * RGBA_CHANNELS);
+  }
+}
+
+static void convolve_1d_1c_s(const short *src, int src_width, int start,
+                             int end, int *temp_out) {
+  const simde__m256i w1_4 = simde_mm256_setr_epi16(1, 4, 1, 4, 1, 4, 1, 4, 1, 4,
+                                                   1, 4, 1, 4, 1, 4);
+  const simde__m256i w6_4 = simde_mm256_setr_epi16(6, 4, 6, 4, 6, 4, 6, 4, 6, 4,
+                                                   6, 4, 6, 4, 6, 4);
+  int x = start;
+  for (; x < end && x < 1; ++x) {
+    temp_out[x - start] = src[reflect_index(-2, src_width)] +
+                  src[reflect_index(-1, src_width)] * 4 + src[0] * 6 +
+                  src[reflect_index(1, src_width)] * 4 +
+                  src[reflect_index(2, src_width)];
+  }
+
+  // same pairing as char_convolve_1, outputs x..x+7 read up to 2x + 17
+  for (; x + 8 <= end && 2 * x + 18 <= src_width; x += 8) {
+    const short *s = src + 2 * x - 2;
+    simde__m256i m1 = simde_mm256_madd_epi16(
+        simde_mm256_loadu_si256((const simde__m256i *)s), w1_4);
+    simde__m256i m2 = simde_mm256_madd_epi16(
+        simde_mm256_loadu_si256((const simde__m256i *)(s + 2)), w6_4);
+    simde__m256i a4 = simde_mm256_loadu_si256((const simde__m256i *)(s + 4));
+    simde__m256i fifth =
+        simde_mm256_srai_epi32(simde_mm256_slli_epi32(a4, 16), 16);
+
+    simde_mm256_storeu_si256(
+        (simde__m256i *)(temp_out + x - start),
+        simde_mm256_add_epi32(simde_mm256_add_epi32(m1, m2), fifth));
+  }
+
+  for (; x < end; ++x) {
+    int xx = x * 2;
+    temp_out[x - start] = src[reflect_index(xx - 2, src_width)] +
+                  src[reflect_index(xx - 1, src_width)] * 4 + src[xx] * 6 +
+                  src[reflect_index(xx + 1, src_width)] * 4 +
+                  src[reflect_index(xx + 2, src_width)];
+  }
+}
+
+static void convolve_1d_v_s(int n, const int *row0, const int *row1,
+                             const int *row2, const int *row3, const int *row4,
+                             short *out_row) {
+  int i = 0;
+  for (; i <= n - 8; i += 8) {
+    simde__m256i r0 = simde_mm256_loadu_si256((const simde__m256i *)(row0 + i));
+    simde__m256i r1 = simde_mm256_loadu_si256((const simde__m256i *)(row1 + i));
+    simde__m256i r2 = simde_mm256_loadu_si256((const simde__m256i *)(row2 + i));
+    simde__m256i r3 = simde_mm256_loadu_si256((const simde__m256i *)(row3 + i));
+    simde__m256i r4 = simde_mm256_loadu_si256((const simde__m256i *)(row4 + i));
+
+    simde__m256i sum = simde_mm256_add_epi32(r0, r4);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(r2, 1));
+    simde__m256i t = simde_mm256_add_epi32(simde_mm256_add_epi32(r1, r3), r2);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_slli_epi32(t, 2));
+
+    // divide by 256 rounding toward zero, like the float path's conversion
+    simde__m256i bias = simde_mm256_and_si256(simde_mm256_srai_epi32(sum, 31),
+                                              simde_mm256_set1_epi32(255));
+    sum = simde_mm256_srai_epi32(simde_mm256_add_epi32(sum, bias), 8);
+
+    simde_mm_storeu_si128(
+        (simde__m128i *)(out_row + i),
+        simde_mm_packs_epi32(simde_mm256_castsi256_si128(sum),
+                             simde_mm256_extracti128_si256(sum, 1)));
+  }
+
+  for (; i < n; ++i) {
+    out_row[i] =
+        (short)((row0[i] + row1[i] * 4 + row2[i] * 6 + row3[i] * 4 + row4[i]) /
+                256);
+  }
+}
+
+/*
+ * Separable integer form of GAUSSIAN_KERNEL for interleaved short images, so
+ * an RGBA image gets its colour and alpha pyramids out of a single pass.
+ * Every product in the float loop is exact and the sum is truncated, which
+ * the integer sum divided by 256 reproduces bit for bit.
+ */
+static void short_convolve(int range_start, int range_end, int start_col,
+                           int end_col, int src_width, int src_height,
+                           int channels, const short *src, short *dst,
+                           void (*convolve_row)(const short *src,
+                                                int src_width, int start,
+                                                int end, int *temp_out)) {
+  size_t row_size = (size_t)(src_width / 2) * channels;
+  int tile_size = (end_col - start_col) * channels;
+
+  int *temp_dst_out = (int *)stitch_malloc(5 * tile_size * sizeof(int));
+  if (!temp_dst_out)
+    return;
+
+  // filtered source rows, slot r % 5 holds row r; five consecutive rows
+  // never share a slot, reflected ones land on rows already in the window
+  int cached_rows[5] = {-1, -1, -1, -1, -1};
+  int *rows[5];
+
+  for (int y = range_start; y < range_end; y++) {
+    for (int i = 0; i < 5; i++) {
+      int r = reflect_index(y * 2 + i - 2, src_height);
+      int *temp_out = temp_dst_out + (r % 5) * tile_size;
+      if (cached_rows[r % 5] != r) {
+        convolve_row(src + (size_t)r * src_width * channels, src_width,
+                     start_col, end_col, temp_out);
+        cached_rows[r % 5] = r;
+      }
+      rows[i] = temp_out;
+    }
+
+    convolve_1d_v_s(tile_size, rows[0], rows[1], rows[2], rows[3], rows[4],
+                    dst + y * row_size + start_col * channels);
+  }
+
+  stitch_free(temp_dst_out);
+}
+
+static void downsample_rows_s(SamplingThreadData *data, int start_row,
+                              int end_row) {
+  ImageS *img = (ImageS *)data->img;
+  short *sampled = (short *)data->sampled;
+  // reflect_index needs a few pixels on every side
+  if (img->width >= 5 && img->height >= 5) {
+    switch (img->channels) {
+    case GRAY_CHANNELS:
+      short_convolve(start_row, end_row, data->start_col,
+                     sampling_end_col(data), img->width, img->height,
+                     GRAY_CHANNELS, img->data, sampled, convolve_1d_1c_s);
+      return;
+    case RGBA_CHANNELS:
+      short_convolve(start_row, end_row, data->start_col,
+                     sampling_end_col(data), img->width, img->height,
+                     RGBA_CHANNELS, img->data, sampled, convolve_1d_4c);
+      return;
+    default:
+      break;
+    }
+  }
+  downsample_rows_generic_s(data, start_row, end_row);
+}
+
+#define DEFINE_UPSAMPLE_KERNEL(NAME, IMAGE_T, PIXEL_T)                         \
+  static void NAME(SamplingThreadData *s, int start_row, int end_row) {        \
+    IMAGE_T *img = (IMAGE_T *)s->img;                                          \
+    PIXEL_T *sampled = (PIXEL_T *)s->sampled;                                  \
+    int pad = 2;                                                               \
+    for (int y = start_row; y < end_row; ++y) {                                \
+      for (int x = s->start_col; x < sampling_end_col(s); ++x) {               \
+        for (char c = 0; c < img->channels; ++c) {                             \
+          float sum = 0;                                                       \
+          for (int ki = 0; ki < 5; ki++) {                                     \
+            for (int kj = 0; kj < 5; kj++) {                                   \
+              int src_i = reflect_index(y + ki - pad, s->new_height);          \
+              int src_j = reflect_index(x + kj - pad, s->new_width);           \
+              int pixel_val = 0;                                               \
+              if (src_i % 2 == 0 && src_j % 2 == 0) {                          \
+                int orig_i = src_i / 2;                                        \
+                int orig_j = src_j / 2;                                        \
+                size_t image_pos =                                             \
+                    ((size_t)orig_i * img->width + orig_j) * img->channels +   \
+                    c;                                                         \
+                pixel_val = img->data[image_pos] * s->upsample_factor;         \
+              }                                                                \
+              sum += GAUSSIAN_KERNEL[ki][kj] * pixel_val;                      \
+            }                                                                  \
+          }                                                                    \
+          size_t up_image_pos =                                                \
+              ((size_t)(y - s->first_row) * s->new_width + x) *                \
+                  img->channels +                                              \
+              c;                                                               \
+          if (s->image_type == IMAGE) {                                        \
+            sum = (PIXEL_T)clamp(floor(sum + 0.5), 0, 255);                    \
+          }                                                                    \
+          sampled[up_image_pos] = sum;                                         \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+DEFINE_UPSAMPLE_KERNEL(upsample_rows, Image, unsigned char)
+DEFINE_UPSAMPLE_KERNEL(upsample_rows_s, ImageS, short)
+DEFINE_UPSAMPLE_KERNEL(upsample_rows_f, ImageF, float)
+
+
+// min() of utils.h is for ints, pixel offsets of a level can exceed them
+static inline ptrdiff_t min_index(ptrdiff_t a, ptrdiff_t b) {
+  return a < b ? a : b;
+}
+
+// each pointer advances by its own channel count, the weight is the last lane
+static inline void feed_row(const short *src, int src_channels,
+                            const short *weights, int weight_channels,
+                            float *dst, int dst_channels, float *dst_mask,
+                            int cols) {
+  for (int i = 0; i < cols; ++i) {
+    float maskVal = weights[i * weight_channels] * (1.0 / 255.0);
+    dst_mask[i] += maskVal;
+    for (int z = 0; z < dst_channels; ++z) {
+      dst[i * dst_channels + z] += src[i * src_channels + z] * maskVal;
+    }
+  }
+}
+
+static void feed_rows(FeedThreadData *f, int start_row, int end_row) {
+  const ImageS *lap = &f->img_laplacians[f->level];
+  const ImageS *mask = &f->mask_gaussian[f->level];
+  float *out = f->out[f->level].data;
+  float *out_mask = f->out_mask[f->level].data;
+  int channels = f->out[f->level].channels;
+
+  // pixels past the end of the level or the canvas are skipped, per row
+  ptrdiff_t src_pixels = min_index((ptrdiff_t)lap->width * lap->height,
+                                   (ptrdiff_t)mask->width * mask->height);
+  ptrdiff_t out_pixels = (ptrdiff_t)f->out_level_height * f->out_level_width;
+  int start_col = f->start_col;
+  int end_col = f->end_col ? f->end_col : f->cols;
+
+  for (int k = start_row; k < end_row; ++k) {
+    ptrdiff_t src_index = (ptrdiff_t)k * f->level_width + start_col;
+    ptrdiff_t out_index =
+        f->x_tl + start_col + (ptrdiff_t)(k + f->y_tl) * f->out_level_width;
+    int cols = (int)min_index(
+        end_col - start_col,
+        min_index(src_pixels - src_index, out_pixels - out_index));
+
+    const short *src = lap->data + src_index * lap->channels;
+    const short *weights =
+        mask->data + src_index * mask->channels + mask->channels - 1;
+    float *dst = out + out_index * channels;
+    float *dst_mask = out_mask + out_index;
+
+    // constant strides let the compiler specialise the common layouts
+    if (lap->channels == RGB_CHANNELS && mask->channels == 1) {
+      feed_row(src, RGB_CHANNELS, weights, 1, dst, RGB_CHANNELS, dst_mask,
+               cols);
+    } else if (lap->channels == RGBA_CHANNELS &&
+               mask->channels == RGBA_CHANNELS) {
+      feed_row(src, RGBA_CHANNELS, weights, RGBA_CHANNELS, dst, RGB_CHANNELS,
+               dst_mask, cols);
+    } else if (lap->channels == GRAY_CHANNELS && mask->channels == 1) {
+      feed_row(src, GRAY_CHANNELS, weights, 1, dst, GRAY_CHANNELS, dst_mask,
+               cols);
+    } else {
+      feed_row(src, lap->channels, weights, mask->channels, dst, channels,
+               dst_mask, cols);
+    }
+  }
+}
+
+static inline void normalize_row(const float *out, const float *out_mask,
+                                 short *final_out, int channels, int cols) {
+  for (int x = 0; x < cols; ++x) {
+    float w = out_mask[x] + WEIGHT_EPS;
+    for (int z = 0; z < channels; z++) {
+      final_out[x * channels + z] = (short)(out[x * channels + z] / w);
+    }
+  }
+}
+
+static void normalize_rows(NormalThreadData *n, int start_row, int end_row) {
+  const float *out = n->out[n->level].data;
+  const float *out_mask = n->out_mask[n->level].data;
+  short *final_out = n->final_out[n->level].data;
+  int channels = n->final_out[n->level].channels;
+
+  ptrdiff_t pixels =
+      min_index(image_size_f(&n->out_mask[n->level]),
+                image_size_s(&n->final_out[n->level]) / channels);
+  int end_col = n->end_col ? n->end_col : n->output_width;
+
+  for (int y = start_row; y < end_row; ++y) {
+    ptrdiff_t index = (ptrdiff_t)y * n->output_width + n->start_col;
+    int cols = (int)min_index(end_col - n->start_col, pixels - index);
+
+    if (channels == RGB_CHANNELS) {
+      normalize_row(out + index * RGB_CHANNELS, out_mask + index,
+                    final_out + index * RGB_CHANNELS, RGB_CHANNELS, cols);
+    } else {
+      normalize_row(out + index * channels, out_mask + index,
+                    final_out + index * channels, channels, cols);
+    }
+  }
+}
+
+static inline unsigned char saturate_u8(int v) {
+  return (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// the scalar form of render_row, dst_channels is channels + 1 with alpha
+static inline void render_pixels(const short *src, const short *add,
+                                 const float *weights, unsigned char *dst,
+                                 int channels, int dst_channels, int x,
+                                 int cols) {
+  for (; x < cols; ++x) {
+    int covered = weights[x] > WEIGHT_EPS;
+    for (int c = 0; c < channels; c++) {
+      short v = src[x * channels + c];
+      if (add) {
+        v = (short)(v + add[x * channels + c]);
+      }
+      dst[x * dst_channels + c] = covered ? saturate_u8(v) : 0;
+    }
+    if (dst_channels > channels) {
+      dst[x * dst_channels + channels] =
+          saturate_u8((int)(weights[x] * 255.0f + 0.5f));
+    }
+  }
+}
+
+static inline simde__m128i load_sum_s(const short *src, const short *add) {
+  simde__m128i v = simde_mm_loadu_si128((const simde__m128i *)src);
+  return add ? simde_mm_add_epi16(
+                   v, simde_mm_loadu_si128((const simde__m128i *)add))
+             : v;
+}
+
+// 8 lanes of all ones or zeros as 8 shorts
+static inline simde__m128i pack_mask(simde__m256i m) {
+  return simde_mm_packs_epi32(simde_mm256_castsi256_si128(m),
+                              simde_mm256_extracti128_si256(m, 1));
+}
+
+static void render_row(const short *src, const short *add,
+                       const float *weights, unsigned char *dst, int channels,
+                       int alpha, int cols) {
+  const simde__m256 eps = simde_mm256_set1_ps(WEIGHT_EPS);
+  const simde__m256i spread0 = simde_mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  const simde__m256i spread1 = simde_mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  const simde__m256i spread2 = simde_mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+  int x = 0;
+  if (alpha) {
+    // the coverage lane breaks the 3 or 1 byte pattern, leave it scalar
+    if (channels == RGB_CHANNELS) {
+      render_pixels(src, add, weights, dst, RGB_CHANNELS, RGBA_CHANNELS, x,
+                    cols);
+    } else {
+      render_pixels(src, add, weights, dst, channels, channels + 1, x, cols);
+    }
+    return;
+  }
+
+  if (channels == RGB_CHANNELS) {
+    for (; x <= cols - 8; x += 8) {
+      simde__m256i covered = simde_mm256_castps_si256(simde_mm256_cmp_ps(
+          simde_mm256_loadu_ps(weights + x), eps, SIMDE_CMP_GT_OQ));
+      const short *s = src + x * RGB_CHANNELS;
+      const short *a = add ? add + x * RGB_CHANNELS : NULL;
+
+      simde__m128i v0 = simde_mm_and_si128(
+          load_sum_s(s, a),
+          pack_mask(simde_mm256_permutevar8x32_epi32(covered, spread0)));
+      simde__m128i v1 = simde_mm_and_si128(
+          load_sum_s(s + 8, a ? a + 8 : NULL),
+          pack_mask(simde_mm256_permutevar8x32_epi32(covered, spread1)));
+      simde__m128i v2 = simde_mm_and_si128(
+          load_sum_s(s + 16, a ? a + 16 : NULL),
+          pack_mask(simde_mm256_permutevar8x32_epi32(covered, spread2)));
+
+      unsigned char *d = dst + x * RGB_CHANNELS;
+      simde_mm_storeu_si128((simde__m128i *)d, simde_mm_packus_epi16(v0, v1));
+      simde_mm_storel_epi64((simde__m128i *)(d + 16),
+                            simde_mm_packus_epi16(v2, v2));
+    }
+    render_pixels(src, add, weights, dst, RGB_CHANNELS, RGB_CHANNELS, x, cols);
+  } else if (channels == GRAY_CHANNELS) {
+    for (; x <= cols - 8; x += 8) {
+      simde__m256i covered = simde_mm256_castps_si256(simde_mm256_cmp_ps(
+          simde_mm256_loadu_ps(weights + x), eps, SIMDE_CMP_GT_OQ));
+      simde__m128i v = simde_mm_and_si128(
+          load_sum_s(src + x, add ? add + x : NULL), pack_mask(covered));
+      simde_mm_storel_epi64((simde__m128i *)(dst + x),
+                            simde_mm_packus_epi16(v, v));
+    }
+    render_pixels(src, add, weights, dst, GRAY_CHANNELS, GRAY_CHANNELS, x,
+                  cols);
+  } else {
+    render_pixels(src, add, weights, dst, channels, channels, x, cols);
+  }
+}
+
+static void feather_accumulate(const unsigned char *src,
+                               const unsigned char *mask, float *dst,
+                               float *dst_mask, int cols) {
+  const float scale = 1.0f / 255.0f;
+  const simde__m256 scale_v = simde_mm256_set1_ps(scale);
+
+  // spread 8 pixel weights over the 24 interleaved RGB lanes
+  const simde__m256i spread0 = simde_mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  const simde__m256i spread1 = simde_mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  const simde__m256i spread2 = simde_mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+  int x = 0;
+  for (; x <= cols - 8; x += 8) {
+    simde__m256 w = simde_mm256_mul_ps(
+        simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+            simde_mm_loadl_epi64((const simde__m128i *)(mask + x)))),
+        scale_v);
+    simde_mm256_storeu_ps(dst_mask + x,
+                          simde_mm256_add_ps(simde_mm256_loadu_ps(dst_mask + x), w));
+
+    const unsigned char *s = src + x * RGB_CHANNELS;
+    float *d = dst + x * RGB_CHANNELS;
+
+    simde__m256 p0 = simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+        simde_mm_loadl_epi64((const simde__m128i *)s)));
+    simde__m256 p1 = simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+        simde_mm_loadl_epi64((const simde__m128i *)(s + 8))));
+    simde__m256 p2 = simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+        simde_mm_loadl_epi64((const simde__m128i *)(s + 16))));
+
+    p0 = simde_mm256_mul_ps(p0, simde_mm256_permutevar8x32_ps(w, spread0));
+    p1 = simde_mm256_mul_ps(p1, simde_mm256_permutevar8x32_ps(w, spread1));
+    p2 = simde_mm256_mul_ps(p2, simde_mm256_permutevar8x32_ps(w, spread2));
+
+    simde_mm256_storeu_ps(d, simde_mm256_add_ps(simde_mm256_loadu_ps(d), p0));
+    simde_mm256_storeu_ps(d + 8,
+                          simde_mm256_add_ps(simde_mm256_loadu_ps(d + 8), p1));
+    simde_mm256_storeu_ps(d + 16,
+                          simde_mm256_add_ps(simde_mm256_loadu_ps(d + 16), p2));
+  }
+
+  for (; x < cols; ++x) {
+    float weight = mask[x] * scale;
+    dst_mask[x] += weight;
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+      dst[x * RGB_CHANNELS + c] += src[x * RGB_CHANNELS + c] * weight;
+    }
+  }
+}
+
+static void feather_normalize(const float *src, const float *weights,
+                              unsigned char *dst, int cols) {
+  const simde__m256 eps = simde_mm256_set1_ps(WEIGHT_EPS);
+  const simde__m256i spread0 = simde_mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  const simde__m256i spread1 = simde_mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  const simde__m256i spread2 = simde_mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+
+  int x = 0;
+  for (; x <= cols - 8; x += 8) {
+    simde__m256 w =
+        simde_mm256_add_ps(simde_mm256_loadu_ps(weights + x), eps);
+    const float *s = src + x * RGB_CHANNELS;
+
+    simde__m256i v0 = simde_mm256_cvttps_epi32(simde_mm256_div_ps(
+        simde_mm256_loadu_ps(s), simde_mm256_permutevar8x32_ps(w, spread0)));
+    simde__m256i v1 = simde_mm256_cvttps_epi32(
+        simde_mm256_div_ps(simde_mm256_loadu_ps(s + 8),
+                           simde_mm256_permutevar8x32_ps(w, spread1)));
+    simde__m256i v2 = simde_mm256_cvttps_epi32(
+        simde_mm256_div_ps(simde_mm256_loadu_ps(s + 16),
+                           simde_mm256_permutevar8x32_ps(w, spread2)));
+
+    simde__m128i s0 = simde_mm_packs_epi32(simde_mm256_castsi256_si128(v0),
+                                           simde_mm256_extracti128_si256(v0, 1));
+    simde__m128i s1 = simde_mm_packs_epi32(simde_mm256_castsi256_si128(v1),
+                                           simde_mm256_extracti128_si256(v1, 1));
+    simde__m128i s2 = simde_mm_packs_epi32(simde_mm256_castsi256_si128(v2),
+                                           simde_mm256_extracti128_si256(v2, 1));
+
+    unsigned char *d = dst + x * RGB_CHANNELS;
+    simde_mm_storeu_si128((simde__m128i *)d, simde_mm_packus_epi16(s0, s1));
+    simde_mm_storel_epi64((simde__m128i *)(d + 16),
+                          simde_mm_packus_epi16(s2, s2));
+  }
+
+  for (; x < cols; ++x) {
+    float w = weights[x] + WEIGHT_EPS;
+    for (int c = 0; c < RGB_CHANNELS; c++) {
+      dst[x * RGB_CHANNELS + c] =
+          clamp((int)(src[x * RGB_CHANNELS + c] / w), 0, 255);
+    }
+  }
+}
+
+static void feather_accumulate_gray(const unsigned char *src,
+                                    const unsigned char *mask, float *dst,
+                                    float *dst_mask, int cols) {
+  const float scale = 1.0f / 255.0f;
+  const simde__m256 scale_v = simde_mm256_set1_ps(scale);
+
+  int x = 0;
+  for (; x <= cols - 8; x += 8) {
+    simde__m256 w = simde_mm256_mul_ps(
+        simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+            simde_mm_loadl_epi64((const simde__m128i *)(mask + x)))),
+        scale_v);
+    simde__m256 p = simde_mm256_cvtepi32_ps(simde_mm256_cvtepu8_epi32(
+        simde_mm_loadl_epi64((const simde__m128i *)(src + x))));
+    simde_mm256_storeu_ps(dst_mask + x,
+                          simde_mm256_add_ps(simde_mm256_loadu_ps(dst_mask + x), w));
+    simde_mm256_storeu_ps(dst + x,
+                          simde_mm256_add_ps(simde_mm256_loadu_ps(dst + x),
+                                             simde_mm256_mul_ps(p, w)));
+  }
+
+  for (; x < cols; ++x) {
+    float weight = mask[x] * scale;
+    dst_mask[x] += weight;
+    dst[x] += src[x] * weight;
+  }
+}
+
+static void feather_normalize_gray(const float *src, const float *weights,
+                                   unsigned char *dst, int cols) {
+  const simde__m256 eps = simde_mm256_set1_ps(WEIGHT_EPS);
+
+  int x = 0;
+  for (; x <= cols - 8; x += 8) {
+    simde__m256 w =
+        simde_mm256_add_ps(simde_mm256_loadu_ps(weights + x), eps);
+    simde__m256i v = simde_mm256_cvttps_epi32(
+        simde_mm256_div_ps(simde_mm256_loadu_ps(src + x), w));
+    simde__m128i s16 = simde_mm_packs_epi32(simde_mm256_castsi256_si128(v),
+                                            simde_mm256_extracti128_si256(v, 1));
+    simde_mm_storel_epi64((simde__m128i *)(dst + x),
+                          simde_mm_packus_epi16(s16, s16));
+  }
+
+  for (; x < cols; ++x) {
+    float w = weights[x] + WEIGHT_EPS;
+    dst[x] = clamp((int)(src[x] / w), 0, 255);
+  }
+}
+
+static inline float fusion_power(float x, float exponent) {
+  return exponent == 1.f ? x : exponent == 0.f ? 1.f : powf(x, exponent);
+}
+
+/*
+ * contrast^a * saturation^b * well-exposedness^c of pixel x, whose left and
+ * right neighbours are l and r. Contrast is the absolute 4-neighbour
+ * laplacian of the gray image and saturation the standard deviation of the
+ * colours, both in [0, 1]. The float steps are the same in every variant,
+ * so are the weights.
+ */
+static inline short fusion_weight(const FusionWeights *w,
+                                  const unsigned char *above,
+                                  const unsigned char *row,
+                                  const unsigned char *below, int channels,
+                                  int x, int l, int r) {
+  int centre = 0, around = 0;
+  float exposedness = 1.f;
+  for (int c = 0; c < channels; ++c) {
+    int v = row[x * channels + c];
+    centre += v;
+    around += above[x * channels + c] + below[x * channels + c] +
+              row[l * channels + c] + row[r * channels + c];
+    exposedness *= w->exposedness[v];
+  }
+  float contrast = abs(4 * centre - around) * (1.f / (4.f * 255.f)) /
+                   (float)channels;
+
+  float saturation = 1.f;
+  if (channels == RGB_CHANNELS) {
+    float mean = centre * (1.f / (3.f * 255.f));
+    float sum = 0.f;
+    for (int c = 0; c < RGB_CHANNELS; ++c) {
+      float d = row[x * RGB_CHANNELS + c] * (1.f / 255.f) - mean;
+      sum += d * d;
+    }
+    saturation = sqrtf(sum / 3.f);
+  }
+
+  float weight = fusion_power(contrast, w->contrast) *
+                 fusion_power(saturation, w->saturation) * exposedness;
+  // every covered pixel keeps a little weight, like Mertens' epsilon
+  return (short)(1 + (int)(fminf(weight, 1.f) * 32766.f));
+}
+
+static void fusion_weights_row(const FusionWeights *w,
+                               const unsigned char *above,
+                               const unsigned char *row,
+                               const unsigned char *below, int channels,
+                               int cols, int start, int end, short *weights) {
+  // constant channel counts let the compiler vectorise the row; the edge
+  // pixels are their own outer neighbours, like a reflected border
+  for (int x = start; x < end; ++x) {
+    int l = x > 0 ? x - 1 : 0;
+    int r = x < cols - 1 ? x + 1 : cols - 1;
+    if (channels == RGB_CHANNELS) {
+      weights[x] = fusion_weight(w, above, row, below, RGB_CHANNELS, x, l, r);
+    } else {
+      weights[x] = fusion_weight(w, above, row, below, GRAY_CHANNELS, x, l, r);
+    }
+  }
+}
+
+const KernelTable KERNEL_CONCAT(kernel_table, KERNEL_VARIANT) = {
+    KERNEL_STRING(KERNEL_VARIANT),
+    downsample_rows,
+    downsample_rows_s,
+    downsample_rows_f,
+    upsample_rows,
+    upsample_rows_s,
+    upsample_rows_f,
+    feed_rows,
+    normalize_rows,
+    feather_accumulate,
+    feather_normalize,
+    feather_accumulate_gray,
+    feather_normalize_gray,
+    fusion_weights_row,
+    render_row};
@@ -0,0 +1,68 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef KERNELS_HEADERS
+#define KERNELS_HEADERS
+
+#include "image_operations.h"
+
+/*
+ * The hot loops are compiled once per instruction set (see kernels.c and
+ * CMakeLists.txt) and reached through this table. get_kernels() picks the
+ * best variant the CPU supports the first time it is called.
+ */
+typedef struct
+{
+    const char *name;
+    void (*downsample)(SamplingThreadData *s, int start_row, int end_row);
+    void (*downsample_s)(SamplingThreadData *s, int start_row, int end_row);
+    void (*downsample_f)(SamplingThreadData *s, int start_row, int end_row);
+    void (*upsample)(SamplingThreadData *s, int start_row, int end_row);
+    void (*upsample_s)(SamplingThreadData *s, int start_row, int end_row);
+    void (*upsample_f)(SamplingThreadData *s, int start_row, int end_row);
+    void (*feed_rows)(FeedThreadData *f, int start_row, int end_row);
+    void (*normalize_rows)(NormalThreadData *n, int start_row, int end_row);
+    void (*feather_accumulate_row)(const unsigned char *src,
+                                   const unsigned char *mask, float *dst,
+                                   float *dst_mask, int cols);
+    void (*feather_normalize_row)(const float *src, const float *weights,
+                                  unsigned char *dst, int cols);
+    void (*feather_accumulate_gray_row)(const unsigned char *src,
+                                        const unsigned char *mask, float *dst,
+                                        float *dst_mask, int cols);
+    void (*feather_normalize_gray_row)(const float *src, const float *weights,
+                                       unsigned char *dst, int cols);
+    // Mertens weights of pixels [start, end) of a row of cols pixels as 15
+    // bit values, at least 1
+    void (*fusion_weights_row)(const FusionWeights *w,
+                               const unsigned char *above,
+                               const unsigned char *row,
+                               const unsigned char *below, int channels,
+                               int cols, int start, int end, short *weights);
+    /*
+     * A level row as 8 bit: src + add (add may be NULL) wrapped to short and
+     * saturated, pixels of weight <= WEIGHT_EPS cleared. With alpha set dst
+     * has channels + 1 lanes, the last one the weight as coverage.
+     */
+    void (*render_row)(const short *src, const short *add,
+                       const float *weights, unsigned char *dst, int channels,
+                       int alpha, int cols);
+} KernelTable;
+
+const KernelTable *get_kernels(void);
+
+/*
+ * Forces a variant by name ("baseline", "avx2", "avx512"), or the best
+ * supported one for NULL. Returns 0 when the variant was not built or the
+ * CPU lacks it. The NATIVE_STITCHER_KERNELS environment variable does the
+ * same at startup.
+ */
+int set_kernel_variant(const char *name);
+const char *kernel_variant_name(void);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
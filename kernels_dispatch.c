@@ -0,0 +1,74 @@
+#include "kernels.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern const KernelTable kernel_table_baseline;
+#ifdef NATIVE_STITCHER_KERNELS_AVX2
+extern const KernelTable kernel_table_avx2;
+#endif
+#ifdef NATIVE_STITCHER_KERNELS_AVX512
+extern const KernelTable kernel_table_avx512;
+#endif
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+static const KernelTable *active_kernels = &kernel_table_baseline;
+
+static int cpu_supports(const KernelTable *table) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#ifdef NATIVE_STITCHER_KERNELS_AVX512
+  if (table == &kernel_table_avx512)
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#ifdef NATIVE_STITCHER_KERNELS_AVX2
+  if (table == &kernel_table_avx2)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+#endif
+  return table == &kernel_table_baseline;
+}
+
+// best first
+static const KernelTable *const KERNEL_TABLES[] = {
+#ifdef NATIVE_STITCHER_KERNELS_AVX512
+    &kernel_table_avx512,
+#endif
+#ifdef NATIVE_STITCHER_KERNELS_AVX2
+    &kernel_table_avx2,
+#endif
+    &kernel_table_baseline};
+
+static const KernelTable *find_kernels(const char *name) {
+  for (size_t i = 0; i < sizeof(KERNEL_TABLES) / sizeof(KERNEL_TABLES[0]);
+       i++) {
+    if ((!name || !strcmp(KERNEL_TABLES[i]->name, name)) &&
+        cpu_supports(KERNEL_TABLES[i]))
+      return KERNEL_TABLES[i];
+  }
+  return NULL;
+}
+
+static void select_kernels(void) {
+  const char *forced = getenv("NATIVE_STITCHER_KERNELS");
+  const KernelTable *table = forced ? find_kernels(forced) : NULL;
+  active_kernels = table ? table : find_kernels(NULL);
+}
+
+const KernelTable *get_kernels(void) {
+  pthread_once(&kernels_once, select_kernels);
+  return active_kernels;
+}
+
+int set_kernel_variant(const char *name) {
+  pthread_once(&kernels_once, select_kernels);
+  const KernelTable *table = find_kernels(name);
+  if (!table)
+    return 0;
+  active_kernels = table;
+  return 1;
+}
+
+const char *kernel_variant_name(void) { return get_kernels()->name; }
@@ -0,0 +1,300 @@
+#include "seam_finder.h"
+#include "allocator.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SEAM_OUTSIDE_COST (1 << 20)
+
+typedef struct {
+  int x;
+  int y;
+  int width;
+  int height;
+  int cols;
+  int rows;
+  int shift;
+} SeamGrid;
+
+static int rect_covers(const StitchRect *r, int px, int py) {
+  return px >= r->x && px < r->x + r->width && py >= r->y &&
+         py < r->y + r->height;
+}
+
+static int border_distance(const StitchRect *r, int px, int py) {
+  return min(min(px - r->x, r->x + r->width - 1 - px),
+             min(py - r->y, r->y + r->height - 1 - py));
+}
+
+static void cell_center(const SeamGrid *g, int cx, int cy, int *px, int *py) {
+  int half = (1 << g->shift) >> 1;
+  *px = min(g->x + (cx << g->shift) + half, g->x + g->width - 1);
+  *py = min(g->y + (cy << g->shift) + half, g->y + g->height - 1);
+}
+
+static int voronoi_owner(const StitchRect *rects, int count, int px, int py) {
+  int best = -1, best_dist = -1;
+  for (int i = 0; i < count; i++) {
+    if (!rect_covers(&rects[i], px, py))
+      continue;
+    int d = border_distance(&rects[i], px, py);
+    if (d > best_dist) {
+      best_dist = d;
+      best = i;
+    }
+  }
+  return best;
+}
+
+static void voronoi_labels(const SeamGrid *g, const StitchRect *rects,
+                           int count, int *labels) {
+  for (int cy = 0; cy < g->rows; cy++) {
+    for (int cx = 0; cx < g->cols; cx++) {
+      int px, py;
+      cell_center(g, cx, cy, &px, &py);
+      labels[cy * g->cols + cx] = voronoi_owner(rects, count, px, py);
+    }
+  }
+}
+
+static const unsigned char *coarse_pixel(const Image *coarse,
+                                         const StitchRect *r, int shift,
+                                         int px, int py) {
+  int x = clamp((px - r->x) >> shift, 0, coarse->width - 1);
+  int y = clamp((py - r->y) >> shift, 0, coarse->height - 1);
+  return coarse->data + (y * coarse->width + x) * RGB_CHANNELS;
+}
+
+static int refine_pair(const SeamGrid *g, const StitchRect *rects,
+                       const Image *coarse, int a, int b, int *labels) {
+  int ox0 = g->cols, oy0 = g->rows, ox1 = -1, oy1 = -1;
+
+  for (int cy = 0; cy < g->rows; cy++) {
+    for (int cx = 0; cx < g->cols; cx++) {
+      int px, py;
+      cell_center(g, cx, cy, &px, &py);
+      if (rect_covers(&rects[a], px, py) && rect_covers(&rects[b], px, py)) {
+        ox0 = min(ox0, cx), ox1 = max(ox1, cx);
+        oy0 = min(oy0, cy), oy1 = max(oy1, cy);
+      }
+    }
+  }
+
+  if (ox1 < 0)
+    return 1;
+
+  // a tall overlap gets a top-to-bottom seam, a wide one a left-to-right seam
+  int vertical = (ox1 - ox0) <= (oy1 - oy0);
+  int len_u = vertical ? ox1 - ox0 + 1 : oy1 - oy0 + 1;
+  int len_v = vertical ? oy1 - oy0 + 1 : ox1 - ox0 + 1;
+
+  long long *energy =
+      (long long *)stitch_malloc((size_t)len_u * len_v * sizeof(long long));
+  int *seam = (int *)stitch_malloc(len_v * sizeof(int));
+  if (!energy || !seam) {
+    stitch_free(energy);
+    stitch_free(seam);
+    return 0;
+  }
+
+  for (int v = 0; v < len_v; v++) {
+    for (int u = 0; u < len_u; u++) {
+      int cx = vertical ? ox0 + u : ox0 + v;
+      int cy = vertical ? oy0 + v : oy0 + u;
+      int px, py;
+      cell_center(g, cx, cy, &px, &py);
+
+      long long cost = SEAM_OUTSIDE_COST;
+      if (rect_covers(&rects[a], px, py) && rect_covers(&rects[b], px, py)) {
+        const unsigned char *pa =
+            coarse_pixel(&coarse[a], &rects[a], g->shift, px, py);
+        const unsigned char *pb =
+            coarse_pixel(&coarse[b], &rects[b], g->shift, px, py);
+        cost = 0;
+        for (int c = 0; c < RGB_CHANNELS; c++) {
+          cost += abs(pa[c] - pb[c]);
+        }
+      }
+
+      if (v > 0) {
+        long long *prev = energy + (size_t)(v - 1) * len_u;
+        long long best = prev[u];
+        if (u > 0 && prev[u - 1] < best)
+          best = prev[u - 1];
+        if (u < len_u - 1 && prev[u + 1] < best)
+          best = prev[u + 1];
+        cost += best;
+      }
+      energy[(size_t)v * len_u + u] = cost;
+    }
+  }
+
+  long long *last = energy + (size_t)(len_v - 1) * len_u;
+  int u_best = 0;
+  for (int u = 1; u < len_u; u++) {
+    if (last[u] < last[u_best])
+      u_best = u;
+  }
+  seam[len_v - 1] = u_best;
+
+  for (int v = len_v - 2; v >= 0; v--) {
+    long long *row = energy + (size_t)v * len_u;
+    int u = seam[v + 1];
+    int next = u;
+    if (u > 0 && row[u - 1] < row[next])
+      next = u - 1;
+    if (u < len_u - 1 && row[u + 1] < row[next])
+      next = u + 1;
+    seam[v] = next;
+  }
+
+  // the input whose footprint starts first keeps the cells before the seam
+  int first = a, second = b;
+  if (vertical ? (2 * rects[b].x + rects[b].width) <
+                     (2 * rects[a].x + rects[a].width)
+               : (2 * rects[b].y + rects[b].height) <
+                     (2 * rects[a].y + rects[a].height)) {
+    first = b, second = a;
+  }
+
+  for (int v = 0; v < len_v; v++) {
+    for (int u = 0; u < len_u; u++) {
+      int cx = vertical ? ox0 + u : ox0 + v;
+      int cy = vertical ? oy0 + v : oy0 + u;
+      int *label = &labels[cy * g->cols + cx];
+      int px, py;
+      cell_center(g, cx, cy, &px, &py);
+
+      if ((*label == a || *label == b) && rect_covers(&rects[a], px, py) &&
+          rect_covers(&rects[b], px, py)) {
+        *label = u < seam[v] ? first : second;
+      }
+    }
+  }
+
+  stitch_free(energy);
+  stitch_free(seam);
+  return 1;
+}
+
+static void fill_mask(const SeamGrid *g, const StitchRect *rects, int count,
+                      const int *labels, int index, Image *mask) {
+  const StitchRect *r = &rects[index];
+
+  for (int y = 0; y < r->height; y++) {
+    int py = r->y + y;
+    int cy = (py - g->y) >> g->shift;
+    const int *label_row = labels + cy * g->cols;
+    unsigned char *row = mask->data + y * mask->width;
+
+    int x = 0;
+    while (x < r->width) {
+      int px = r->x + x;
+      int cx = (px - g->x) >> g->shift;
+      int run = min(r->width - x, g->x + ((cx + 1) << g->shift) - px);
+      int label = label_row[cx];
+
+      if (label == index) {
+        memset(row + x, 255, run);
+      } else if (label < 0 || !rect_covers(&rects[label], px, py) ||
+                 !rect_covers(&rects[label], px + run - 1, py)) {
+        // cells on a footprint border are resolved per pixel
+        for (int i = 0; i < run; i++) {
+          if (voronoi_owner(rects, count, px + i, py) == index)
+            row[x + i] = 255;
+        }
+      }
+      x += run;
+    }
+  }
+}
+
+int find_seam_masks(SeamFinderType type, const StitchRect *rects,
+                    Image *images, int count, int scale_shift, Image *masks) {
+  if (count <= 0 || scale_shift < 0)
+    return 0;
+  if (type == SEAM_DP_COLOR && !images)
+    return 0;
+
+  SeamGrid g;
+  StitchPoint tl = {rects[0].x, rects[0].y};
+  StitchPoint bottom_right = br(rects[0]);
+  for (int i = 1; i < count; i++) {
+    StitchPoint p = br(rects[i]);
+    tl.x = min(tl.x, rects[i].x), tl.y = min(tl.y, rects[i].y);
+    bottom_right.x = max(bottom_right.x, p.x);
+    bottom_right.y = max(bottom_right.y, p.y);
+  }
+  g.x = tl.x;
+  g.y = tl.y;
+  g.width = bottom_right.x - tl.x;
+  g.height = bottom_right.y - tl.y;
+  g.shift = scale_shift;
+  g.cols = (g.width + (1 << scale_shift) - 1) >> scale_shift;
+  g.rows = (g.height + (1 << scale_shift) - 1) >> scale_shift;
+
+  if (g.cols <= 0 || g.rows <= 0)
+    return 0;
+
+  int *labels = (int *)stitch_malloc(g.cols * g.rows * sizeof(int));
+  if (!labels) {
+    fprintf(stderr, "Failed to allocate memory for seam labels.\n");
+    return 0;
+  }
+
+  voronoi_labels(&g, rects, count, labels);
+
+  int return_val = 1;
+  if (type == SEAM_DP_COLOR) {
+    Image *coarse = (Image *)stitch_calloc(count, sizeof(Image));
+    if (!coarse) {
+      stitch_free(labels);
+      return 0;
+    }
+
+    for (int i = 0; i < count && return_val; i++) {
+      coarse[i] = images[i];
+      for (int level = 0; level < scale_shift; level++) {
+        if (coarse[i].width < 2 || coarse[i].height < 2)
+          break;
+        Image next = downsample(&coarse[i]);
+        if (level > 0)
+          destroy_image(&coarse[i]);
+        coarse[i] = next;
+        if (!next.data) {
+          return_val = 0;
+          break;
+        }
+      }
+    }
+
+    for (int a = 0; a < count && return_val; a++) {
+      for (int b = a + 1; b < count && return_val; b++) {
+        return_val = refine_pair(&g, rects, coarse, a, b, labels);
+      }
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (coarse[i].data != images[i].data)
+        destroy_image(&coarse[i]);
+    }
+    stitch_free(coarse);
+  }
+
+  for (int i = 0; i < count && return_val; i++) {
+    masks[i] = create_empty_image(rects[i].width, rects[i].height,
+                                  GRAY_CHANNELS);
+    if (!masks[i].data) {
+      for (int j = 0; j < i; j++) {
+        destroy_image(&masks[j]);
+      }
+      return_val = 0;
+      break;
+    }
+    fill_mask(&g, rects, count, labels, i, &masks[i]);
+  }
+
+  stitch_free(labels);
+  return return_val;
+}
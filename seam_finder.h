@@ -0,0 +1,35 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SEAM_FINDER_HEADERS
+#define SEAM_FINDER_HEADERS
+
+#include "image_operations.h"
+
+typedef enum {
+    SEAM_VORONOI,
+    SEAM_DP_COLOR
+} SeamFinderType;
+
+/*
+ * Computes one binary (0/255) mask per input from the inputs' footprints on
+ * the output canvas. The partition is worked out on a grid that is
+ * (1 << scale_shift) times coarser than the canvas, so 3 or 4 keeps it cheap.
+ *
+ * SEAM_VORONOI assigns every cell to the covering input whose border is
+ * farthest away. SEAM_DP_COLOR additionally runs a min-cost dynamic
+ * programming seam on the colour difference through every pairwise overlap;
+ * it needs `images`, which may be NULL for SEAM_VORONOI.
+ *
+ * `masks` must hold `count` entries and receives masks of rects[i] size,
+ * ready to be passed to feed(). Returns 1 on success, 0 on failure.
+ */
+int find_seam_masks(SeamFinderType type, const StitchRect *rects,
+                    Image *images, int count, int scale_shift, Image *masks);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,102 @@
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static __thread BlenderStats *active_stats = NULL;
+
+static const char *OPERATOR_NAMES[OPERATOR_TYPE_COUNT] = {
+    "downsample",   "upsample",     "laplacian",         "feed",
+    "blend",        "normalize",    "feather_feed",      "feather_normalize",
+    "encode_tiles", "decode_segments", "decode_files", "encode_stripes",
+    "merge", "zero"};
+
+static const char *STAGE_NAMES[BLEND_STAGE_COUNT] = {
+    "border", "pyramid", "feed", "normalize", "collapse", "crop", "encode"};
+
+double stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *stats_timed_worker(void *args) {
+  ThreadArgs *arg = (ThreadArgs *)args;
+  double start = stats_now();
+  arg->worker(args);
+  arg->busy_seconds = stats_now() - start;
+  return NULL;
+}
+
+BlenderStats *stats_activate(BlenderStats *stats) {
+  BlenderStats *previous = active_stats;
+  active_stats = stats;
+  return previous;
+}
+
+BlenderStats *stats_active(void) { return active_stats; }
+
+double stats_begin(void) { return active_stats ? stats_now() : 0.0; }
+
+void stats_record_stage(BlendStage stage, double start) {
+  if (!active_stats)
+    return;
+  active_stats->stage_calls[stage]++;
+  active_stats->stage_seconds[stage] += stats_now() - start;
+}
+
+void stats_record_operator(OperatorType operatorType, double start,
+                           unsigned long long bytes, ThreadArgs *thread_data,
+                           int num_threads) {
+  if (!active_stats)
+    return;
+
+  double wall = stats_now() - start;
+  stats_record_operator_call(operatorType, wall, bytes);
+  for (int i = 0; i < num_threads; i++) {
+    stats_record_thread(i, thread_data[i].busy_seconds, wall);
+  }
+}
+
+void stats_record_operator_call(OperatorType operatorType, double seconds,
+                                unsigned long long bytes) {
+  if (!active_stats)
+    return;
+  active_stats->operator_calls[operatorType]++;
+  active_stats->operator_seconds[operatorType] += seconds;
+  active_stats->operator_bytes[operatorType] += bytes;
+}
+
+void stats_record_thread(int thread, double busy, double wall) {
+  if (!active_stats)
+    return;
+  int slot = thread < MAX_STATS_THREADS ? thread : MAX_STATS_THREADS - 1;
+  active_stats->thread_busy_seconds[slot] += busy;
+  active_stats->thread_idle_seconds[slot] += wall > busy ? wall - busy : 0.0;
+
+  int num_threads = thread + 1;
+  if (num_threads > active_stats->num_threads) {
+    active_stats->num_threads =
+        num_threads < MAX_STATS_THREADS ? num_threads : MAX_STATS_THREADS;
+  }
+}
+
+// the workers of a task graph allocate into the same block at once
+void stats_record_alloc(size_t bytes) {
+  if (!active_stats)
+    return;
+  __atomic_add_fetch(&active_stats->alloc_calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&active_stats->alloc_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+const char *operator_type_name(OperatorType operatorType) {
+  if (operatorType < 0 || operatorType >= OPERATOR_TYPE_COUNT)
+    return "unknown";
+  return OPERATOR_NAMES[operatorType];
+}
+
+const char *blend_stage_name(BlendStage stage) {
+  if (stage < 0 || stage >= BLEND_STAGE_COUNT)
+    return "unknown";
+  return STAGE_NAMES[stage];
+}
@@ -0,0 +1,65 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef STATS_HEADERS
+#define STATS_HEADERS
+
+#include "image_operations.h"
+
+#define MAX_STATS_THREADS 256
+
+typedef enum {
+    STAGE_BORDER,
+    STAGE_PYRAMID,
+    STAGE_FEED,
+    STAGE_NORMALIZE,
+    STAGE_COLLAPSE,
+    STAGE_CROP,
+    STAGE_ENCODE,
+    BLEND_STAGE_COUNT
+} BlendStage;
+
+typedef struct
+{
+    unsigned long long operator_calls[OPERATOR_TYPE_COUNT];
+    double operator_seconds[OPERATOR_TYPE_COUNT];
+    unsigned long long operator_bytes[OPERATOR_TYPE_COUNT];
+    unsigned long long stage_calls[BLEND_STAGE_COUNT];
+    double stage_seconds[BLEND_STAGE_COUNT];
+    int num_threads;
+    double thread_busy_seconds[MAX_STATS_THREADS];
+    double thread_idle_seconds[MAX_STATS_THREADS];
+    unsigned long long alloc_calls;
+    unsigned long long alloc_bytes;
+} BlenderStats;
+
+/*
+ * Statistics are recorded into the stats block activated on the calling
+ * thread; feed() and blend() activate the blender's block for their
+ * duration. With no active block every hook is a single pointer test.
+ */
+BlenderStats *stats_activate(BlenderStats *stats);
+BlenderStats *stats_active(void);
+
+double stats_now(void);
+double stats_begin(void);
+void stats_record_stage(BlendStage stage, double start);
+void stats_record_operator(OperatorType operatorType, double start,
+                           unsigned long long bytes, ThreadArgs *thread_data,
+                           int num_threads);
+// the parts of stats_record_operator, for work not run by parallel_operator
+void stats_record_operator_call(OperatorType operatorType, double seconds,
+                                unsigned long long bytes);
+void stats_record_thread(int thread, double busy, double wall);
+void stats_record_alloc(size_t bytes);
+void *stats_timed_worker(void *args);
+
+const char *operator_type_name(OperatorType operatorType);
+const char *blend_stage_name(BlendStage stage);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
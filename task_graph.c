@@ -0,0 +1,344 @@
+#include "task_graph.h"
+#include "allocator.h"
+#include "stats.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  TaskFunc run;
+  void *user;
+  int index;
+  int cleanup;
+  int op;
+  int call;
+  unsigned long long bytes;
+  // NUMA node of the workers that should run it, -1 for any
+  int node;
+  // prerequisites not done yet while running
+  int pending;
+  // the task below it on the same ready stack
+  int next_ready;
+  double start;
+  double end;
+} Task;
+
+typedef struct {
+  int task;
+  int prerequisite;
+} TaskEdge;
+
+struct TaskGraph {
+  Task *tasks;
+  int count;
+  int capacity;
+  TaskEdge *edges;
+  int edge_count;
+  int edge_capacity;
+  int broken;
+
+  // successors of task t are successors[first_successor[t] ..
+  // first_successor[t + 1]), built when the graph is run
+  int *first_successor;
+  int *successors;
+  // one ready stack per node, then one for the tasks of any node, linked
+  // through Task.next_ready
+  int *ready;
+  int ready_lists;
+  int ready_count;
+  int remaining;
+  int failed;
+  int timed;
+  BlenderStats *stats;
+  MemoryContext *memory;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+typedef struct {
+  TaskGraph *g;
+  int cpu;
+  int node;
+  double busy_seconds;
+} TaskWorker;
+
+static int grow(void **items, int *capacity, int count, size_t item_size) {
+  if (count < *capacity)
+    return 1;
+  int new_capacity = *capacity ? *capacity * 2 : 64;
+  void *grown = stitch_malloc((size_t)new_capacity * item_size);
+  if (!grown)
+    return 0;
+  if (*items)
+    memcpy(grown, *items, (size_t)count * item_size);
+  stitch_free(*items);
+  *items = grown;
+  *capacity = new_capacity;
+  return 1;
+}
+
+TaskGraph *create_task_graph(void) {
+  return (TaskGraph *)stitch_calloc(1, sizeof(TaskGraph));
+}
+
+void destroy_task_graph(TaskGraph *g) {
+  if (!g)
+    return;
+  stitch_free(g->tasks);
+  stitch_free(g->edges);
+  stitch_free(g);
+}
+
+int add_task(TaskGraph *g, TaskFunc run, void *user, int index) {
+  if (!grow((void **)&g->tasks, &g->capacity, g->count, sizeof(Task))) {
+    g->broken = 1;
+    return -1;
+  }
+  Task *t = &g->tasks[g->count];
+  memset(t, 0, sizeof(Task));
+  t->run = run;
+  t->user = user;
+  t->index = index;
+  t->op = -1;
+  t->node = -1;
+  return g->count++;
+}
+
+int add_dependency(TaskGraph *g, int task, int prerequisite) {
+  if (task < 0 || prerequisite < 0 ||
+      !grow((void **)&g->edges, &g->edge_capacity, g->edge_count,
+            sizeof(TaskEdge))) {
+    g->broken = 1;
+    return 0;
+  }
+  TaskEdge edge = {task, prerequisite};
+  g->edges[g->edge_count++] = edge;
+  return 1;
+}
+
+void set_task_cleanup(TaskGraph *g, int task) {
+  if (task >= 0)
+    g->tasks[task].cleanup = 1;
+}
+
+void set_task_operator(TaskGraph *g, int task, OperatorType op, int call,
+                       unsigned long long bytes) {
+  if (task < 0)
+    return;
+  g->tasks[task].op = op;
+  g->tasks[task].call = call;
+  g->tasks[task].bytes = bytes;
+}
+
+void set_task_node(TaskGraph *g, int task, int node) {
+  if (task >= 0)
+    g->tasks[task].node = node;
+}
+
+static void push_ready(TaskGraph *g, int task) {
+  int node = g->tasks[task].node;
+  int any = g->ready_lists - 1;
+  int list = node >= 0 && node < any ? node : any;
+  g->tasks[task].next_ready = g->ready[list];
+  g->ready[list] = task;
+  g->ready_count++;
+}
+
+// the worker's own node first, then tasks of any node, then the other nodes
+static int pop_ready(TaskGraph *g, int node) {
+  int any = g->ready_lists - 1;
+  int list = node >= 0 && node < any && g->ready[node] >= 0 ? node : any;
+  for (int other = 0; g->ready[list] < 0; other++) {
+    list = other;
+  }
+  int task = g->ready[list];
+  g->ready[list] = g->tasks[task].next_ready;
+  g->ready_count--;
+  return task;
+}
+
+static void *task_worker(void *args) {
+  TaskWorker *w = (TaskWorker *)args;
+  TaskGraph *g = w->g;
+  if (w->cpu >= 0) {
+    pin_thread_to_cpu(w->cpu);
+  }
+  memory_activate(g->memory);
+  stats_activate(g->stats);
+
+  pthread_mutex_lock(&g->lock);
+  for (;;) {
+    while (!g->ready_count && g->remaining) {
+      pthread_cond_wait(&g->wake, &g->lock);
+    }
+    if (!g->ready_count) {
+      break;
+    }
+
+    int id = pop_ready(g, w->node);
+    Task *t = &g->tasks[id];
+    int skip = g->failed && !t->cleanup;
+    pthread_mutex_unlock(&g->lock);
+
+    double start = g->timed ? stats_now() : 0.0;
+    int ok = skip || t->run(t->user, t->index);
+    if (g->timed) {
+      t->start = start;
+      t->end = stats_now();
+      w->busy_seconds += t->end - start;
+    }
+
+    pthread_mutex_lock(&g->lock);
+    if (!ok) {
+      g->failed = 1;
+    }
+    // this worker picks up one of the released tasks itself
+    int released = 0;
+    for (int s = g->first_successor[id]; s < g->first_successor[id + 1]; s++) {
+      int next = g->successors[s];
+      if (--g->tasks[next].pending == 0) {
+        push_ready(g, next);
+        if (released++) {
+          pthread_cond_signal(&g->wake);
+        }
+      }
+    }
+    if (--g->remaining == 0) {
+      pthread_cond_broadcast(&g->wake);
+    }
+  }
+  pthread_mutex_unlock(&g->lock);
+  return NULL;
+}
+
+typedef struct {
+  int op;
+  int call;
+  double start;
+  double end;
+  unsigned long long bytes;
+} TaskTiming;
+
+static int compare_calls(const void *a, const void *b) {
+  const TaskTiming *x = (const TaskTiming *)a;
+  const TaskTiming *y = (const TaskTiming *)b;
+  if (x->op != y->op)
+    return x->op < y->op ? -1 : 1;
+  return (x->call > y->call) - (x->call < y->call);
+}
+
+// the tasks of one operator call count as one call spanning all of them
+static void record_task_stats(TaskGraph *g) {
+  TaskTiming *timings =
+      (TaskTiming *)stitch_malloc(g->count * sizeof(TaskTiming));
+  if (!timings)
+    return;
+  int count = 0;
+  for (int i = 0; i < g->count; i++) {
+    const Task *t = &g->tasks[i];
+    if (t->op >= 0) {
+      TaskTiming timing = {t->op, t->call, t->start, t->end, t->bytes};
+      timings[count++] = timing;
+    }
+  }
+  qsort(timings, count, sizeof(TaskTiming), compare_calls);
+
+  for (int i = 0; i < count;) {
+    TaskTiming call = timings[i];
+    for (i++; i < count && !compare_calls(&timings[i], &call); i++) {
+      if (timings[i].start < call.start)
+        call.start = timings[i].start;
+      if (timings[i].end > call.end)
+        call.end = timings[i].end;
+      call.bytes += timings[i].bytes;
+    }
+    stats_record_operator_call((OperatorType)call.op, call.end - call.start,
+                               call.bytes);
+  }
+  stitch_free(timings);
+}
+
+int run_task_graph(TaskGraph *g, int num_threads) {
+  if (g->broken) {
+    return 0;
+  }
+  if (!g->count) {
+    return 1;
+  }
+
+  g->first_successor = (int *)stitch_calloc(g->count + 1, sizeof(int));
+  g->successors = (int *)stitch_malloc((g->edge_count + 1) * sizeof(int));
+  g->ready_lists = max(get_numa_nodes_count(), 1) + 1;
+  g->ready = (int *)stitch_malloc(g->ready_lists * sizeof(int));
+  if (!g->first_successor || !g->successors || !g->ready) {
+    stitch_free(g->first_successor);
+    stitch_free(g->successors);
+    stitch_free(g->ready);
+    return 0;
+  }
+
+  // counts, then running ends, which the back to front fill turns into
+  // starts while keeping every list in the order of add_dependency
+  for (int e = 0; e < g->edge_count; e++) {
+    g->first_successor[g->edges[e].prerequisite]++;
+    g->tasks[g->edges[e].task].pending++;
+  }
+  for (int t = 1; t < g->count; t++) {
+    g->first_successor[t] += g->first_successor[t - 1];
+  }
+  g->first_successor[g->count] = g->edge_count;
+  for (int e = g->edge_count - 1; e >= 0; e--) {
+    int slot = --g->first_successor[g->edges[e].prerequisite];
+    g->successors[slot] = g->edges[e].task;
+  }
+
+  // the ready lists are stacks, so the earliest added task comes first
+  g->ready_count = 0;
+  for (int list = 0; list < g->ready_lists; list++) {
+    g->ready[list] = -1;
+  }
+  for (int t = g->count - 1; t >= 0; t--) {
+    if (!g->tasks[t].pending) {
+      push_ready(g, t);
+    }
+  }
+  g->remaining = g->count;
+  g->failed = 0;
+  g->stats = stats_active();
+  g->timed = g->stats != NULL;
+  g->memory = memory_active();
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->wake, NULL);
+
+  num_threads = clamp(num_threads, 1, g->count);
+  double start = stats_begin();
+  pthread_t threads[num_threads];
+  TaskWorker workers[num_threads];
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].g = g;
+    workers[i].cpu = get_worker_cpu(i, num_threads);
+    workers[i].node = get_worker_node(i, num_threads);
+    workers[i].busy_seconds = 0.0;
+    pthread_create(&threads[i], NULL, task_worker, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (g->timed) {
+    double wall = stats_now() - start;
+    record_task_stats(g);
+    for (int i = 0; i < num_threads; i++) {
+      stats_record_thread(i, workers[i].busy_seconds, wall);
+    }
+  }
+
+  pthread_cond_destroy(&g->wake);
+  pthread_mutex_destroy(&g->lock);
+  stitch_free(g->first_successor);
+  stitch_free(g->successors);
+  stitch_free(g->ready);
+  g->first_successor = g->successors = g->ready = NULL;
+  return !g->failed;
+}
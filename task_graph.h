@@ -0,0 +1,58 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef TASK_GRAPH_HEADERS
+#define TASK_GRAPH_HEADERS
+
+#include "image_operations.h"
+
+/*
+ * Tasks and the order constraints between them, run by a pool of workers
+ * that start each task as soon as all of its prerequisites are done.
+ * parallel_operator splits one step between the workers and waits for all
+ * of them before the next one; a graph lets a tile of the next pyramid
+ * level start while the rest of the current level is still being computed,
+ * so coarse levels and consecutive images overlap.
+ */
+
+// returns 0 on failure
+typedef int (*TaskFunc)(void *user, int index);
+
+typedef struct TaskGraph TaskGraph;
+
+TaskGraph *create_task_graph(void);
+void destroy_task_graph(TaskGraph *g);
+
+// the id of the new task, -1 when out of memory
+int add_task(TaskGraph *g, TaskFunc run, void *user, int index);
+// task starts after prerequisite is done; returns 0 when out of memory
+int add_dependency(TaskGraph *g, int task, int prerequisite);
+/*
+ * Once a task failed the ones not started yet are skipped, apart from
+ * cleanup tasks, which always run. Skipped tasks still count as done for
+ * the tasks depending on them.
+ */
+void set_task_cleanup(TaskGraph *g, int task);
+/*
+ * Workers of that NUMA node take the task before any other ready one, the
+ * others only once they have nothing else to run. get_row_node gives the
+ * node for tasks on the rows of a large image.
+ */
+void set_task_node(TaskGraph *g, int task, int node);
+// counts the task towards call number `call` of op in the blender stats
+void set_task_operator(TaskGraph *g, int task, OperatorType op, int call,
+                       unsigned long long bytes);
+
+/*
+ * Runs every task on num_threads workers, which use the caller's memory
+ * context and stats block. Returns 1 when all tasks succeeded, 0 when one failed or when
+ * building the graph ran out of memory, in which case nothing is run.
+ */
+int run_task_graph(TaskGraph *g, int num_threads);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
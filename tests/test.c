@@ -1,6 +1,13 @@
 
 
+#include "blender_io.h"
+#include "blending.h"
+#include "deep_zoom.h"
 #include "image_operations.h"
+#include "kernels.h"
+#include "seam_finder.h"
+#include "task_graph.h"
+#include "tiled_blending.h"
 #include "utils.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,7 +29,7 @@ void test_sampling_operations() {
 
   Image down = downsample(&mask1);
   if (image_size(&down) != 4) {
-    printf("FATAL Image  size doesn't match expected expected 16 , got (%d)\n",
+    printf("FATAL Image  size doesn't match expected expected 16 , got (%zu)\n",
            image_size(&down));
     exit(1);
   }
@@ -36,7 +43,7 @@ void test_sampling_operations() {
 
   Image up = upsample(&down, 4.f);
   if (image_size(&up) != 16) {
-    printf("FATAL Image  size doesn't match expected expected 16 , got (%d)\n",
+    printf("FATAL Image  size doesn't match expected expected 16 , got (%zu)\n",
            image_size(&down));
     exit(1);
   }
@@ -81,6 +88,1275 @@ void test_sampling_operations() {
   destroy_image(&rgb_image);
 }
 
+void test_seam_masks() {
+  StitchRect rects[2] = {{0, 0, 200, 120}, {150, 10, 200, 120}};
+  Image images[2];
+  Image masks[2];
+
+  for (int i = 0; i < 2; i++) {
+    images[i] = create_empty_image(rects[i].width, rects[i].height,
+                                   RGB_CHANNELS);
+    for (int p = 0; p < image_size(&images[i]); p++) {
+      images[i].data[p] = (p * (i + 7)) % 251;
+    }
+  }
+
+  for (int type = SEAM_VORONOI; type <= SEAM_DP_COLOR; type++) {
+    if (!find_seam_masks(type, rects, images, 2, 3, masks)) {
+      printf("FATAL seam finder failed\n");
+      exit(1);
+    }
+
+    for (int y = 0; y < 130; y++) {
+      for (int x = 0; x < 350; x++) {
+        int covered = 0, owners = 0;
+        for (int i = 0; i < 2; i++) {
+          int lx = x - rects[i].x, ly = y - rects[i].y;
+          if (lx < 0 || ly < 0 || lx >= rects[i].width ||
+              ly >= rects[i].height)
+            continue;
+          covered = 1;
+          owners += masks[i].data[ly * masks[i].width + lx] == 255;
+        }
+        if (covered && owners != 1) {
+          printf("FATAL seam mask owners at (%d, %d) expected 1 got (%d)\n",
+                 x, y, owners);
+          exit(1);
+        }
+      }
+    }
+
+    destroy_image(&masks[0]);
+    destroy_image(&masks[1]);
+  }
+
+  destroy_image(&images[0]);
+  destroy_image(&images[1]);
+}
+
+void test_blender_stats() {
+  StitchRect rect = {0, 0, 96, 64};
+  Blender *b = create_blender(MULTIBAND, rect, 3);
+  if (!enable_blender_stats(b)) {
+    printf("FATAL could not enable blender stats\n");
+    exit(1);
+  }
+
+  Image img = create_empty_image(64, 64, RGB_CHANNELS);
+  Image mask = create_empty_image(64, 64, GRAY_CHANNELS);
+  memset(img.data, 128, image_size(&img));
+  memset(mask.data, 255, image_size(&mask));
+
+  StitchPoint tl0 = {0, 0}, tl1 = {32, 0};
+  unsigned long long calls = get_blender_memory_usage(b).alloc_calls;
+  feed(b, &img, &mask, tl0);
+  feed(b, &img, &mask, tl1);
+  blend(b);
+  calls = get_blender_memory_usage(b).alloc_calls - calls;
+
+  // the task workers allocate the pyramids into the blender's stats too
+  const BlenderStats *stats = get_blender_stats(b);
+  if (stats->alloc_calls != calls ||
+      stats->stage_calls[STAGE_FEED] != 2 ||
+      stats->stage_calls[STAGE_COLLAPSE] != 1 ||
+      stats->operator_calls[FEED] != 2 * (b->num_bands + 1) ||
+      stats->operator_calls[BLEND] != b->num_bands ||
+      stats->num_threads <= 0 || stats->alloc_bytes == 0) {
+    printf("FATAL unexpected blender stats\n");
+    exit(1);
+  }
+
+  reset_blender_stats(b);
+  if (stats->operator_calls[FEED] != 0) {
+    printf("FATAL blender stats were not reset\n");
+    exit(1);
+  }
+
+  destroy_image(&img);
+  destroy_image(&mask);
+  destroy_blender(b);
+}
+
+static Image rgba_from(const Image *rgb, const Image *mask) {
+  Image rgba = create_empty_image(rgb->width, rgb->height, RGBA_CHANNELS);
+  for (int p = 0; p < rgb->width * rgb->height; p++) {
+    memcpy(rgba.data + p * RGBA_CHANNELS, rgb->data + p * RGB_CHANNELS,
+           RGB_CHANNELS);
+    rgba.data[p * RGBA_CHANNELS + 3] = mask->data[p];
+  }
+  return rgba;
+}
+
+void test_rgba_feed() {
+  StitchRect rect = {0, 0, 120, 70};
+  Blender *separate = create_blender(MULTIBAND, rect, 3);
+  Blender *alpha = create_blender(MULTIBAND, rect, 3);
+  alpha->output_alpha = 1;
+
+  StitchPoint tls[2] = {{0, 0}, {50, 5}};
+  for (int i = 0; i < 2; i++) {
+    Image img = create_empty_image(70, 60, RGB_CHANNELS);
+    Image mask = create_empty_image(70, 60, GRAY_CHANNELS);
+    for (int p = 0; p < image_size(&img); p++) {
+      img.data[p] = (p * (31 + i * 6)) % 251;
+    }
+    for (int p = 0; p < image_size(&mask); p++) {
+      mask.data[p] = (p % 70) < 8 ? 0 : 255 - (p % 70);
+    }
+    Image rgba = rgba_from(&img, &mask);
+
+    feed(separate, &img, &mask, tls[i]);
+    feed_rgba(alpha, &rgba, tls[i]);
+
+    destroy_image(&img);
+    destroy_image(&mask);
+    destroy_image(&rgba);
+  }
+  blend(separate);
+  blend(alpha);
+
+  Image *a = &separate->result, *b = &alpha->result;
+  if (b->channels != RGBA_CHANNELS || a->width != b->width ||
+      a->height != b->height) {
+    printf("FATAL unexpected RGBA result layout\n");
+    exit(1);
+  }
+  for (int p = 0; p < a->width * a->height; p++) {
+    if (memcmp(a->data + p * RGB_CHANNELS, b->data + p * RGBA_CHANNELS,
+               RGB_CHANNELS)) {
+      printf("FATAL RGBA feed differs from separate mask at %d\n", p);
+      exit(1);
+    }
+  }
+  // (10, 30) is inside the first image, the bottom right is never covered
+  if (b->data[(30 * b->width + 10) * RGBA_CHANNELS + 3] == 0 ||
+      b->data[(b->width * b->height - 1) * RGBA_CHANNELS + 3] != 0) {
+    printf("FATAL RGBA result alpha does not follow coverage\n");
+    exit(1);
+  }
+
+  destroy_blender(separate);
+  destroy_blender(alpha);
+}
+
+void test_gray_blender() {
+  BlenderType types[2] = {MULTIBAND, FEATHER};
+  StitchRect rect = {0, 0, 110, 66};
+  StitchPoint tls[2] = {{0, 0}, {45, 6}};
+
+  for (int t = 0; t < 2; t++) {
+    Blender *rgb = create_blender(types[t], rect, 3);
+    Blender *gray = create_blender_with_channels(types[t], rect, 3, 1);
+
+    for (int i = 0; i < 2; i++) {
+      Image g = create_empty_image(65, 60, GRAY_CHANNELS);
+      Image mask = create_empty_image(65, 60, GRAY_CHANNELS);
+      Image c = create_empty_image(65, 60, RGB_CHANNELS);
+      Image mask_c = create_empty_image(65, 60, GRAY_CHANNELS);
+      for (int p = 0; p < image_size(&g); p++) {
+        g.data[p] = (p * (29 + i * 8)) % 251;
+        mask.data[p] = (p % 65) < 5 ? 0 : 250 - (p % 65);
+        memset(c.data + p * RGB_CHANNELS, g.data[p], RGB_CHANNELS);
+      }
+      memcpy(mask_c.data, mask.data, image_size(&mask));
+
+      feed(gray, &g, &mask, tls[i]);
+      feed(rgb, &c, &mask_c, tls[i]);
+      destroy_image(&g);
+      destroy_image(&mask);
+      destroy_image(&c);
+      destroy_image(&mask_c);
+    }
+    blend(gray);
+    blend(rgb);
+
+    Image *a = &rgb->result, *b = &gray->result;
+    if (b->channels != GRAY_CHANNELS || a->width != b->width ||
+        a->height != b->height) {
+      printf("FATAL unexpected gray result layout\n");
+      exit(1);
+    }
+    for (int p = 0; p < b->width * b->height; p++) {
+      if (b->data[p] != a->data[p * RGB_CHANNELS]) {
+        printf("FATAL gray blend differs from RGB at %d\n", p);
+        exit(1);
+      }
+    }
+
+    destroy_blender(rgb);
+    destroy_blender(gray);
+  }
+}
+
+static int count_tiles(void *user, const Image *tile, StitchRect rect) {
+  (*(int *)user)++;
+  return tile->width == rect.width && tile->height == rect.height;
+}
+
+void test_tiled_blender() {
+  StitchRect rect = {0, 0, 300, 180};
+  Blender *full = create_blender(MULTIBAND, rect, 3);
+  TiledBlender *tiled = create_tiled_blender(rect, 3, RGB_CHANNELS, 96, 64);
+  tiled->num_threads = 2;
+
+  StitchPoint tls[2] = {{0, 0}, {130, 20}};
+  Image imgs[2], masks[2];
+  for (int i = 0; i < 2; i++) {
+    imgs[i] = create_empty_image(170, 160, RGB_CHANNELS);
+    masks[i] = create_empty_image(170, 160, GRAY_CHANNELS);
+    for (int y = 0; y < 160; y++) {
+      for (int x = 0; x < 170; x++) {
+        for (int c = 0; c < RGB_CHANNELS; c++) {
+          imgs[i].data[(y * 170 + x) * RGB_CHANNELS + c] =
+              (x * (2 + i) + y * (3 - i) + c * 40) % 256;
+        }
+        masks[i].data[y * 170 + x] = 255;
+      }
+    }
+    tiled_feed(tiled, &imgs[i], &masks[i], tls[i]);
+  }
+
+  int tiles = 0;
+  if (!tiled_blend(tiled, count_tiles, &tiles) || tiles != 4 * 3 ||
+      !tiled_blend(tiled, NULL, NULL)) {
+    printf("FATAL tiled blend failed\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    feed(full, &imgs[i], &masks[i], tls[i]);
+  }
+  blend(full);
+
+  if (memcmp(full->result.data, tiled->result.data,
+             image_size(&full->result))) {
+    printf("FATAL tiled blend differs from full blend\n");
+    exit(1);
+  }
+
+  // tiles off the coarsest level's grid come out the same
+  TiledBlender *odd = create_tiled_blender(rect, 3, RGB_CHANNELS, 37, 29);
+  odd->num_threads = 2;
+  for (int i = 0; i < 2; i++) {
+    tiled_feed(odd, &imgs[i], &masks[i], tls[i]);
+  }
+  if (!tiled_blend(odd, NULL, NULL) ||
+      memcmp(full->result.data, odd->result.data,
+             image_size(&full->result))) {
+    printf("FATAL tiled blend of unaligned tiles differs from full blend\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    destroy_image(&imgs[i]);
+    destroy_image(&masks[i]);
+  }
+  destroy_tiled_blender(tiled);
+  destroy_tiled_blender(odd);
+  destroy_blender(full);
+}
+
+// wide enough for the graphs to split every level into several tiles
+void test_wide_blend() {
+  StitchRect rect = {0, 0, 1301, 90};
+  Blender *b = create_blender(MULTIBAND, rect, 4);
+  StitchPoint tls[2] = {{0, 0}, {590, 9}};
+  for (int i = 0; i < 2; i++) {
+    Image img = create_empty_image(711, 81, RGB_CHANNELS);
+    Image mask = create_empty_image(711, 81, GRAY_CHANNELS);
+    for (int p = 0; p < image_size(&img); p++) {
+      img.data[p] = (p * (13 + i * 4) + p / 2133 * 7) % 251;
+    }
+    for (int p = 0; p < image_size(&mask); p++) {
+      mask.data[p] = (p % 711) < 40 * i ? 0 : 255;
+    }
+    feed(b, &img, &mask, tls[i]);
+    destroy_image(&img);
+    destroy_image(&mask);
+  }
+
+  Image view;
+  int ok = blend_roi(b, rect, &view);
+  blend(b);
+  if (!ok || !b->result.data || b->result.width != view.width ||
+      b->result.height != view.height ||
+      memcmp(b->result.data, view.data, image_size(&view))) {
+    printf("FATAL tiled blend of a wide canvas differs from blend_roi\n");
+    exit(1);
+  }
+  destroy_image(&view);
+  destroy_blender(b);
+}
+
+static int in_zones(const Blender *b, int x, int y) {
+  for (int i = 0; i < b->zone_count; i++) {
+    StitchRect z = b->zones[i];
+    if (x >= z.x && x < z.x + z.width && y >= z.y && y < z.y + z.height) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Exits when a zone pixel or any alpha differs from the full blend, returns
+ * the largest difference at least 2 << num_bands away from canvas no mask
+ * covers. Closer to it the full blend fades its coarse levels into the
+ * empty canvas, which the copied pixels do not.
+ */
+static int seam_local_difference(const Blender *full, const Blender *local,
+                                 Image *masks, StitchPoint *tls, int count) {
+  const Image *a = &full->result, *b = &local->result;
+  int width = a->width, height = a->height;
+  int reach = 2 << local->num_bands;
+
+  // summed area table of the uncovered pixels
+  int *empty = (int *)calloc((size_t)(width + 1) * (height + 1), sizeof(int));
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int covered = 0;
+      for (int i = 0; i < count && !covered; i++) {
+        int mx = x - tls[i].x, my = y - tls[i].y;
+        covered = mx >= 0 && my >= 0 && mx < masks[i].width &&
+                  my < masks[i].height &&
+                  masks[i].data[(size_t)my * masks[i].width + mx];
+      }
+      empty[(y + 1) * (width + 1) + x + 1] =
+          !covered + empty[y * (width + 1) + x + 1] +
+          empty[(y + 1) * (width + 1) + x] - empty[y * (width + 1) + x];
+    }
+  }
+
+  int worst = 0;
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int near_edge = x < reach || y < reach || x + reach >= width ||
+                      y + reach >= height;
+      if (!near_edge) {
+        int x0 = x - reach, y0 = y - reach;
+        int x1 = x + reach + 1, y1 = y + reach + 1;
+        near_edge = empty[y1 * (width + 1) + x1] -
+                    empty[y0 * (width + 1) + x1] -
+                    empty[y1 * (width + 1) + x0] +
+                    empty[y0 * (width + 1) + x0];
+      }
+      for (int c = 0; c < a->channels; c++) {
+        size_t pos = ((size_t)y * width + x) * a->channels + c;
+        int d = abs(a->data[pos] - b->data[pos]);
+        if (d && (in_zones(local, x, y) || c == RGB_CHANNELS)) {
+          printf("FATAL seam-local pixel %d,%d differs in a zone\n", x, y);
+          exit(1);
+        }
+        worst = d > worst && !near_edge ? d : worst;
+      }
+    }
+  }
+  free(empty);
+  return worst;
+}
+
+// a strip of three images with seams in their overlaps, like a panorama
+void test_seam_local() {
+  StitchRect rect = {0, 0, 1517, 203};
+  StitchPoint tls[3] = {{0, 5}, {470, 0}, {950, 17}};
+  Image imgs[3], masks[3], rgba_imgs[3];
+  Image *img_ptrs[3], *mask_ptrs[3], *rgba_ptrs[3];
+  for (int i = 0; i < 3; i++) {
+    imgs[i] = create_empty_image(567, 186, RGB_CHANNELS);
+    masks[i] = create_empty_image(567, 186, GRAY_CHANNELS);
+    for (int p = 0; p < image_size(&imgs[i]); p++) {
+      imgs[i].data[p] = (p / 3 % 567 * (2 + i) + p / 1701 * 3 + p % 3 * 40) % 256;
+    }
+    for (int y = 0; y < 186; y++) {
+      // the seam wanders through the left part the previous image covers
+      int seam = i ? 40 + y % 23 : 0;
+      for (int x = 0; x < 567; x++) {
+        masks[i].data[y * 567 + x] = x < seam ? 0 : 255;
+      }
+    }
+    rgba_imgs[i] = rgba_from(&imgs[i], &masks[i]);
+    img_ptrs[i] = &imgs[i];
+    mask_ptrs[i] = &masks[i];
+    rgba_ptrs[i] = &rgba_imgs[i];
+  }
+
+  for (int rgba = 0; rgba < 2; rgba++) {
+    Blender *full = create_blender(MULTIBAND, rect, 4);
+    Blender *local = create_blender(MULTIBAND, rect, 4);
+    local->seam_local = 1;
+    full->output_alpha = local->output_alpha = rgba;
+    int ok = rgba ? feed_many(full, rgba_ptrs, NULL, tls, 3) &&
+                        feed_many(local, rgba_ptrs, NULL, tls, 3)
+                  : feed_many(full, img_ptrs, mask_ptrs, tls, 3) &&
+                        feed_many(local, img_ptrs, mask_ptrs, tls, 3);
+    if (!ok || local->zone_count != 2) {
+      printf("FATAL seam-local feed failed\n");
+      exit(1);
+    }
+    if (feed(local, &imgs[0], &masks[0], tls[0]) ||
+        blender_save(local, "seam_local.blend", 0)) {
+      printf("FATAL seam-local blender took a second feed or was saved\n");
+      exit(1);
+    }
+
+    Image view;
+    ok = blend_roi(local, rect, &view);
+    blend(full);
+    blend(local);
+    if (!ok || !local->result.data ||
+        memcmp(view.data, local->result.data, image_size(&view))) {
+      printf("FATAL seam-local blend_roi differs from blend\n");
+      exit(1);
+    }
+    destroy_image(&view);
+
+    // the zones come from the pyramid as before, the rest skips its rounding:
+    // one truncation in the normalization of each level
+    Image *b = &local->result;
+    int worst = seam_local_difference(full, local, masks, tls, 3);
+    if (worst > local->num_bands + 1) {
+      printf("FATAL seam-local copy differs by %d\n", worst);
+      exit(1);
+    }
+    // left of the first seam everything is image 0 as it was fed
+    for (int y = tls[0].y; y < tls[0].y + imgs[0].height; y++) {
+      if (memcmp(b->data + (size_t)y * b->width * b->channels,
+                 imgs[0].data + (size_t)(y - tls[0].y) * imgs[0].width *
+                                    RGB_CHANNELS,
+                 RGB_CHANNELS) ||
+          memcmp(b->data + ((size_t)y * b->width + local->zones[0].x - 1) *
+                               b->channels,
+                 imgs[0].data + ((size_t)(y - tls[0].y) * imgs[0].width +
+                                 local->zones[0].x - 1) *
+                                    RGB_CHANNELS,
+                 RGB_CHANNELS)) {
+        printf("FATAL seam-local pixels are not copied from the input\n");
+        exit(1);
+      }
+    }
+    destroy_blender(full);
+    destroy_blender(local);
+  }
+
+  // a grid of Voronoi cells, where zones meet at the corners
+  StitchRect cells[9];
+  StitchPoint grid_tls[9];
+  Image grid[9], grid_masks[9];
+  Image *grid_ptrs[9], *grid_mask_ptrs[9];
+  for (int i = 0; i < 9; i++) {
+    grid_tls[i].x = i % 3 * 170 + i / 3 * 7 % 13;
+    grid_tls[i].y = i / 3 * 125 + i % 3 * 5 % 11;
+    StitchRect cell = {grid_tls[i].x, grid_tls[i].y, 200, 150};
+    cells[i] = cell;
+    grid[i] = create_empty_image(200, 150, RGB_CHANNELS);
+    for (int p = 0; p < image_size(&grid[i]); p++) {
+      grid[i].data[p] = (p / 3 % 200 * (2 + i) + p / 600 * (3 + i % 4) +
+                         p % 3 * 40 + i * 31) %
+                        256;
+    }
+    grid_ptrs[i] = &grid[i];
+    grid_mask_ptrs[i] = &grid_masks[i];
+  }
+  if (!find_seam_masks(SEAM_VORONOI, cells, NULL, 9, 3, grid_masks)) {
+    printf("FATAL seam finder failed on the grid\n");
+    exit(1);
+  }
+  StitchRect grid_rect = {0, 0, 553, 411};
+  Blender *full = create_blender(MULTIBAND, grid_rect, 4);
+  Blender *local = create_blender(MULTIBAND, grid_rect, 4);
+  local->seam_local = 1;
+  feed_many(full, grid_ptrs, grid_mask_ptrs, grid_tls, 9);
+  feed_many(local, grid_ptrs, grid_mask_ptrs, grid_tls, 9);
+  blend(full);
+  blend(local);
+  int worst = seam_local_difference(full, local, grid_masks, grid_tls, 9);
+  if (!local->result.data || local->zone_count < 12 ||
+      worst > local->num_bands + 1) {
+    printf("FATAL seam-local grid differs by %d\n", worst);
+    exit(1);
+  }
+  for (int i = 0; i < 9; i++) {
+    destroy_image(&grid[i]);
+    destroy_image(&grid_masks[i]);
+  }
+  destroy_blender(full);
+  destroy_blender(local);
+
+  // alone, an image needs no pyramid at all
+  StitchRect own = {0, 0, imgs[0].width, imgs[0].height};
+  Blender *alone = create_blender(MULTIBAND, own, 4);
+  alone->seam_local = 1;
+  StitchPoint origin = {0, 0};
+  feed(alone, &imgs[0], &masks[0], origin);
+  blend(alone);
+  if (alone->zone_count || !alone->result.data ||
+      memcmp(alone->result.data, imgs[0].data, image_size(&imgs[0]))) {
+    printf("FATAL seam-local blend of one image is not the image\n");
+    exit(1);
+  }
+  destroy_blender(alone);
+
+  for (int i = 0; i < 3; i++) {
+    destroy_image(&imgs[i]);
+    destroy_image(&masks[i]);
+    destroy_image(&rgba_imgs[i]);
+  }
+}
+
+void test_level_outputs() {
+  StitchRect rect = {0, 0, 150, 90};
+  Blender *all = create_blender(MULTIBAND, rect, 4);
+  Blender *coarse = create_blender(MULTIBAND, rect, 4);
+  all->output_levels = (1 << 0) | (1 << 2) | (1 << 4);
+  coarse->output_levels = (1 << 2) | (1 << 4);
+
+  StitchPoint tls[2] = {{0, 0}, {70, 10}};
+  for (int i = 0; i < 2; i++) {
+    Image imgs[2], masks[2];
+    for (int k = 0; k < 2; k++) {
+      imgs[k] = create_empty_image(80, 75, RGB_CHANNELS);
+      masks[k] = create_empty_image(80, 75, GRAY_CHANNELS);
+      for (int p = 0; p < image_size(&imgs[k]); p++) {
+        imgs[k].data[p] = (p * (13 + i * 4)) % 251;
+      }
+      memset(masks[k].data, 255, image_size(&masks[k]));
+    }
+    feed(all, &imgs[0], &masks[0], tls[i]);
+    feed(coarse, &imgs[1], &masks[1], tls[i]);
+    for (int k = 0; k < 2; k++) {
+      destroy_image(&imgs[k]);
+      destroy_image(&masks[k]);
+    }
+  }
+  blend(all);
+  blend(coarse);
+
+  Image *quarter = &all->level_results[2];
+  if (!all->result.data || all->result.width != 150 || !quarter->data ||
+      quarter->width != 38 || quarter->height != 23 ||
+      all->level_results[4].width != 10 || all->level_results[1].data) {
+    printf("FATAL unexpected level renditions\n");
+    exit(1);
+  }
+  // stopping the collapse early must not change the coarse levels
+  if (coarse->result.data ||
+      memcmp(quarter->data, coarse->level_results[2].data,
+             image_size(quarter)) ||
+      memcmp(all->level_results[4].data, coarse->level_results[4].data,
+             image_size(&all->level_results[4]))) {
+    printf("FATAL early stopped collapse differs\n");
+    exit(1);
+  }
+
+  destroy_blender(all);
+  destroy_blender(coarse);
+}
+
+void test_blend_roi() {
+  BlenderType types[2] = {MULTIBAND, FEATHER};
+  StitchRect rect = {0, 0, 130, 77};
+  StitchRect rois[3] = {{0, 0, 130, 77}, {37, 21, 40, 30}, {100, 60, 50, 50}};
+
+  for (int t = 0; t < 2; t++) {
+    Blender *b = create_blender(types[t], rect, 3);
+    StitchPoint tls[2] = {{0, 0}, {60, 12}};
+    for (int i = 0; i < 2; i++) {
+      Image img = create_empty_image(70, 64, RGB_CHANNELS);
+      Image mask = create_empty_image(70, 64, GRAY_CHANNELS);
+      for (int p = 0; p < image_size(&img); p++) {
+        img.data[p] = (p * (17 + i * 6)) % 253;
+      }
+      for (int p = 0; p < image_size(&mask); p++) {
+        mask.data[p] = (p % 70) < 6 ? 0 : 255;
+      }
+      feed(b, &img, &mask, tls[i]);
+      destroy_image(&img);
+      destroy_image(&mask);
+    }
+
+    Image views[3];
+    for (int r = 0; r < 3; r++) {
+      // asking twice must give the same pixels, the accumulators survive
+      Image first;
+      if (!blend_roi(b, rois[r], &first) || !blend_roi(b, rois[r], &views[r]) ||
+          memcmp(first.data, views[r].data, image_size(&first))) {
+        printf("FATAL repeated blend_roi failed\n");
+        exit(1);
+      }
+      destroy_image(&first);
+    }
+
+    blend(b);
+    for (int r = 0; r < 3; r++) {
+      for (int y = 0; y < views[r].height; y++) {
+        const unsigned char *expected =
+            b->result.data +
+            ((rois[r].y + y) * b->result.width + rois[r].x) * RGB_CHANNELS;
+        if (memcmp(expected, views[r].data + y * views[r].width * RGB_CHANNELS,
+                   views[r].width * RGB_CHANNELS)) {
+          printf("FATAL blend_roi differs from blend in roi %d\n", r);
+          exit(1);
+        }
+      }
+      destroy_image(&views[r]);
+    }
+    destroy_blender(b);
+  }
+}
+
+static void check_deep_zoom_tiles(const char *corner_path,
+                                  const char *single_path,
+                                  const char *eighth_path,
+                                  const char *descriptor_path) {
+  // 300 x 200 needs 10 levels; the last tile of the top level is 45 x 73
+  Image corner = create_image(corner_path);
+  Image single = create_image(single_path);
+  Image eighth = create_image(eighth_path);
+  FILE *descriptor = fopen(descriptor_path, "r");
+  if (corner.width != 45 || corner.height != 73 || single.width != 1 ||
+      eighth.width != 38 || eighth.height != 25 || !descriptor) {
+    printf("FATAL unexpected deep zoom tiles\n");
+    exit(1);
+  }
+
+  fclose(descriptor);
+  destroy_image(&corner);
+  destroy_image(&single);
+  destroy_image(&eighth);
+}
+
+void test_deep_zoom() {
+  StitchRect rect = {0, 0, 300, 200};
+  Blender *b = create_blender(MULTIBAND, rect, 3);
+  Blender *local = create_blender(MULTIBAND, rect, 3);
+  local->seam_local = 1;
+  StitchPoint tls[2] = {{0, 0}, {140, 30}};
+  Image imgs[2], masks[2];
+  Image *img_ptrs[2], *mask_ptrs[2];
+  for (int i = 0; i < 2; i++) {
+    imgs[i] = create_empty_image(160, 170, RGB_CHANNELS);
+    masks[i] = create_empty_image(160, 170, GRAY_CHANNELS);
+    for (int p = 0; p < image_size(&imgs[i]); p++) {
+      imgs[i].data[p] = (p / 3 + i * 90) % 256;
+    }
+    memset(masks[i].data, 255, image_size(&masks[i]));
+    feed(b, &imgs[i], &masks[i], tls[i]);
+    img_ptrs[i] = &imgs[i];
+    mask_ptrs[i] = &masks[i];
+  }
+  feed_many(local, img_ptrs, mask_ptrs, tls, 2);
+
+  if (!save_deep_zoom(b, "deep_zoom_test", 128, 1, 90)) {
+    printf("FATAL save_deep_zoom failed\n");
+    exit(1);
+  }
+  check_deep_zoom_tiles("deep_zoom_test_files/9/2_1.jpg",
+                        "deep_zoom_test_files/0/0_0.jpg",
+                        "deep_zoom_test_files/6/0_0.jpg", "deep_zoom_test.dzi");
+
+  // a seam-local feed only collapses to the full level, the rest is halved
+  if (!save_deep_zoom(local, "deep_zoom_local", 128, 1, 90)) {
+    printf("FATAL seam-local save_deep_zoom failed\n");
+    exit(1);
+  }
+  check_deep_zoom_tiles("deep_zoom_local_files/9/2_1.jpg",
+                        "deep_zoom_local_files/0/0_0.jpg",
+                        "deep_zoom_local_files/6/0_0.jpg",
+                        "deep_zoom_local.dzi");
+
+  for (int i = 0; i < 2; i++) {
+    destroy_image(&imgs[i]);
+    destroy_image(&masks[i]);
+  }
+  destroy_blender(b);
+  destroy_blender(local);
+}
+
+void test_jpeg_memory_io() {
+  Image img = create_empty_image(48, 40, RGB_CHANNELS);
+  for (int p = 0; p < image_size(&img); p++) {
+    img.data[p] = (p / 3) % 200;
+  }
+
+  unsigned char *jpeg = NULL;
+  unsigned long size = 0;
+  if (!compress_jpeg_buffer(&img, 95, &jpeg, &size)) {
+    printf("FATAL compress_jpeg_buffer failed\n");
+    exit(1);
+  }
+  Image decoded = decompress_jpeg_buffer(jpeg, size);
+  tjFree(jpeg);
+
+  // a caller buffer of jpeg_buffer_size() bytes is filled in place
+  unsigned long capacity = jpeg_buffer_size(&img);
+  unsigned char *own = (unsigned char *)malloc(capacity);
+  unsigned char *buf = own;
+  size = capacity;
+  int ok = compress_jpeg_buffer(&img, 95, &buf, &size);
+  if (!decoded.data || decoded.width != 48 || decoded.height != 40 || !ok ||
+      buf != own || size == 0 || size > capacity) {
+    printf("FATAL unexpected in-memory jpeg round trip\n");
+    exit(1);
+  }
+
+  compress_jpeg("memory_io_test.jpg", &img, 95);
+  Image mapped = create_image("memory_io_test.jpg");
+  Image reference = decompress_jpeg_buffer(own, size);
+  if (!mapped.data || !reference.data ||
+      memcmp(mapped.data, reference.data, image_size(&reference))) {
+    printf("FATAL mapped jpeg differs from the in-memory one\n");
+    exit(1);
+  }
+
+  free(own);
+  destroy_image(&img);
+  destroy_image(&decoded);
+  destroy_image(&mapped);
+  destroy_image(&reference);
+}
+
+void test_jpeg_batch_decode() {
+  const char *names[3] = {"batch_test_0.jpg", "batch_test_1.jpg",
+                          "batch_test_2.jpg"};
+  for (int i = 0; i < 3; i++) {
+    Image img = create_empty_image(64 + i * 16, 48, RGB_CHANNELS);
+    for (int p = 0; p < image_size(&img); p++) {
+      img.data[p] = (p + i * 40) % 256;
+    }
+    compress_jpeg(names[i], &img, 90);
+    destroy_image(&img);
+  }
+
+  Image images[3];
+  if (!decompress_jpeg_batch(names, 3, images)) {
+    printf("FATAL decompress_jpeg_batch failed\n");
+    exit(1);
+  }
+  for (int i = 0; i < 3; i++) {
+    Image single = decompress_jpeg(names[i]);
+    if (images[i].width != 64 + i * 16 || images[i].height != 48 ||
+        memcmp(images[i].data, single.data, image_size(&single))) {
+      printf("FATAL batch decode differs from the single decode\n");
+      exit(1);
+    }
+    destroy_image(&single);
+    destroy_image(&images[i]);
+  }
+}
+
+void test_striped_jpeg() {
+  Image img = create_empty_image(1024, 1024, RGB_CHANNELS);
+  for (int p = 0; p < image_size(&img); p++) {
+    img.data[p] = (p * 7 + (p >> 10) * 3) % 256;
+  }
+
+  unsigned char *serial = NULL, *striped = NULL;
+  unsigned long serial_size = 0, striped_size = 0;
+  set_cpus_count(1);
+  compress_jpeg_buffer(&img, 90, &serial, &serial_size);
+  Image expected = decompress_jpeg_buffer(serial, serial_size);
+
+  // striped with restart markers, which also sends the decode down the
+  // segment path; DCT blocks do not straddle stripes, so pixels must match
+  BlenderStats stats;
+  memset(&stats, 0, sizeof(stats));
+  set_cpus_count(4);
+  stats_activate(&stats);
+  compress_jpeg_buffer(&img, 90, &striped, &striped_size);
+  Image decoded = decompress_jpeg_buffer(striped, striped_size);
+  stats_activate(NULL);
+  set_cpus_count(0);
+
+  if (!stats.operator_calls[ENCODE_STRIPES] ||
+      !stats.operator_calls[DECODE_SEGMENTS] || !decoded.data ||
+      memcmp(decoded.data, expected.data, image_size(&expected))) {
+    printf("FATAL striped jpeg differs from the serial one\n");
+    exit(1);
+  }
+
+  tjFree(serial);
+  tjFree(striped);
+  destroy_image(&img);
+  destroy_image(&expected);
+  destroy_image(&decoded);
+}
+
+static void feed_stripes(Blender *b, int first, int last) {
+  StitchPoint tls[2] = {{0, 0}, {70, 10}};
+  for (int i = first; i < last; i++) {
+    Image img = create_empty_image(90, 80, RGB_CHANNELS);
+    Image mask = create_empty_image(90, 80, GRAY_CHANNELS);
+    for (int p = 0; p < image_size(&img); p++) {
+      img.data[p] = (p / 3 * 5 + i * 70) % 256;
+    }
+    memset(mask.data, 255, image_size(&mask));
+    feed(b, &img, &mask, tls[i]);
+    destroy_image(&img);
+    destroy_image(&mask);
+  }
+}
+
+void test_blender_merge() {
+  StitchRect rect = {0, 0, 160, 90};
+  Blender *whole = create_blender(MULTIBAND, rect, 3);
+  Blender *left = create_blender(MULTIBAND, rect, 3);
+  Blender *right = create_blender(MULTIBAND, rect, 3);
+  Blender *other = create_blender(FEATHER, rect, 3);
+  feed_stripes(whole, 0, 2);
+  feed_stripes(left, 0, 1);
+  feed_stripes(right, 1, 2);
+
+  // one input per partial blender, so the sums are added in feed order
+  int ok = blender_save(right, "merge_test_raw.blend", 0) &&
+           blender_save(right, "merge_test_rle.blend", 1);
+  Blender *loaded = blender_load("merge_test_rle.blend");
+  Blender *mapped = create_blender(MULTIBAND, rect, 3);
+  feed_stripes(mapped, 0, 1);
+
+  // a file cut short in its last section is refused without adding the rest
+  FILE *file = fopen("merge_test_rle.blend", "rb");
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  unsigned char *bytes = (unsigned char *)malloc(size);
+  fseek(file, 0, SEEK_SET);
+  ok = ok && fread(bytes, 1, size, file) == (size_t)size;
+  fclose(file);
+  file = fopen("merge_test_cut.blend", "wb");
+  fwrite(bytes, 1, size - 8, file);
+  fclose(file);
+  free(bytes);
+  ok = ok && !blender_merge_file(mapped, "merge_test_cut.blend") &&
+       !blender_load("merge_test_cut.blend");
+
+  ok = ok && loaded && blender_merge_file(mapped, "merge_test_raw.blend");
+  Blender *merged = left;
+  ok = ok && blender_merge(merged, loaded) && !blender_merge(merged, other);
+
+  blend(whole);
+  blend(merged);
+  blend(mapped);
+  if (!ok || memcmp(whole->result.data, merged->result.data,
+                    image_size(&whole->result)) ||
+      memcmp(whole->result.data, mapped->result.data,
+             image_size(&whole->result))) {
+    printf("FATAL merged blender differs from the single one\n");
+    exit(1);
+  }
+
+  destroy_blender(whole);
+  destroy_blender(left);
+  destroy_blender(right);
+  destroy_blender(other);
+  destroy_blender(loaded);
+  destroy_blender(mapped);
+}
+
+static void make_feed_input(Image *img, Image *mask, int i) {
+  *img = create_empty_image(150, 120, RGB_CHANNELS);
+  *mask = create_empty_image(150, 120, GRAY_CHANNELS);
+  for (int p = 0; p < image_size(img); p++) {
+    img->data[p] = (p / 3 * (3 + i) + p / 450 * 7 + p % 3 * 50) % 256;
+  }
+  for (int p = 0; p < image_size(mask); p++) {
+    mask->data[p] = 255 - (p % 150 + i * 20) % 200;
+  }
+}
+
+void test_feed_many() {
+  StitchRect rect = {0, 0, 330, 170};
+  StitchPoint tls[3] = {{0, 0}, {90, 40}, {180, 20}};
+  BlenderType types[2] = {MULTIBAND, FEATHER};
+  for (int t = 0; t < 2; t++) {
+    Blender *one = create_blender(types[t], rect, 4);
+    Blender *many = create_blender(types[t], rect, 4);
+    Blender *rgba = create_blender(types[t], rect, 4);
+    Image imgs[3], masks[3], rgba_imgs[3];
+    Image *img_ptrs[3], *mask_ptrs[3], *rgba_ptrs[3];
+    for (int i = 0; i < 3; i++) {
+      Image img, mask;
+      make_feed_input(&img, &mask, i);
+      feed(one, &img, &mask, tls[i]);
+      destroy_image(&img);
+      destroy_image(&mask);
+
+      make_feed_input(&imgs[i], &masks[i], i);
+      rgba_imgs[i] = rgba_from(&imgs[i], &masks[i]);
+      img_ptrs[i] = &imgs[i];
+      mask_ptrs[i] = &masks[i];
+      rgba_ptrs[i] = &rgba_imgs[i];
+    }
+    int ok = feed_many(many, img_ptrs, mask_ptrs, tls, 3) &&
+             feed_many(rgba, rgba_ptrs, NULL, tls, 3);
+
+    // the inputs are only read, the border is made while building the pyramid
+    for (int i = 0; i < 3; i++) {
+      Image img, mask;
+      make_feed_input(&img, &mask, i);
+      if (imgs[i].width != img.width || imgs[i].height != img.height ||
+          masks[i].width != mask.width ||
+          memcmp(imgs[i].data, img.data, image_size(&img)) ||
+          memcmp(masks[i].data, mask.data, image_size(&mask))) {
+        printf("FATAL feed_many changed its inputs\n");
+        exit(1);
+      }
+      destroy_image(&img);
+      destroy_image(&mask);
+    }
+
+    blend(one);
+    blend(many);
+    blend(rgba);
+    if (!ok || !one->result.data || !many->result.data || !rgba->result.data ||
+        memcmp(one->result.data, many->result.data,
+               image_size(&one->result)) ||
+        memcmp(one->result.data, rgba->result.data,
+               image_size(&one->result))) {
+      printf("FATAL feed_many differs from feeding one at a time\n");
+      exit(1);
+    }
+
+    for (int i = 0; i < 3; i++) {
+      destroy_image(&imgs[i]);
+      destroy_image(&masks[i]);
+      destroy_image(&rgba_imgs[i]);
+    }
+    destroy_blender(one);
+    destroy_blender(many);
+    destroy_blender(rgba);
+  }
+}
+
+static Image exposure(int width, int height, float gain) {
+  Image img = create_empty_image(width, height, RGB_CHANNELS);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      for (int c = 0; c < RGB_CHANNELS; c++) {
+        float v = (x + y / 2 + (x / 4 + y / 4) % 2 * 30 + c * 20) * gain;
+        img.data[(y * width + x) * RGB_CHANNELS + c] = v > 255 ? 255 : v;
+      }
+    }
+  }
+  return img;
+}
+
+static double mean_distance(const Image *a, const Image *b, int x0, int x1) {
+  double sum = 0;
+  for (int y = 0; y < a->height; y++) {
+    for (int x = x0; x < x1; x++) {
+      for (int c = 0; c < a->channels; c++) {
+        int p = (y * a->width + x) * a->channels + c;
+        sum += abs(a->data[p] - (b ? b->data[p] : 128));
+      }
+    }
+  }
+  return sum / (a->height * (x1 - x0) * a->channels);
+}
+
+void test_fusion_blender() {
+  StitchRect rect = {0, 0, 120, 90};
+  StitchPoint tl = {0, 0};
+  float gains[3] = {0.3f, 1.f, 3.f};
+  const char *variants[2] = {"baseline", NULL};
+  Image fused[2];
+  for (int v = 0; v < 2; v++) {
+    set_kernel_variant(variants[v]);
+    Blender *b = create_blender(FUSION, rect, 4);
+    for (int i = 0; i < 3; i++) {
+      Image img = exposure(120, 90, gains[i]);
+      feed(b, &img, NULL, tl);
+      destroy_image(&img);
+    }
+    blend(b);
+    fused[v] = b->result;
+    b->result.data = NULL;
+    destroy_blender(b);
+  }
+  set_kernel_variant(NULL);
+
+  // closer to mid gray than the dark and the bright frame
+  Image dark = exposure(120, 90, gains[0]);
+  Image bright = exposure(120, 90, gains[2]);
+  double fused_distance = mean_distance(&fused[0], NULL, 0, 120);
+  if (!fused[0].data || !fused[1].data ||
+      memcmp(fused[0].data, fused[1].data, image_size(&fused[0])) ||
+      fused_distance >= mean_distance(&dark, NULL, 0, 120) ||
+      fused_distance >= mean_distance(&bright, NULL, 0, 120)) {
+    printf("FATAL exposure fusion\n");
+    exit(1);
+  }
+
+  // each frame is only sharp in one half, focus stacking keeps both halves
+  Image frames[2];
+  Blender *stack = create_blender(FUSION, rect, 4);
+  stack->fusion_saturation = 0.f;
+  stack->fusion_exposedness = 0.f;
+  for (int i = 0; i < 2; i++) {
+    frames[i] = exposure(120, 90, 1.f);
+    for (int p = 0; p < image_size(&frames[i]); p++) {
+      int x = p / RGB_CHANNELS % 120;
+      if ((x < 60) != (i == 0)) {
+        frames[i].data[p] = 128;
+      }
+    }
+    Image img = exposure(120, 90, 1.f);
+    memcpy(img.data, frames[i].data, image_size(&img));
+    feed(stack, &img, NULL, tl);
+    destroy_image(&img);
+  }
+  blend(stack);
+  if (!stack->result.data ||
+      mean_distance(&stack->result, &frames[0], 0, 40) >=
+          mean_distance(&stack->result, &frames[1], 0, 40) ||
+      mean_distance(&stack->result, &frames[1], 80, 120) >=
+          mean_distance(&stack->result, &frames[0], 80, 120)) {
+    printf("FATAL focus stacking\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < 2; i++) {
+    destroy_image(&fused[i]);
+    destroy_image(&frames[i]);
+  }
+  destroy_image(&dark);
+  destroy_image(&bright);
+  destroy_blender(stack);
+}
+
+void test_feed_jpeg() {
+  Image img = create_empty_image(150, 110, RGB_CHANNELS);
+  for (int p = 0; p < image_size(&img); p++) {
+    img.data[p] = (p / 3 % 150 * 2 + p / 450 * 3 + p % 3 * 60) % 256;
+  }
+  unsigned char *jpeg = NULL;
+  unsigned long size = 0;
+  compress_jpeg_buffer(&img, 90, &jpeg, &size);
+  destroy_image(&img);
+
+  StitchRect rect = {0, 0, 260, 190};
+  StitchPoint tls[2] = {{0, 0}, {100, 70}};
+  BlenderType types[2] = {MULTIBAND, FEATHER};
+  for (int t = 0; t < 2; t++) {
+    Blender *streamed = create_blender(types[t], rect, 4);
+    Blender *decoded = create_blender(types[t], rect, 4);
+    int ok = 1;
+    for (int i = 0; i < 2; i++) {
+      Image mask = create_empty_image(150, 110, GRAY_CHANNELS);
+      Image mask_copy = create_empty_image(150, 110, GRAY_CHANNELS);
+      memset(mask.data, 255, image_size(&mask));
+      memset(mask_copy.data, 255, image_size(&mask_copy));
+      Image full = decompress_jpeg_buffer(jpeg, size);
+      ok = ok && feed_jpeg(streamed, jpeg, size, &mask, tls[i]) &&
+           feed(decoded, &full, &mask_copy, tls[i]);
+      destroy_image(&full);
+      destroy_image(&mask);
+      destroy_image(&mask_copy);
+    }
+
+    blend(streamed);
+    blend(decoded);
+    if (!ok || memcmp(streamed->result.data, decoded->result.data,
+                      image_size(&decoded->result))) {
+      printf("FATAL feed_jpeg differs from feed\n");
+      exit(1);
+    }
+    destroy_blender(streamed);
+    destroy_blender(decoded);
+  }
+  tjFree(jpeg);
+}
+
+static size_t counting_allocations = 0;
+
+static void *counting_alloc(void *user, size_t size, size_t alignment) {
+  void *ptr = NULL;
+  __atomic_add_fetch(&counting_allocations, 1, __ATOMIC_RELAXED);
+  return posix_memalign(&ptr, alignment, size) ? NULL : ptr;
+}
+
+static void counting_free(void *user, void *ptr) { free(ptr); }
+
+void test_blender_memory() {
+  StitchAllocator allocator = {counting_alloc, NULL, counting_free, NULL};
+  StitchRect rect = {0, 0, 96, 64};
+
+  if (create_blender_with_allocator(MULTIBAND, rect, 3, &allocator, 1024)) {
+    printf("FATAL blender ignored its memory limit\n");
+    exit(1);
+  }
+
+  Blender *b =
+      create_blender_with_allocator(MULTIBAND, rect, 3, &allocator, 0);
+  Image img = create_empty_image(64, 64, RGB_CHANNELS);
+  Image mask = create_empty_image(64, 64, GRAY_CHANNELS);
+  memset(img.data, 128, image_size(&img));
+  memset(mask.data, 255, image_size(&mask));
+
+  size_t before = get_blender_memory_usage(b).current_bytes;
+  StitchPoint tl = {16, 0};
+  feed(b, &img, &mask, tl);
+  MemoryUsage usage = get_blender_memory_usage(b);
+  if (usage.current_bytes != before || usage.peak_bytes <= before ||
+      counting_allocations == 0) {
+    printf("FATAL feed leaked memory: %zu -> %zu\n", before,
+           usage.current_bytes);
+    exit(1);
+  }
+
+  blend(b);
+  if (!b->result.data || (size_t)b->result.data % STITCH_ALIGNMENT != 0) {
+    printf("FATAL blend result is not aligned\n");
+    exit(1);
+  }
+
+  destroy_blender(b);
+  destroy_image(&img);
+  destroy_image(&mask);
+}
+
+// leaves garbage behind so blocks the library forgets to clear show up
+static void *dirty_alloc(void *user, size_t size, size_t alignment) {
+  void *ptr = counting_alloc(user, size, alignment);
+  if (ptr)
+    memset(ptr, 0xAB, size);
+  return ptr;
+}
+
+void test_large_images() {
+  Image huge = {NULL, 50000, 50000, RGB_CHANNELS};
+  if (image_size(&huge) != (size_t)50000 * 50000 * RGB_CHANNELS) {
+    printf("FATAL image_size overflows\n");
+    exit(1);
+  }
+
+  // big enough to be cleared by the workers instead of stitch_calloc
+  StitchAllocator allocator = {dirty_alloc, NULL, counting_free, NULL};
+  MemoryContext *context = create_memory_context(&allocator, 0);
+  MemoryContext *previous = memory_activate(context);
+  ImageF level = create_empty_image_f(2051, 4099, 2);
+  memory_activate(previous);
+  if (!level.data) {
+    printf("FATAL large image allocation failed\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < image_size_f(&level); i++) {
+    if (level.data[i] != 0.0f) {
+      printf("FATAL large image not cleared at %zu\n", i);
+      exit(1);
+    }
+  }
+  destroy_image_f(&level);
+  destroy_memory_context(context);
+}
+
+static size_t calloc_calls = 0;
+
+static void *counting_calloc(void *user, size_t size, size_t alignment) {
+  __atomic_add_fetch(&calloc_calls, 1, __ATOMIC_RELAXED);
+  void *ptr = counting_alloc(user, size, alignment);
+  if (ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+static int record_task(void *user, int index) {
+  int *order = (int *)user;
+  order[order[3]++] = index;
+  return 1;
+}
+
+void test_numa_first_touch() {
+  StitchRect rect = {0, 0, 160, 90};
+  Blender *reference = create_blender(MULTIBAND, rect, 3);
+  feed_stripes(reference, 0, 2);
+  blend(reference);
+
+  // pretend to be a two node host: pinned workers and first touch
+  set_numa_nodes_count(2);
+  StitchAllocator allocator = {dirty_alloc, counting_calloc, counting_free,
+                               NULL};
+  MemoryContext *context = create_memory_context(&allocator, 0);
+  MemoryContext *previous = memory_activate(context);
+  ImageF level = create_empty_image_f(1024, 1024, RGB_CHANNELS);
+  memory_activate(previous);
+  int cleared = level.data && calloc_calls == 0;
+  for (size_t i = 0; cleared && i < image_size_f(&level); i++) {
+    cleared = level.data[i] == 0.0f;
+  }
+
+  Blender *pinned = create_blender(MULTIBAND, rect, 3);
+  feed_stripes(pinned, 0, 2);
+  blend(pinned);
+
+  // a worker takes the tasks of its node, then those of any, then steals
+  int node = get_worker_node(0, 1);
+  int nodes[3] = {1, -1, 0};
+  int order[4] = {0, 0, 0, 0};
+  TaskGraph *g = create_task_graph();
+  for (int i = 0; i < 3; i++) {
+    set_task_node(g, add_task(g, record_task, order, i), nodes[i]);
+  }
+  int ran = run_task_graph(g, 1);
+  destroy_task_graph(g);
+  int expected[3][3] = {{1, 2, 0}, {2, 1, 0}, {0, 1, 2}};
+  set_numa_nodes_count(0);
+  if (!ran || node < -1 || node > 1 ||
+      memcmp(order, expected[node + 1], sizeof(expected[0]))) {
+    printf("FATAL task graph ignored the node of its tasks\n");
+    exit(1);
+  }
+
+  if (!cleared) {
+    printf("FATAL large image was not first touched by the workers\n");
+    exit(1);
+  }
+  if (!pinned->result.data ||
+      memcmp(reference->result.data, pinned->result.data,
+             image_size(&reference->result))) {
+    printf("FATAL pinned workers changed the blend\n");
+    exit(1);
+  }
+  destroy_image_f(&level);
+  destroy_memory_context(context);
+  destroy_blender(reference);
+  destroy_blender(pinned);
+}
+
+void test_kernel_variants() {
+  const char *variants[] = {"avx2", "avx512"};
+  Image rgb = create_empty_image(75, 41, RGB_CHANNELS);
+  Image gray = create_empty_image(75, 41, GRAY_CHANNELS);
+  for (int p = 0; p < image_size(&rgb); p++) {
+    rgb.data[p] = (p * 37) % 251;
+  }
+  for (int p = 0; p < image_size(&gray); p++) {
+    gray.data[p] = (p * 53) % 241;
+  }
+
+  set_kernel_variant("baseline");
+  Image rgb_ref = downsample(&rgb);
+  Image gray_ref = downsample(&gray);
+
+  for (int v = 0; v < 2; v++) {
+    if (!set_kernel_variant(variants[v]))
+      continue;
+    Image rgb_down = downsample(&rgb);
+    Image gray_down = downsample(&gray);
+    if (memcmp(rgb_down.data, rgb_ref.data, image_size(&rgb_ref)) ||
+        memcmp(gray_down.data, gray_ref.data, image_size(&gray_ref))) {
+      printf("FATAL %s kernels differ from baseline\n", variants[v]);
+      exit(1);
+    }
+    destroy_image(&rgb_down);
+    destroy_image(&gray_down);
+  }
+
+  set_kernel_variant(NULL);
+  destroy_image(&rgb);
+  destroy_image(&gray);
+  destroy_image(&rgb_ref);
+  destroy_image(&gray_ref);
+}
+
 int main() {
 
   Image img_buf1 = create_image("../files/apple.jpeg");
@@ -101,6 +1377,27 @@ int main() {
   save_image(&ds1, "test2.jpg");
 
   test_sampling_operations();
+  test_seam_masks();
+  test_blender_stats();
+  test_blender_memory();
+  test_large_images();
+  test_numa_first_touch();
+  test_kernel_variants();
+  test_rgba_feed();
+  test_gray_blender();
+  test_tiled_blender();
+  test_level_outputs();
+  test_blend_roi();
+  test_wide_blend();
+  test_seam_local();
+  test_deep_zoom();
+  test_jpeg_memory_io();
+  test_jpeg_batch_decode();
+  test_striped_jpeg();
+  test_blender_merge();
+  test_feed_many();
+  test_fusion_blender();
+  test_feed_jpeg();
 
   destroy_image(&img_buf1);
   destroy_image_s(&imgs);
@@ -0,0 +1,236 @@
+#include "tiled_blending.h"
+#include "allocator.h"
+#include "utils.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  TiledBlender *t;
+  TileSink sink;
+  void *user;
+  int tiles_x;
+  int tile_count;
+  int next_tile;
+  int failed;
+  pthread_mutex_t sink_lock;
+  MemoryContext *memory;
+} TileJob;
+
+TiledBlender *create_tiled_blender(StitchRect out_size, int nb, int channels,
+                                   int tile_width, int tile_height) {
+  if (tile_width <= 0 || tile_height <= 0 ||
+      (channels != RGB_CHANNELS && channels != GRAY_CHANNELS)) {
+    fprintf(stderr, "Invalid tiled blender configuration.\n");
+    return NULL;
+  }
+
+  TiledBlender *t = (TiledBlender *)stitch_calloc(1, sizeof(TiledBlender));
+  if (!t)
+    return NULL;
+  t->output_size = out_size;
+  t->num_bands = min(MAX_BANDS, nb);
+  t->channels = channels;
+  t->tile_width = tile_width;
+  t->tile_height = tile_height;
+  t->num_threads = 1;
+  return t;
+}
+
+void destroy_tiled_blender(TiledBlender *t) {
+  if (!t)
+    return;
+  stitch_free(t->inputs);
+  destroy_image(&t->result);
+  stitch_free(t);
+}
+
+int tiled_feed(TiledBlender *t, Image *img, Image *mask, StitchPoint tl) {
+  assert(img->height == mask->height && img->width == mask->width);
+  assert(img->channels == t->channels);
+
+  if (t->num_inputs == t->inputs_capacity) {
+    int capacity = t->inputs_capacity ? t->inputs_capacity * 2 : 8;
+    TiledInput *inputs =
+        (TiledInput *)stitch_malloc(capacity * sizeof(TiledInput));
+    if (!inputs)
+      return 0;
+    if (t->inputs)
+      memcpy(inputs, t->inputs, t->num_inputs * sizeof(TiledInput));
+    stitch_free(t->inputs);
+    t->inputs = inputs;
+    t->inputs_capacity = capacity;
+  }
+
+  TiledInput input = {img, mask, tl};
+  t->inputs[t->num_inputs++] = input;
+  return 1;
+}
+
+static Image copy_region(const Image *img, int x, int y, int width,
+                         int height) {
+  Image region = create_empty_image(width, height, img->channels);
+  if (!region.data)
+    return region;
+
+  for (int row = 0; row < height; row++) {
+    memcpy(region.data + (size_t)row * width * img->channels,
+           img->data + ((size_t)(y + row) * img->width + x) * img->channels,
+           (size_t)width * img->channels);
+  }
+  return region;
+}
+
+static StitchRect tile_rect(const TiledBlender *t, int index, int tiles_x) {
+  StitchRect core;
+  core.x = t->output_size.x + (index % tiles_x) * t->tile_width;
+  core.y = t->output_size.y + (index / tiles_x) * t->tile_height;
+  core.width = min(t->tile_width, t->output_size.x + t->output_size.width -
+                                      core.x);
+  core.height = min(t->tile_height, t->output_size.y +
+                                        t->output_size.height - core.y);
+  return core;
+}
+
+/*
+ * The tile plus its halo, both ends on the coarsest level's grid. The
+ * halo is as far as any filter of the pyramid carries a weight, so the
+ * cut inputs do not reach the core and it comes out as in a full blend.
+ */
+static StitchRect halo_rect(const TiledBlender *t, StitchRect core) {
+  int halo = 5 << t->num_bands;
+  int grid = (1 << t->num_bands) - 1;
+  StitchPoint canvas_br = br(t->output_size);
+
+  int x0 = max(0, core.x - halo - t->output_size.x) & ~grid;
+  int y0 = max(0, core.y - halo - t->output_size.y) & ~grid;
+  int x1 = (core.x + core.width + halo - t->output_size.x + grid) & ~grid;
+  int y1 = (core.y + core.height + halo - t->output_size.y + grid) & ~grid;
+
+  StitchRect area;
+  area.x = t->output_size.x + x0;
+  area.y = t->output_size.y + y0;
+  area.width = min(canvas_br.x, t->output_size.x + x1) - area.x;
+  area.height = min(canvas_br.y, t->output_size.y + y1) - area.y;
+  return area;
+}
+
+// blends the inputs clipped to the halo area and cuts the core out of it
+static Image blend_tile(TiledBlender *t, StitchRect core) {
+  Image tile = {NULL, 0, 0, 0};
+  StitchRect area = halo_rect(t, core);
+  Blender *b =
+      create_blender_with_channels(MULTIBAND, area, t->num_bands, t->channels);
+  if (!b)
+    return tile;
+
+  int fed = 1;
+  for (int i = 0; i < t->num_inputs && fed; i++) {
+    const TiledInput *in = &t->inputs[i];
+    int x0 = max(area.x, in->tl.x);
+    int y0 = max(area.y, in->tl.y);
+    int x1 = min(area.x + area.width, in->tl.x + in->img->width);
+    int y1 = min(area.y + area.height, in->tl.y + in->img->height);
+    if (x1 <= x0 || y1 <= y0)
+      continue;
+
+    Image img = copy_region(in->img, x0 - in->tl.x, y0 - in->tl.y, x1 - x0,
+                            y1 - y0);
+    Image mask = copy_region(in->mask, x0 - in->tl.x, y0 - in->tl.y,
+                             x1 - x0, y1 - y0);
+    StitchPoint tl = {x0, y0};
+    fed = img.data && mask.data && feed(b, &img, &mask, tl);
+    destroy_image(&img);
+    destroy_image(&mask);
+  }
+
+  if (fed) {
+    blend(b);
+    if (b->result.data) {
+      tile = copy_region(&b->result, core.x - area.x, core.y - area.y,
+                         core.width, core.height);
+    }
+  }
+  destroy_blender(b);
+  return tile;
+}
+
+static void *tile_worker(void *args) {
+  TileJob *job = (TileJob *)args;
+  memory_activate(job->memory);
+
+  for (;;) {
+    int index = __atomic_fetch_add(&job->next_tile, 1, __ATOMIC_RELAXED);
+    if (index >= job->tile_count ||
+        __atomic_load_n(&job->failed, __ATOMIC_RELAXED))
+      break;
+
+    StitchRect core = tile_rect(job->t, index, job->tiles_x);
+    Image tile = blend_tile(job->t, core);
+    int ok = tile.data != NULL;
+    if (ok) {
+      pthread_mutex_lock(&job->sink_lock);
+      ok = job->sink(job->user, &tile, core);
+      pthread_mutex_unlock(&job->sink_lock);
+    }
+    destroy_image(&tile);
+    if (!ok)
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+static int assemble_tile(void *user, const Image *tile, StitchRect rect) {
+  TiledBlender *t = (TiledBlender *)user;
+  int x = rect.x - t->output_size.x;
+  int y = rect.y - t->output_size.y;
+  for (int row = 0; row < tile->height; row++) {
+    memcpy(t->result.data +
+               ((size_t)(y + row) * t->result.width + x) * t->channels,
+           tile->data + (size_t)row * tile->width * t->channels,
+           (size_t)tile->width * t->channels);
+  }
+  return 1;
+}
+
+int tiled_blend(TiledBlender *t, TileSink sink, void *user) {
+  if (!sink) {
+    destroy_image(&t->result);
+    t->result = create_empty_image(t->output_size.width,
+                                   t->output_size.height, t->channels);
+    if (!t->result.data)
+      return 0;
+    sink = assemble_tile;
+    user = t;
+  }
+
+  TileJob job;
+  job.t = t;
+  job.sink = sink;
+  job.user = user;
+  job.tiles_x = (t->output_size.width + t->tile_width - 1) / t->tile_width;
+  job.tile_count = job.tiles_x * ((t->output_size.height + t->tile_height - 1) /
+                                  t->tile_height);
+  job.next_tile = 0;
+  job.failed = 0;
+  job.memory = memory_active();
+  pthread_mutex_init(&job.sink_lock, NULL);
+
+  int num_threads = clamp(t->num_threads, 1, max(job.tile_count, 1));
+  if (num_threads == 1) {
+    tile_worker(&job);
+  } else {
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+      pthread_create(&threads[i], NULL, tile_worker, &job);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  pthread_mutex_destroy(&job.sink_lock);
+  return !job.failed;
+}
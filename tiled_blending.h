@@ -0,0 +1,60 @@
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef TILED_BLENDING_HEADERS
+#define TILED_BLENDING_HEADERS
+
+#include "blending.h"
+
+/*
+ * Multiband blending in canvas tiles. Each tile is blended on its own with
+ * a halo of 5 * 2^num_bands pixels, rounded out to the coarsest level's
+ * grid, fed only from the inputs that reach it, so peak memory follows the
+ * tile size instead of the canvas size. Any tile size gives the pixels of
+ * a full-canvas blend.
+ */
+
+// receives every finished tile in canvas coordinates, returns 0 to abort
+typedef int (*TileSink)(void *user, const Image *tile, StitchRect rect);
+
+typedef struct
+{
+    Image *img;
+    Image *mask;
+    StitchPoint tl;
+} TiledInput;
+
+typedef struct
+{
+    StitchRect output_size;
+    int num_bands;
+    int channels;
+    int tile_width;
+    int tile_height;
+    int num_threads;
+    TiledInput *inputs;
+    int num_inputs;
+    int inputs_capacity;
+    Image result;
+} TiledBlender;
+
+TiledBlender *create_tiled_blender(StitchRect out_size, int nb, int channels,
+                                   int tile_width, int tile_height);
+void destroy_tiled_blender(TiledBlender *t);
+
+// the images are only referenced and must stay alive until tiled_blend
+int tiled_feed(TiledBlender *t, Image *img, Image *mask, StitchPoint tl);
+
+/*
+ * Blends tile by tile, num_threads tiles at a time, and hands each one to
+ * sink. Calls to sink are serialized. With a NULL sink the tiles are
+ * assembled into t->result instead.
+ */
+int tiled_blend(TiledBlender *t, TileSink sink, void *user);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,9 +1,16 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #if defined(_WIN32) || defined(_WIN64)
 #include <windows.h>
 #elif defined(__linux__) || defined(__APPLE__) || defined(__unix__)
 #include <unistd.h>
 #endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 int get_no_of_cpu()
 {
@@ -18,11 +25,161 @@ int get_no_of_cpu()
 #endif
 }
 
+static int cpus_count_override = 0;
+
+void set_cpus_count(int count)
+{
+    cpus_count_override = count > 0 ? count : 0;
+}
+
 int get_cpus_count()
 {
+    if (cpus_count_override > 0)
+    {
+        return cpus_count_override;
+    }
     return (get_no_of_cpu() / 2) + 1;
 }
 
+#define MAX_NUMA_NODES 64
+#define MAX_WORKER_CPUS 1024
+
+static int numa_nodes_override = 0;
+static int numa_nodes = 1;
+// the CPUs this process may run on, node by node
+static int node_cpus[MAX_WORKER_CPUS];
+// the node of each entry of node_cpus, counting only nodes with allowed CPUs
+static int cpu_nodes[MAX_WORKER_CPUS];
+static int node_cpus_count = 0;
+
+#if defined(__linux__)
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+// appends the allowed CPUs of a sysfs cpulist such as "0-15,32-47"
+static int read_cpu_list(FILE *file, const cpu_set_t *allowed, int node)
+{
+    int found = 0;
+    int first, last;
+    while (fscanf(file, "%d", &first) == 1)
+    {
+        last = first;
+        int separator = fgetc(file);
+        if (separator == '-')
+        {
+            if (fscanf(file, "%d", &last) != 1)
+                break;
+            separator = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, allowed) && node_cpus_count < MAX_WORKER_CPUS)
+            {
+                cpu_nodes[node_cpus_count] = node;
+                node_cpus[node_cpus_count++] = cpu;
+                found = 1;
+            }
+        }
+        if (separator != ',')
+            break;
+    }
+    return found;
+}
+
+static void read_numa_layout(void)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+
+    int nodes = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+        nodes += read_cpu_list(file, &allowed, nodes);
+        fclose(file);
+    }
+    numa_nodes = nodes > 0 ? nodes : 1;
+}
+#endif
+
+void set_numa_nodes_count(int count)
+{
+    numa_nodes_override = count > 0 ? count : 0;
+}
+
+int get_numa_nodes_count()
+{
+    if (numa_nodes_override > 0)
+    {
+        return numa_nodes_override;
+    }
+#if defined(__linux__)
+    pthread_once(&numa_once, read_numa_layout);
+#endif
+    return numa_nodes;
+}
+
+// the entry of node_cpus for a worker, -1 when workers are not pinned
+static int worker_slot(int worker, int workers)
+{
+    if (get_numa_nodes_count() <= 1 || workers <= 0)
+    {
+        return -1;
+    }
+#if defined(__linux__)
+    pthread_once(&numa_once, read_numa_layout);
+#endif
+    if (node_cpus_count == 0)
+    {
+        return -1;
+    }
+    // consecutive workers, and so consecutive rows, stay on one node
+    return (long long)worker * node_cpus_count / workers;
+}
+
+int get_worker_cpu(int worker, int workers)
+{
+    int slot = worker_slot(worker, workers);
+    return slot < 0 ? -1 : node_cpus[slot];
+}
+
+int get_worker_node(int worker, int workers)
+{
+    int slot = worker_slot(worker, workers);
+    return slot < 0 ? -1 : cpu_nodes[slot];
+}
+
+int get_row_node(int row, int rows)
+{
+    int workers = get_cpus_count();
+    if (rows <= 0 || workers <= 0)
+    {
+        return -1;
+    }
+    // the split of parallel_operator, the first rows % workers get one more
+    int per_worker = rows / workers;
+    int longer = rows % workers;
+    int worker = row < longer * (per_worker + 1)
+                     ? row / (per_worker + 1)
+                     : longer + (row - longer * (per_worker + 1)) / per_worker;
+    return get_worker_node(worker, workers);
+}
+
+void pin_thread_to_cpu(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
 int clamp(int value, int min, int max)
 {
     if (value < min)
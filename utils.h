@@ -3,7 +3,27 @@ extern "C" {
 #endif
 
 
+int get_no_of_cpu();
 int get_cpus_count();
+void set_cpus_count(int count);
+
+/*
+ * On hosts with more than one NUMA node the workers of parallel_operator
+ * and of task graphs are pinned, worker i of n to the i-th n-th of the
+ * allowed CPUs taken node by node. Large images are first touched by the
+ * parallel_operator workers, a range of rows each, and task graphs run the
+ * tiles of those rows on workers of the same node where they can.
+ * set_numa_nodes_count overrides the detected count, 1 turns all of it off.
+ */
+int get_numa_nodes_count();
+void set_numa_nodes_count(int count);
+// the CPU worker should be pinned to, -1 for none
+int get_worker_cpu(int worker, int workers);
+// the node of that CPU, -1 for none
+int get_worker_node(int worker, int workers);
+// the node whose worker first touched row of a large image, -1 for none
+int get_row_node(int row, int rows);
+void pin_thread_to_cpu(int cpu);
 int clamp(int value, int min, int max) ;
 int min(int a , int b);
 int max(int a , int b);